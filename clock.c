@@ -0,0 +1,80 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <time.h>
+
+#include "natpmpd.h"
+
+/*
+ * The daemon's idea of the time.  The clock is read once at the start of
+ * each event that needs it and everything handled in that event uses the
+ * same reading, so a batch of requests costs one clock call rather than
+ * a few per request.
+ *
+ * It's monotonic, anchored to the wall clock when the daemon starts.
+ * Expiry times are kept in the resulting seconds, which look enough like
+ * the wall clock to still mean something in the rule labels and the
+ * snapshot after a restart, but stepping the clock while running moves
+ * neither an expiry nor the seconds since the epoch.  Going backwards
+ * would otherwise tell every client we had rebooted, and have them all
+ * map their ports again at once.
+ */
+
+static struct timespec	 clock_start, clock_mono;
+static time_t		 clock_wall;
+
+void
+init_clock(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &clock_start);
+	clock_mono = clock_start;
+	clock_wall = time(NULL);
+}
+
+const struct timespec *
+clock_update(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &clock_mono);
+
+	return (&clock_mono);
+}
+
+/* Seconds, for expiry times */
+time_t
+clock_now(void)
+{
+	return (clock_wall + (clock_mono.tv_sec - clock_start.tv_sec));
+}
+
+/* Only differences are of interest, so it's fine for this to wrap */
+u_int32_t
+clock_msec(void)
+{
+	return (clock_mono.tv_sec * 1000 + clock_mono.tv_nsec / 1000000);
+}
+
+u_int32_t
+sssoe(struct natpmpd *env)
+{
+	return (clock_mono.tv_sec - clock_start.tv_sec);
+}
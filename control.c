@@ -0,0 +1,458 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ * Copyright (c) 2003, 2004 Henning Brauer <henning@openbsd.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "natpmpd.h"
+
+/*
+ * The control socket, served by the parent.  natpmpctl(8) can read the
+ * counters kept by every process and list or flush the mappings.  The
+ * counters from the other processes are fetched on demand and relayed
+ * as they arrive, the client adds them up.
+ *
+ * A client can also ask to monitor the mappings, after which it is sent
+ * every event as it happens.  Events are gathered up and sent on to each
+ * monitor a batch at a time, once whatever caused them is done with or
+ * when a batch fills.  Nothing is ever waited for, a monitor that falls
+ * too far behind has events dropped and is told how many once it has
+ * caught up.
+ */
+
+#define CONTROL_BACKLOG	 5
+#define CONTROL_EVENT_MAX ((MAX_IMSGSIZE - IMSG_HEADER_SIZE) / \
+			    sizeof(struct ctl_event) - 1)	/* per batch */
+#define CONTROL_MONITOR_QUEUE 64	/* batches waiting for a monitor */
+
+struct ctl_conn {
+	TAILQ_ENTRY(ctl_conn)	 entry;
+	struct imsgev		 iev;
+	u_int			 pending;
+	u_int8_t		 monitor;
+	u_int32_t		 dropped;
+};
+
+void		 control_accept(int, short, void *);
+struct ctl_conn	*control_connbyfd(int);
+void		 control_dispatch_imsg(int, short, void *);
+void		 control_show_stats(struct natpmpd *, struct ctl_conn *);
+void		 control_show_mappings(struct ctl_conn *);
+void		 control_end(struct ctl_conn *);
+void		 control_free(struct ctl_conn *);
+void		 control_monitor(struct ctl_conn *);
+void		 control_flush_events(int, short, void *);
+
+TAILQ_HEAD(, ctl_conn)	 ctl_conns = TAILQ_HEAD_INITIALIZER(ctl_conns);
+
+struct {
+	struct event	 ev;
+	int		 fd;
+	u_int		 monitors;
+	struct event	 flush_ev;
+} control_state = { .fd = -1 };
+
+/* The first is kept for saying how many were dropped before the rest */
+static struct ctl_event	 events[1 + CONTROL_EVENT_MAX];
+static u_int		 nevents;
+
+/* Needs to happen before the chroot, the socket lives outside of it */
+int
+control_init(void)
+{
+	struct sockaddr_un	 sun;
+	int			 fd;
+	mode_t			 old_umask;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		log_warn("control_init: socket");
+		return (-1);
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, NATPMPD_SOCKET, sizeof(sun.sun_path));
+
+	if (unlink(NATPMPD_SOCKET) == -1 && errno != ENOENT) {
+		log_warn("control_init: unlink %s", NATPMPD_SOCKET);
+		close(fd);
+		return (-1);
+	}
+
+	old_umask = umask(S_IXUSR|S_IXGRP|S_IWOTH|S_IROTH|S_IXOTH);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		log_warn("control_init: bind: %s", NATPMPD_SOCKET);
+		close(fd);
+		umask(old_umask);
+		return (-1);
+	}
+	umask(old_umask);
+
+	if (chmod(NATPMPD_SOCKET, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) == -1) {
+		log_warn("control_init: chmod");
+		close(fd);
+		(void)unlink(NATPMPD_SOCKET);
+		return (-1);
+	}
+
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+		log_warn("control_init: fcntl");
+		close(fd);
+		(void)unlink(NATPMPD_SOCKET);
+		return (-1);
+	}
+
+	control_state.fd = fd;
+
+	return (0);
+}
+
+int
+control_listen(struct natpmpd *env)
+{
+	if (listen(control_state.fd, CONTROL_BACKLOG) == -1) {
+		log_warn("control_listen: listen");
+		return (-1);
+	}
+
+	event_set(&control_state.ev, control_state.fd, EV_READ|EV_PERSIST,
+	    control_accept, env);
+	event_add(&control_state.ev, NULL);
+	evtimer_set(&control_state.flush_ev, control_flush_events, NULL);
+
+	return (0);
+}
+
+/* For the other processes, which have no use for the socket */
+void
+control_close(void)
+{
+	if (control_state.fd != -1) {
+		close(control_state.fd);
+		control_state.fd = -1;
+	}
+}
+
+void
+control_accept(int listenfd, short event, void *arg)
+{
+	struct natpmpd		*env = (struct natpmpd *)arg;
+	struct sockaddr_un	 sun;
+	struct ctl_conn		*c;
+	socklen_t		 len;
+	int			 connfd;
+
+	len = sizeof(sun);
+	if ((connfd = accept(listenfd, (struct sockaddr *)&sun,
+	    &len)) == -1) {
+		if (errno != EWOULDBLOCK && errno != EINTR)
+			log_warn("control_accept: accept");
+		return;
+	}
+
+	if (fcntl(connfd, F_SETFL, O_NONBLOCK) == -1) {
+		log_warn("control_accept: fcntl");
+		close(connfd);
+		return;
+	}
+
+	if ((c = calloc(1, sizeof(struct ctl_conn))) == NULL) {
+		log_warn("control_accept");
+		close(connfd);
+		return;
+	}
+
+	imsg_init(&c->iev.ibuf, connfd);
+	c->iev.handler = control_dispatch_imsg;
+	c->iev.data = env;
+	c->iev.events = EV_READ;
+	event_set(&c->iev.ev, c->iev.ibuf.fd, c->iev.events,
+	    c->iev.handler, c->iev.data);
+	event_add(&c->iev.ev, NULL);
+
+	TAILQ_INSERT_TAIL(&ctl_conns, c, entry);
+}
+
+struct ctl_conn *
+control_connbyfd(int fd)
+{
+	struct ctl_conn	*c;
+
+	TAILQ_FOREACH(c, &ctl_conns, entry)
+		if (c->iev.ibuf.fd == fd)
+			break;
+
+	return (c);
+}
+
+void
+control_free(struct ctl_conn *c)
+{
+	msgbuf_clear(&c->iev.ibuf.w);
+	TAILQ_REMOVE(&ctl_conns, c, entry);
+	if (c->monitor)
+		control_state.monitors--;
+
+	event_del(&c->iev.ev);
+	close(c->iev.ibuf.fd);
+	free(c);
+}
+
+void
+control_dispatch_imsg(int fd, short event, void *arg)
+{
+	struct natpmpd	*env = (struct natpmpd *)arg;
+	struct ctl_conn	*c;
+	struct imsg	 imsg;
+	ssize_t		 n;
+
+	if ((c = control_connbyfd(fd)) == NULL) {
+		log_warnx("control_dispatch_imsg: fd %d not found", fd);
+		return;
+	}
+
+	if (event & EV_READ) {
+		if (((n = imsg_read(&c->iev.ibuf)) == -1 && errno != EAGAIN) ||
+		    n == 0) {
+			control_free(c);
+			return;
+		}
+	}
+	if (event & EV_WRITE) {
+		if (((n = msgbuf_write(&c->iev.ibuf.w)) == -1 &&
+		    errno != EAGAIN) || n == 0) {
+			control_free(c);
+			return;
+		}
+	}
+
+	for (;;) {
+		if ((n = imsg_get(&c->iev.ibuf, &imsg)) == -1) {
+			control_free(c);
+			return;
+		}
+		if (n == 0)
+			break;
+
+		switch (imsg.hdr.type) {
+		case IMSG_CTL_SHOW_STATS:
+			control_show_stats(env, c);
+			break;
+		case IMSG_CTL_SHOW_MAPPINGS:
+			control_show_mappings(c);
+			break;
+		case IMSG_CTL_FLUSH_MAPPINGS:
+			log_info("flushed %u mappings on request",
+			    flush_mappings(env));
+			control_end(c);
+			break;
+		case IMSG_CTL_MONITOR:
+			control_monitor(c);
+			break;
+		default:
+			log_debug("control_dispatch_imsg: "
+			    "error handling imsg %d", imsg.hdr.type);
+			break;
+		}
+		imsg_free(&imsg);
+	}
+
+	imsg_event_add(&c->iev);
+}
+
+/*
+ * Send our own counters straight away and ask every other process for
+ * theirs, the connection is identified by its descriptor.
+ */
+void
+control_show_stats(struct natpmpd *env, struct ctl_conn *c)
+{
+	struct imsgev	*iev;
+	u_int		 i;
+
+	imsg_compose(&c->iev.ibuf, IMSG_CTL_STATS, 0, 0, -1, &stats,
+	    sizeof(stats));
+
+	for (i = 0; i <= env->sc_workers; i++) {
+		iev = (i == env->sc_workers) ? env->sc_iev_pfe :
+		    &env->sc_iev_workers[i];
+		if (imsg_compose(&iev->ibuf, IMSG_STATS, c->iev.ibuf.fd, 0,
+		    -1, NULL, 0) == -1)
+			continue;
+		imsg_event_add(iev);
+		c->pending++;
+	}
+
+	if (c->pending == 0)
+		control_end(c);
+}
+
+void
+control_relay_stats(struct imsg *imsg)
+{
+	struct ctl_conn	*c;
+
+	if (imsg->hdr.len != IMSG_HEADER_SIZE + sizeof(stats))
+		fatalx("control_relay_stats: invalid stats");
+
+	/* Whoever asked might have gone away already */
+	if ((c = control_connbyfd(imsg->hdr.peerid)) == NULL ||
+	    c->pending == 0)
+		return;
+
+	imsg_compose(&c->iev.ibuf, IMSG_CTL_STATS, 0, 0, -1, imsg->data,
+	    sizeof(stats));
+	if (--c->pending == 0)
+		control_end(c);
+	else
+		imsg_event_add(&c->iev);
+}
+
+void
+control_show_mappings(struct ctl_conn *c)
+{
+	struct mapping		*m;
+	struct ctl_mapping	 cm;
+	time_t			 now;
+
+	clock_update();
+	now = clock_now();
+	for (m = first_mapping(); m != NULL; m = next_mapping(m)) {
+		memset(&cm, 0, sizeof(cm));
+		cm.id = get_mapping_info(m)->id;
+		cm.proto = m->proto;
+		get_mapping_addr(m, &cm.addr);
+		cm.lifetime = (m->expires > now) ? m->expires - now : 0;
+
+		imsg_compose(&c->iev.ibuf, IMSG_CTL_MAPPING, 0, 0, -1, &cm,
+		    sizeof(cm));
+	}
+
+	control_end(c);
+}
+
+void
+control_end(struct ctl_conn *c)
+{
+	imsg_compose(&c->iev.ibuf, IMSG_CTL_END, 0, 0, -1, NULL, 0);
+	imsg_event_add(&c->iev);
+}
+
+/* Events go to this client from now on, for as long as it's connected */
+void
+control_monitor(struct ctl_conn *c)
+{
+	if (c->monitor)
+		return;
+
+	c->monitor = 1;
+	control_state.monitors++;
+}
+
+/*
+ * Somewhere to put the next event, or NULL if nobody is monitoring and it
+ * isn't worth filling in.  The batch goes out once the current event has
+ * been handled, or straight away here if it's full.
+ */
+struct ctl_event *
+control_event(u_int8_t type)
+{
+	struct timeval		 tv = { 0, 0 };
+	struct ctl_event	*ev;
+
+	if (control_state.monitors == 0)
+		return (NULL);
+
+	if (nevents == CONTROL_EVENT_MAX)
+		control_flush_events(0, 0, NULL);
+	if (nevents == 0)
+		evtimer_add(&control_state.flush_ev, &tv);
+
+	ev = &events[1 + nevents++];
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->time = clock_now();
+	stats.events++;
+
+	return (ev);
+}
+
+/*
+ * Queue the batch for every monitor, unless it already has more than
+ * enough waiting for it, then the batch is dropped rather than letting
+ * the queue grow.  A monitor that has had events dropped is told how
+ * many, ahead of the next batch it does get.
+ */
+void
+control_flush_events(int fd, short event, void *arg)
+{
+	struct ctl_conn		*c;
+	struct ctl_event	*ev;
+	u_int			 n;
+
+	if (evtimer_pending(&control_state.flush_ev, NULL))
+		evtimer_del(&control_state.flush_ev);
+	if (nevents == 0)
+		return;
+
+	TAILQ_FOREACH(c, &ctl_conns, entry) {
+		if (!c->monitor)
+			continue;
+		if (c->iev.ibuf.w.queued >= CONTROL_MONITOR_QUEUE) {
+			c->dropped += nevents;
+			stats.events_dropped += nevents;
+			continue;
+		}
+
+		ev = &events[1];
+		n = nevents;
+		if (c->dropped > 0) {
+			ev = &events[0];
+			memset(ev, 0, sizeof(*ev));
+			ev->type = EVENT_DROPPED;
+			ev->time = clock_now();
+			ev->count = c->dropped;
+			n++;
+		}
+		if (imsg_compose(&c->iev.ibuf, IMSG_CTL_EVENT, 0, 0, -1, ev,
+		    n * sizeof(*ev)) == -1) {
+			c->dropped += nevents;
+			stats.events_dropped += nevents;
+			continue;
+		}
+		c->dropped = 0;
+		imsg_event_add(&c->iev);
+	}
+	nevents = 0;
+}
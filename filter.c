@@ -29,58 +29,321 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 
 #include "natpmpd.h"
 
-int add_addr(struct sockaddr *, struct pf_pool *);
-int prepare_rule(u_int8_t, struct sockaddr *);
+int add_addr(struct in_addr *, struct pf_pool *);
+int append_anchor(const char *);
+int prepare_rule(int, struct pfe_change *);
+int read_rule(const char *, u_int32_t, void (*)(struct pfe_change *));
+void anchor_limit(const char *);
+
+int pf_init(struct natpmpd *);
+int pf_prepare_commit(void);
+int pf_add_anchor(const char *);
+int pf_flush_anchors(void);
+int pf_read_anchors(void (*)(struct pfe_change *));
+int pf_begin_commit(void);
+int pf_add_rule(int, struct pfe_change *);
+int pf_do_commit(void);
+int pf_do_rollback(void);
+
+/*
+ * Everything the pf process does to the ruleset goes through one of
+ * these, pf itself or a stand-in for it.
+ */
+static const struct filter_backend pf_backend = {
+	"pf",
+	pf_init,
+	pf_prepare_commit,
+	pf_add_anchor,
+	pf_flush_anchors,
+	pf_read_anchors,
+	pf_begin_commit,
+	pf_add_rule,
+	pf_do_commit,
+	pf_do_rollback
+};
+
+static const struct filter_backend *const backends[] = {
+	[FILTER_PF] =		&pf_backend,
+	[FILTER_MEMORY] =	&mem_backend
+};
+
+static const struct filter_backend *backend = &pf_backend;
 
 static struct pfioc_rule pfr;
 static struct pfioc_trans pft;
-static struct pfioc_trans_e pfte;
-static int dev, rule_log;
+static struct pfioc_trans_e *pfte;
+static int pfte_size;
+static int dev, rule_log, group_rules;
 static char *qname, *tagname;
 
 int
-add_addr(struct sockaddr *addr, struct pf_pool *pfp)
+add_addr(struct in_addr *addr, struct pf_pool *pfp)
 {
-	if (addr->sa_family == AF_INET) {
-		memcpy(&pfp->addr.v.a.addr.v4,
-		    &((struct sockaddr_in *)addr)->sin_addr.s_addr, 4);
-		memset(&pfp->addr.v.a.mask.addr8, 255, 4);
-	}
+	memcpy(&pfp->addr.v.a.addr.v4, &addr->s_addr, 4);
+	memset(&pfp->addr.v.a.mask.addr8, 255, 4);
 	pfp->addr.type = PF_ADDR_ADDRMASK;
 	return (0);
 }
 
+/*
+ * Mappings live in sub-anchors, "natpmpd/<id>" for one each or a group of
+ * them in one, so a change only has to replace that one ruleset rather
+ * than every rule in the anchor.  A transaction is built up by adding one
+ * element per sub-anchor being replaced; any sub-anchor with no rules
+ * added to it before the commit is left empty and pf removes it.
+ */
 int
-add_rdr(u_int8_t proto, struct sockaddr *dst, struct sockaddr *rdr)
+append_anchor(const char *anchor)
 {
-	if (dst->sa_family != rdr->sa_family) {
-		errno = EINVAL;
+	struct pfioc_trans_e	*e;
+	int			 size;
+
+	if (pft.size == pfte_size) {
+		size = pfte_size ? pfte_size * 2 : 16;
+		if ((e = reallocarray(pfte, size, sizeof(*pfte))) == NULL)
+			return (-1);
+		pfte = pft.array = e;
+		pfte_size = size;
+	}
+
+	e = &pfte[pft.size];
+	memset(e, 0, sizeof(*e));
+	if (strlcpy(e->anchor, anchor, sizeof(e->anchor)) >=
+	    sizeof(e->anchor)) {
+		errno = ENAMETOOLONG;
 		return (-1);
 	}
+	e->type = PF_TRANS_RULESET;
+
+	return (pft.size++);
+}
+
+/*
+ * pf has nothing better than EINVAL to say it couldn't make a sub-anchor,
+ * which with one per mapping is most likely its anchor limit.  Say so,
+ * the cure is in pf.conf or ours rather than anything natpmpd can do.
+ */
+void
+anchor_limit(const char *what)
+{
+	int	 saved_errno = errno;
+
+	if (errno == EINVAL && !group_rules &&
+	    log_check(LOGC_RULESET, LOG_CRIT))
+		log_warnx("%s: pf refused a sub-anchor, there may be more "
+		    "mappings than its anchor limit allows, raise \"set limit "
+		    "anchors\" in pf.conf or use \"group rules\"", what);
+	errno = saved_errno;
+}
+
+int
+pf_add_anchor(const char *name)
+{
+	char	 anchor[PATH_MAX];
+
+	snprintf(anchor, sizeof(anchor), "%s/%s", NATPMPD_ANCHOR, name);
+
+	return (append_anchor(anchor));
+}
+
+/*
+ * Add every sub-anchor currently loaded beneath ours, plus the anchor
+ * itself, to the transaction so that committing leaves nothing behind
+ * other than the rules added to it.  This is only used for the full
+ * rebuild at startup and shutdown.
+ */
+int
+pf_flush_anchors(void)
+{
+	struct pfioc_ruleset	 pr;
+	char			 anchor[PATH_MAX];
+	u_int32_t		 i, nr;
+	int			 j;
+
+	memset(&pr, 0, sizeof(pr));
+	strlcpy(pr.path, NATPMPD_ANCHOR, sizeof(pr.path));
+	stats.ioctls++;
+	if (ioctl(dev, DIOCGETRULESETS, &pr) == -1) {
+		/* Nothing has ever been loaded beneath our anchor */
+		if (errno != ENOENT && errno != EINVAL)
+			return (-1);
+		pr.nr = 0;
+	}
+
+	for (i = 0, nr = pr.nr; i < nr; i++) {
+		pr.nr = i;
+		stats.ioctls++;
+		if (ioctl(dev, DIOCGETRULESET, &pr) == -1)
+			return (-1);
+		snprintf(anchor, sizeof(anchor), "%s/%s", NATPMPD_ANCHOR,
+		    pr.name);
+
+		/* Skip any sub-anchor already part of this transaction */
+		for (j = 0; j < pft.size; j++)
+			if (strcmp(pfte[j].anchor, anchor) == 0)
+				break;
+		if (j < pft.size)
+			continue;
+
+		if (append_anchor(anchor) == -1)
+			return (-1);
+	}
 
-	if (prepare_rule(proto, dst) == -1)
+	if (append_anchor(NATPMPD_ANCHOR) == -1)
 		return (-1);
 
-	if (add_addr(rdr, &pfr.rule.rdr) == -1)
+	return (0);
+}
+
+/*
+ * Read back every mapping loaded beneath our anchor, as left behind by
+ * an earlier run, passing each one to the callback.  Rules without an
+ * expiry in their label are ignored, they'll be flushed along with
+ * everything else.  Sub-anchors holding a group of mappings have no id
+ * in their name, but the parent hands out new ids anyway.
+ */
+int
+pf_read_anchors(void (*cb)(struct pfe_change *))
+{
+	struct pfioc_ruleset	 pr;
+	char			 anchor[PATH_MAX];
+	const char		*errstr;
+	u_int32_t		 i, id, nr;
+
+	memset(&pr, 0, sizeof(pr));
+	strlcpy(pr.path, NATPMPD_ANCHOR, sizeof(pr.path));
+	stats.ioctls++;
+	if (ioctl(dev, DIOCGETRULESETS, &pr) == -1) {
+		if (errno != ENOENT && errno != EINVAL)
+			return (-1);
+		return (0);
+	}
+
+	for (i = 0, nr = pr.nr; i < nr; i++) {
+		pr.nr = i;
+		stats.ioctls++;
+		if (ioctl(dev, DIOCGETRULESET, &pr) == -1)
+			return (-1);
+
+		id = strtonum(pr.name, 0, UINT_MAX, &errstr);
+		if (errstr != NULL)
+			id = 0;
+
+		snprintf(anchor, sizeof(anchor), "%s/%s", NATPMPD_ANCHOR,
+		    pr.name);
+		if (read_rule(anchor, id, cb) == -1)
+			return (-1);
+	}
+
+	return (0);
+}
+
+int
+read_rule(const char *anchor, u_int32_t id, void (*cb)(struct pfe_change *))
+{
+	struct pfioc_rule	 pr;
+	struct pfe_change	 c;
+	const char		*errstr;
+	char			*p;
+	u_int32_t		 i, nr, uplink;
+	time_t			 expires;
+
+	memset(&pr, 0, sizeof(pr));
+	strlcpy(pr.anchor, anchor, sizeof(pr.anchor));
+	pr.rule.action = PF_PASS;
+	stats.ioctls++;
+	if (ioctl(dev, DIOCGETRULES, &pr) == -1)
 		return (-1);
 
+	for (i = 0, nr = pr.nr; i < nr; i++) {
+		pr.nr = i;
+		stats.ioctls++;
+		if (ioctl(dev, DIOCGETRULE, &pr) == -1)
+			return (-1);
+
+		/* An IPv4 redirect, or an IPv6 pinhole */
+		if (!(pr.rule.af == AF_INET &&
+		    pr.rule.rdr.addr.type == PF_ADDR_ADDRMASK) &&
+		    !(pr.rule.af == AF_INET6 &&
+		    pr.rule.rdr.addr.type == PF_ADDR_NONE))
+			continue;
+
+		/* "<expires>:<uplink>", older rules have no uplink */
+		uplink = 0;
+		errstr = NULL;
+		if ((p = strchr(pr.rule.label, ':')) != NULL) {
+			*p++ = '\0';
+			uplink = strtonum(p, 0, NATPMPD_MAX_UPLINKS - 1,
+			    &errstr);
+		}
+		if (errstr == NULL)
+			expires = strtonum(pr.rule.label, 1, LLONG_MAX,
+			    &errstr);
+		if (errstr != NULL)
+			continue;
+
+		memset(&c, 0, sizeof(c));
+		c.id = id;
+		c.proto = pr.rule.proto;
+		c.uplink = uplink;
+		c.expires = expires;
+		c.addr.ma_af = pr.rule.af;
+		c.addr.ma_dst_port = pr.rule.dst.port[0];
+		if (pr.rule.af == AF_INET) {
+			memcpy(&c.addr.ma_dst, &pr.rule.dst.addr.v.a.addr.v4,
+			    4);
+			memcpy(&c.addr.ma_rdr, &pr.rule.rdr.addr.v.a.addr.v4,
+			    4);
+			c.addr.ma_rdr_port = htons(pr.rule.rdr.proxy_port[0]);
+		} else {
+			memcpy(&c.addr.ma_addr6,
+			    &pr.rule.dst.addr.v.a.addr.v6, 16);
+			c.addr.ma_rdr_port = pr.rule.dst.port[0];
+		}
+		cb(&c);
+	}
+
+	return (0);
+}
+
+/*
+ * An IPv4 mapping is a pass rule that redirects, an IPv6 pinhole is
+ * just the pass rule.
+ */
+int
+pf_add_rule(int nr, struct pfe_change *c)
+{
+	if (prepare_rule(nr, c) == -1)
+		return (-1);
+
+	if (c->addr.ma_af == AF_INET) {
+		if (add_addr(&c->addr.ma_rdr, &pfr.rule.rdr) == -1)
+			return (-1);
+		pfr.rule.rdr.proxy_port[0] = ntohs(c->addr.ma_rdr_port);
+	}
+
 	pfr.rule.direction = PF_IN;
-	pfr.rule.rdr.proxy_port[0] = ntohs(((struct sockaddr_in *)rdr)->sin_port);
-	if (ioctl(dev, DIOCADDRULE, &pfr) == -1)
+	stats.ioctls++;
+	if (ioctl(dev, DIOCADDRULE, &pfr) == -1) {
+		anchor_limit("DIOCADDRULE");
 		return (-1);
+	}
 
 	return (0);
 }
 
 int
-do_commit(void)
+pf_do_commit(void)
 {
+	stats.ioctls++;
 	if (ioctl(dev, DIOCXCOMMIT, &pft) == -1)
 		return (-1);
 
@@ -88,8 +351,9 @@ do_commit(void)
 }
 
 int
-do_rollback(void)
+pf_do_rollback(void)
 {
+	stats.ioctls++;
 	if (ioctl(dev, DIOCXROLLBACK, &pft) == -1)
 		return (-1);
 
@@ -97,10 +361,9 @@ do_rollback(void)
 }
 
 void
-init_filter(char *opt_qname, char *opt_tagname, int opt_verbose)
+init_filter(struct natpmpd *env, char *opt_qname, char *opt_tagname,
+    int opt_verbose)
 {
-	struct pf_status status;
-
 	qname = opt_qname;
 	tagname = opt_tagname;
 
@@ -109,69 +372,144 @@ init_filter(char *opt_qname, char *opt_tagname, int opt_verbose)
 	else if (opt_verbose == 2)
 		rule_log = PF_LOG_ALL;
 
+	backend = backends[env->sc_filter];
+	if (backend->init(env) == -1)
+		fatal("init_filter");
+}
+
+int
+prepare_commit(void)
+{
+	return (backend->prepare_commit());
+}
+
+int
+add_anchor(const char *name)
+{
+	return (backend->add_anchor(name));
+}
+
+int
+flush_anchors(void)
+{
+	return (backend->flush_anchors());
+}
+
+int
+read_anchors(void (*cb)(struct pfe_change *))
+{
+	return (backend->read_anchors(cb));
+}
+
+int
+begin_commit(void)
+{
+	return (backend->begin_commit());
+}
+
+int
+add_rule(int nr, struct pfe_change *c)
+{
+	return (backend->add_rule(nr, c));
+}
+
+int
+do_commit(void)
+{
+	return (backend->do_commit());
+}
+
+int
+do_rollback(void)
+{
+	return (backend->do_rollback());
+}
+
+int
+pf_init(struct natpmpd *env)
+{
+	struct pf_status status;
+
 	dev = open("/dev/pf", O_RDWR);
 	if (dev == -1)
 		fatal("open /dev/pf");
+	stats.ioctls++;
 	if (ioctl(dev, DIOCGETSTATUS, &status) == -1)
 		fatal("ioctl");
 	if (!status.running)
 		fatalx("pf is disabled");
+	group_rules = env->sc_flags & NATPMPD_F_GROUP_RULES;
+
+	return (0);
 }
 
 int
-prepare_commit(void)
+pf_prepare_commit(void)
 {
 	memset(&pft, 0, sizeof(pft));
-	pft.size = 1;
-	pft.esize = sizeof(pfte);
-	pft.array = &pfte;
+	pft.esize = sizeof(struct pfioc_trans_e);
+	pft.array = pfte;
 
-	memset(&pfte, 0, sizeof(pfte));
-	strlcpy(pfte.anchor, NATPMPD_ANCHOR, PF_ANCHOR_NAME_SIZE);
-	pfte.type = PF_TRANS_RULESET;
+	return (0);
+}
 
-	if (ioctl(dev, DIOCXBEGIN, &pft) == -1)
+int
+pf_begin_commit(void)
+{
+	stats.ioctls++;
+	if (ioctl(dev, DIOCXBEGIN, &pft) == -1) {
+		anchor_limit("DIOCXBEGIN");
 		return (-1);
+	}
 
 	return (0);
 }
 
-
 int
-prepare_rule(u_int8_t proto, struct sockaddr *dst)
+prepare_rule(int nr, struct pfe_change *c)
 {
-	if ((dst->sa_family != AF_INET) ||
-	    (proto != IPPROTO_UDP && proto != IPPROTO_TCP)) {
+	struct mapping_addr	*ma = &c->addr;
+
+	if ((ma->ma_af != AF_INET && ma->ma_af != AF_INET6) ||
+	    (c->proto != IPPROTO_UDP && c->proto != IPPROTO_TCP)) {
 		errno = EPROTONOSUPPORT;
 		return (-1);
 	}
 
+	if (nr < 0 || nr >= pft.size) {
+		errno = EINVAL;
+		return (-1);
+	}
+
 	memset(&pfr, 0, sizeof(pfr));
-	strlcpy(pfr.anchor, NATPMPD_ANCHOR, PF_ANCHOR_NAME_SIZE);
+	strlcpy(pfr.anchor, pfte[nr].anchor, sizeof(pfr.anchor));
 
-	pfr.ticket = pfte.ticket;
+	pfr.ticket = pfte[nr].ticket;
 
 	/* Generic for all rule types. */
-	pfr.rule.af = dst->sa_family;
-	pfr.rule.proto = proto;
+	pfr.rule.af = ma->ma_af;
+	pfr.rule.proto = c->proto;
 	pfr.rule.src.addr.type = PF_ADDR_ADDRMASK;
 	pfr.rule.dst.addr.type = PF_ADDR_ADDRMASK;
 	pfr.rule.nat.addr.type = PF_ADDR_NONE;
 	pfr.rule.rdr.addr.type = PF_ADDR_NONE;
 
-	/*snprintf(label, PF_RULE_LABEL_SIZE, "%ld", expires);
-	strlcpy(pfr.rule.label, label, PF_RULE_LABEL_SIZE);*/
+	/* So the mapping can be picked up again by read_anchors() */
+	snprintf(pfr.rule.label, sizeof(pfr.rule.label), "%lld:%u",
+	    (long long)c->expires, c->uplink);
 
-	if (dst->sa_family == AF_INET) {
-		memcpy(&pfr.rule.dst.addr.v.a.addr.v4,
-		    &((struct sockaddr_in *)dst)->sin_addr.s_addr, 4);
+	if (ma->ma_af == AF_INET) {
+		memcpy(&pfr.rule.dst.addr.v.a.addr.v4, &ma->ma_dst.s_addr, 4);
 		memset(&pfr.rule.dst.addr.v.a.mask.addr8, 255, 4);
-		pfr.rule.dst.port[0] = ((struct sockaddr_in *)dst)->sin_port;
+	} else {
+		memcpy(&pfr.rule.dst.addr.v.a.addr.v6, &ma->ma_addr6, 16);
+		memset(&pfr.rule.dst.addr.v.a.mask.addr8, 255, 16);
 	}
+	pfr.rule.dst.port[0] = ma->ma_dst_port;
 	pfr.rule.dst.port_op = PF_OP_EQ;
 
 	/*
-	 * pass [quick] [log] inet proto $proto \
+	 * pass [quick] [log] inet|inet6 proto $proto \
 	 *     from $src to $dst port = $_port
 	 *     [queue qname] [tag tagname]
 	 */
@@ -0,0 +1,308 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/tree.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "natpmpd.h"
+
+/*
+ * A stand-in for pf that keeps the ruleset in memory, so the rest of the
+ * daemon can be run, profiled and stressed without a packet filter.  Each
+ * sub-anchor is a node in a tree keyed by its name, holding the rules it
+ * would have had loaded.
+ *
+ * Transactions behave like pf's: nothing changes until the commit, which
+ * replaces every sub-anchor in the transaction at once, and a flush also
+ * empties every other one.  A commit can be made to take longer, or to
+ * fail with EBUSY as if something else had changed the ruleset, to see
+ * how the daemon copes with a slow or contended pf.
+ *
+ * Operations are counted as pf ioctls, one for each that pf would need.
+ */
+
+struct mem_anchor {
+	RB_ENTRY(mem_anchor)	 entry;
+	char			 name[FILTER_ANCHOR_LEN];
+	struct pfe_change	*rules;
+	u_int			 nrules;
+};
+
+/* A sub-anchor in the open transaction */
+struct mem_trans {
+	char			 name[FILTER_ANCHOR_LEN];
+	struct pfe_change	*rules;
+	u_int			 nrules, maxrules;
+};
+
+int		 mem_anchor_cmp(struct mem_anchor *, struct mem_anchor *);
+int		 mem_init(struct natpmpd *);
+int		 mem_prepare_commit(void);
+int		 mem_add_anchor(const char *);
+int		 mem_flush_anchors(void);
+int		 mem_read_anchors(void (*)(struct pfe_change *));
+int		 mem_begin_commit(void);
+int		 mem_add_rule(int, struct pfe_change *);
+int		 mem_do_commit(void);
+int		 mem_do_rollback(void);
+void		 mem_free_trans(void);
+
+RB_HEAD(mem_anchors, mem_anchor);
+RB_PROTOTYPE(mem_anchors, mem_anchor, entry, mem_anchor_cmp);
+
+const struct filter_backend mem_backend = {
+	"memory",
+	mem_init,
+	mem_prepare_commit,
+	mem_add_anchor,
+	mem_flush_anchors,
+	mem_read_anchors,
+	mem_begin_commit,
+	mem_add_rule,
+	mem_do_commit,
+	mem_do_rollback
+};
+
+static struct mem_anchors	 anchors = RB_INITIALIZER(&anchors);
+static u_int			 nanchors;
+static struct mem_trans		*trans;
+static u_int			 ntrans, maxtrans;
+static int			 trans_flush, trans_open;
+static u_int			 delay, busy;
+
+int
+mem_anchor_cmp(struct mem_anchor *a, struct mem_anchor *b)
+{
+	return (strcmp(a->name, b->name));
+}
+
+RB_GENERATE(mem_anchors, mem_anchor, entry, mem_anchor_cmp);
+
+int
+mem_init(struct natpmpd *env)
+{
+	delay = env->sc_filter_delay;
+	busy = env->sc_filter_busy;
+
+	log_warnx("using the in-memory filter, nothing will reach pf");
+
+	return (0);
+}
+
+int
+mem_prepare_commit(void)
+{
+	mem_free_trans();
+	trans_flush = 0;
+	trans_open = 0;
+
+	return (0);
+}
+
+int
+mem_add_anchor(const char *name)
+{
+	struct mem_trans	*t;
+	u_int			 size;
+
+	if (ntrans == maxtrans) {
+		size = maxtrans ? maxtrans * 2 : 16;
+		if ((t = reallocarray(trans, size, sizeof(*trans))) == NULL)
+			return (-1);
+		trans = t;
+		maxtrans = size;
+	}
+
+	t = &trans[ntrans];
+	memset(t, 0, sizeof(*t));
+	if (strlcpy(t->name, name, sizeof(t->name)) >= sizeof(t->name)) {
+		errno = ENAMETOOLONG;
+		return (-1);
+	}
+
+	return (ntrans++);
+}
+
+int
+mem_flush_anchors(void)
+{
+	/* Listing the sub-anchors, then one per sub-anchor */
+	stats.ioctls += 1 + nanchors;
+	trans_flush = 1;
+
+	return (0);
+}
+
+int
+mem_read_anchors(void (*cb)(struct pfe_change *))
+{
+	struct mem_anchor	*a;
+	u_int			 i;
+
+	stats.ioctls += 1 + nanchors;
+	RB_FOREACH(a, mem_anchors, &anchors) {
+		/* Getting the sub-anchor, its rules and then each rule */
+		stats.ioctls += 2 + a->nrules;
+		for (i = 0; i < a->nrules; i++)
+			cb(&a->rules[i]);
+	}
+
+	return (0);
+}
+
+int
+mem_begin_commit(void)
+{
+	stats.ioctls++;
+	trans_open = 1;
+
+	return (0);
+}
+
+int
+mem_add_rule(int nr, struct pfe_change *c)
+{
+	struct mapping_addr	*ma = &c->addr;
+	struct mem_trans	*t;
+	struct pfe_change	*r;
+	u_int			 size;
+
+	if ((ma->ma_af != AF_INET && ma->ma_af != AF_INET6) ||
+	    (c->proto != IPPROTO_UDP && c->proto != IPPROTO_TCP)) {
+		errno = EPROTONOSUPPORT;
+		return (-1);
+	}
+	if (!trans_open || nr < 0 || (u_int)nr >= ntrans) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	t = &trans[nr];
+	if (t->nrules == t->maxrules) {
+		size = t->maxrules ? t->maxrules * 2 : 1;
+		if ((r = reallocarray(t->rules, size, sizeof(*r))) == NULL)
+			return (-1);
+		t->rules = r;
+		t->maxrules = size;
+	}
+
+	stats.ioctls++;
+	memcpy(&t->rules[t->nrules++], c, sizeof(*c));
+
+	return (0);
+}
+
+int
+mem_do_commit(void)
+{
+	struct mem_anchor	*a, *next, key;
+	struct mem_trans	*t;
+	u_int			 i, loaded;
+
+	if (!trans_open) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	stats.ioctls++;
+	if (delay > 0)
+		usleep(delay * 1000);
+	if (busy > 0 && arc4random_uniform(100) < busy) {
+		errno = EBUSY;
+		return (-1);
+	}
+
+	if (trans_flush) {
+		for (a = RB_MIN(mem_anchors, &anchors); a != NULL; a = next) {
+			next = RB_NEXT(mem_anchors, &anchors, a);
+			RB_REMOVE(mem_anchors, &anchors, a);
+			free(a->rules);
+			free(a);
+		}
+		nanchors = 0;
+	}
+
+	/* The rules loaded in the transaction move over to the anchors */
+	for (i = 0, loaded = 0; i < ntrans; i++) {
+		t = &trans[i];
+		memcpy(key.name, t->name, sizeof(key.name));
+		a = RB_FIND(mem_anchors, &anchors, &key);
+		if (t->nrules == 0) {
+			if (a != NULL) {
+				RB_REMOVE(mem_anchors, &anchors, a);
+				free(a->rules);
+				free(a);
+				nanchors--;
+			}
+			continue;
+		}
+
+		if (a == NULL) {
+			if ((a = calloc(1, sizeof(*a))) == NULL)
+				fatal("mem_do_commit");
+			memcpy(a->name, t->name, sizeof(a->name));
+			RB_INSERT(mem_anchors, &anchors, a);
+			nanchors++;
+		}
+		free(a->rules);
+		a->rules = t->rules;
+		a->nrules = t->nrules;
+		loaded += t->nrules;
+		t->rules = NULL;
+		t->nrules = t->maxrules = 0;
+	}
+
+	if (log_check(LOGC_RULESET, LOG_DEBUG))
+		log_debug("memory filter: %u sub-anchors replaced, %u rules "
+		    "loaded, %u sub-anchors in total%s", ntrans, loaded,
+		    nanchors, trans_flush ? " after a flush" : "");
+
+	mem_free_trans();
+	trans_open = 0;
+
+	return (0);
+}
+
+int
+mem_do_rollback(void)
+{
+	stats.ioctls++;
+	mem_free_trans();
+	trans_flush = 0;
+	trans_open = 0;
+
+	return (0);
+}
+
+void
+mem_free_trans(void)
+{
+	u_int	 i;
+
+	for (i = 0; i < ntrans; i++)
+		free(trans[i].rules);
+	ntrans = 0;
+}
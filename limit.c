@@ -0,0 +1,162 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "natpmpd.h"
+
+/*
+ * Per-client limits on mapping requests, kept by the parent.
+ *
+ * Each client address gets a token bucket, filled at the configured rate
+ * up to the burst size and drained by one token per mapping request.  The
+ * buckets live in a fixed table of small sets, a client hashing to a full
+ * set takes over whichever entry in it has been quiet the longest.  That
+ * client, and the one it displaced, only ever start over with a full
+ * bucket so nobody is limited harder than the configuration says.
+ *
+ * Nothing is ever allocated, the table is the same size however many
+ * clients there are.
+ */
+
+#define CLIENT_SETS		 256	/* power of 2 */
+#define CLIENT_WAYS		 4
+
+#define TOKEN			 1000	/* a bucket counts thousandths */
+
+struct client {
+	struct in6_addr		 addr;		/* IPv4 as IPv4-mapped */
+	u_int32_t		 tokens;
+	u_int32_t		 stamp;		/* msec, last refill */
+};
+
+void			 client_addr(struct sockaddr *, struct in6_addr *);
+struct client		*client_lookup(struct in6_addr *, u_int32_t,
+			    u_int32_t);
+
+static struct client	 clients[CLIENT_SETS][CLIENT_WAYS];
+static u_int32_t	 client_seed;
+
+void
+init_limits(void)
+{
+	memset(clients, 0, sizeof(clients));
+	client_seed = arc4random();
+}
+
+void
+client_addr(struct sockaddr *sa, struct in6_addr *addr)
+{
+	if (sa->sa_family == AF_INET6) {
+		*addr = ((struct sockaddr_in6 *)sa)->sin6_addr;
+		return;
+	}
+
+	memset(addr, 0, sizeof(*addr));
+	addr->s6_addr[10] = 0xff;
+	addr->s6_addr[11] = 0xff;
+	memcpy(&addr->s6_addr[12], &((struct sockaddr_in *)sa)->sin_addr,
+	    sizeof(struct in_addr));
+}
+
+/* Find the client's bucket, taking one over for it if it has none */
+struct client *
+client_lookup(struct in6_addr *addr, u_int32_t now, u_int32_t full)
+{
+	struct client	*set, *c, *victim;
+	u_int32_t	 w[4], h;
+	u_int		 i;
+
+	memcpy(w, addr, sizeof(w));
+	h = (w[0] ^ w[1] ^ w[2] ^ w[3] ^ client_seed) * 0x9e3779b1;
+	set = clients[(h >> 24) & (CLIENT_SETS - 1)];
+
+	victim = &set[0];
+	for (i = 0; i < CLIENT_WAYS; i++) {
+		c = &set[i];
+		if (IN6_ARE_ADDR_EQUAL(&c->addr, addr))
+			return (c);
+		if (IN6_IS_ADDR_UNSPECIFIED(&c->addr)) {
+			victim = c;
+			break;
+		}
+		if (now - c->stamp > now - victim->stamp)
+			victim = c;
+	}
+
+	victim->addr = *addr;
+	victim->tokens = full;
+	victim->stamp = now;
+
+	return (victim);
+}
+
+/*
+ * Take a token from the client's bucket, returning whether it had one.
+ * With no rate configured every request is allowed.
+ */
+int
+client_allow(struct natpmpd *env, struct sockaddr *sa)
+{
+	struct in6_addr	 addr;
+	struct client	*c;
+	u_int64_t	 tokens;
+	u_int32_t	 now, full;
+
+	if (env->sc_limit_rate == 0)
+		return (1);
+
+	now = clock_msec();
+	full = env->sc_limit_burst * TOKEN;
+
+	client_addr(sa, &addr);
+	c = client_lookup(&addr, now, full);
+
+	/* A token is a thousand thousandths, so rate per sec is per msec */
+	tokens = c->tokens + (u_int64_t)(now - c->stamp) * env->sc_limit_rate;
+	c->tokens = (tokens > full) ? full : tokens;
+	c->stamp = now;
+
+	if (c->tokens < TOKEN) {
+		stats.limited++;
+		return (0);
+	}
+	c->tokens -= TOKEN;
+
+	return (1);
+}
+
+/* Whether the client is allowed another mapping */
+int
+client_quota(struct natpmpd *env, struct sockaddr *sa)
+{
+	if (env->sc_limit_mappings == 0 ||
+	    count_client_mappings(sa, env->sc_limit_mappings) <
+	    env->sc_limit_mappings)
+		return (1);
+
+	stats.over_quota++;
+
+	return (0);
+}
@@ -16,7 +16,11 @@
  * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <sys/types.h>
+#include <sys/time.h>
+
 #include <errno.h>
+#include <event.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,9 +30,27 @@
 
 #include "natpmpd.h"
 
+#define LOG_RING_MSG	 256
+#define LOG_RING_FLUSH	 100	/* msec */
+
+/* A message held in the ring until the next flush */
+struct log_msg {
+	int	 pri;
+	char	 msg[LOG_RING_MSG];
+};
+
 int	 debug;
 
+/* Anything less urgent than this for each class isn't even formatted */
+int	 log_level[LOGC_MAX] = { LOG_DEBUG, LOG_INFO, LOG_INFO, LOG_INFO };
+
+static struct log_msg	*ring;
+static u_int		 ring_size, ring_head, ring_count;
+static u_int64_t	 ring_dropped;
+static struct event	 ring_ev;
+
 void	 logit(int, const char *, ...);
+void	 log_flush(int, short, void *);
 
 void
 log_init(int n_debug)
@@ -43,6 +65,58 @@ log_init(int n_debug)
 	tzset();
 }
 
+/*
+ * Queue messages in a ring of size entries, handed to syslog from a
+ * timer, rather than possibly blocking in syslog every time.  Each
+ * process turns this on for itself once it has called event_init().
+ * A size of 0 flushes the ring and goes back to logging straight away.
+ */
+void
+log_async(u_int size)
+{
+	struct log_msg	*r;
+
+	if (ring != NULL) {
+		if (evtimer_pending(&ring_ev, NULL))
+			evtimer_del(&ring_ev);
+		log_flush(0, 0, NULL);
+		free(ring);
+		ring = NULL;
+	}
+	ring_size = ring_head = ring_count = 0;
+	ring_dropped = 0;
+
+	if (size == 0 || debug)
+		return;
+
+	if ((r = calloc(size, sizeof(*r))) == NULL) {
+		log_warn("log_async");
+		return;
+	}
+
+	ring = r;
+	ring_size = size;
+	evtimer_set(&ring_ev, log_flush, NULL);
+}
+
+void
+log_flush(int fd, short event, void *arg)
+{
+	struct log_msg	*m;
+
+	while (ring_count > 0) {
+		m = &ring[(ring_head + ring_size - ring_count) % ring_size];
+		syslog(m->pri, "%s", m->msg);
+		ring_count--;
+	}
+
+	if (ring_dropped > 0) {
+		syslog(LOG_WARNING, "%llu log messages dropped",
+		    (unsigned long long)ring_dropped);
+		ring_dropped = 0;
+	}
+}
+
 void
 logit(int pri, const char *fmt, ...)
 {
@@ -56,7 +130,8 @@ logit(int pri, const char *fmt, ...)
 void
 vlog(int pri, const char *fmt, va_list ap)
 {
-	char	*nfmt;
+	struct timeval	 tv = { 0, LOG_RING_FLUSH * 1000 };
+	char		*nfmt;
 
 	if (debug) {
 		/* best effort in out of mem situations */
@@ -68,6 +143,19 @@ vlog(int pri, const char *fmt, va_list ap)
 			free(nfmt);
 		}
 		fflush(stderr);
+	} else if (ring != NULL) {
+		if (ring_count == ring_size) {
+			ring_dropped++;
+			return;
+		}
+		ring[ring_head].pri = pri;
+		vsnprintf(ring[ring_head].msg, sizeof(ring[ring_head].msg),
+		    fmt, ap);
+		ring_head = (ring_head + 1) % ring_size;
+		ring_count++;
+
+		if (!evtimer_pending(&ring_ev, NULL))
+			evtimer_add(&ring_ev, &tv);
 	} else
 		vsyslog(pri, fmt, ap);
 }
@@ -131,6 +219,12 @@ log_debug(const char *emsg, ...)
 void
 fatal(const char *emsg)
 {
+	int	 saved_errno = errno;
+
+	/* Get everything out before going away */
+	log_async(0);
+	errno = saved_errno;
+
 	if (emsg == NULL)
 		logit(LOG_CRIT, "fatal: %s", strerror(errno));
 	else
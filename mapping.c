@@ -0,0 +1,683 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+
+#include <netinet/in.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "natpmpd.h"
+
+/*
+ * Mappings are kept in one array of small records holding just what a
+ * lookup or the expiry compares: the internal address and port, the
+ * external port, the expiry time, the protocol and the uplink.  The rest
+ * of each mapping is in a second array and the links chaining it into
+ * the indexes in a third, all three indexed the same way.  Free slots are
+ * chained together and reused before the arrays grow.
+ *
+ * The arrays grow by being reallocated, so a pointer to a mapping only
+ * stays good until the next alloc_mapping().  Anything holding on to a
+ * mapping for longer than that uses its index.  Walking every mapping is
+ * a pass along the array.
+ *
+ * Every live mapping is in three hash tables, chained by index:
+ *
+ *   by_int	(uplink, proto, internal address, internal port), refresh
+ *		and delete
+ *   by_addr	internal address, "delete all"
+ *   by_ext	(uplink, proto, external port), collision checks
+ *
+ * An IPv6 address is folded down to 32 bits for the record and for
+ * hashing, the full address is compared from the rest of the mapping.
+ * IPv6 pinholes have no external port of their own, so they stay out of
+ * by_ext and the port bitmaps.
+ *
+ * The tables double in size whenever there are more mappings than
+ * buckets.
+ *
+ * Each uplink has a bitmap per protocol of the external ports in use so
+ * a free one can be found without touching the mappings at all.
+ *
+ * Expiry is handled by a wheel of one second slots, each mapping hanging
+ * off the slot for the second it expires in.  One periodic timer walks
+ * the slots that have passed since it last ran, a mapping further than a
+ * full turn into the future simply stays put until its turn comes round.
+ * Pushing the expiry back, as every renewal does, only changes the time
+ * in the record and the mapping is moved to its new slot once the timer
+ * gets to the old one.
+ */
+
+#define MAPPING_HASH_SIZE	 256	/* initial buckets, power of 2 */
+#define MAPPING_TABLE_SIZE	 256	/* initial mappings */
+
+#define PORT_WORDS		 (65536 / 32)
+#define EXPIRE_WHEEL_SIZE	 1024	/* seconds, power of 2 */
+
+#define MAPPING_NONE		 0xffffffffU
+
+/* How a mapping is chained into the hash tables and the wheel */
+struct mapping_link {
+	u_int32_t	 int_next;	/* also the free list */
+	u_int32_t	 addr_next;
+	u_int32_t	 ext_next;
+	u_int32_t	 wheel_next;
+	u_int32_t	 wheel_prev;
+	u_int16_t	 wheel_slot;
+};
+
+struct port_map {
+	u_int32_t	 used[PORT_WORDS];
+	u_int32_t	 free;
+};
+
+u_int32_t		 mapping_hash(u_int32_t, u_int32_t);
+u_int32_t		 addr6_fold(const struct in6_addr *);
+int			 grow_table(void);
+u_int32_t		*new_buckets(u_int32_t);
+void			 grow_mappings(void);
+void			 hash_mapping(u_int32_t);
+void			 wheel_insert(u_int32_t);
+void			 wheel_remove(u_int32_t);
+struct port_map		*port_map(u_int8_t, u_int8_t);
+
+static struct mapping		*table;
+static struct mapping_info	*info;
+static struct mapping_link	*links;
+static u_int32_t		 table_size, table_used, free_list;
+static u_int32_t		*by_int, *by_addr, *by_ext;
+static u_int32_t		 hash_size, hash_mask, hash_seed;
+static u_int32_t		 mapping_count;
+static struct port_map		*ports;
+static u_int			 nuplinks;
+static u_int16_t		 port_lo, port_hi;
+static u_int32_t		 wheel[EXPIRE_WHEEL_SIZE];
+static time_t			 wheel_last;
+
+#define WHEEL_INDEX(t)		 ((t) & (EXPIRE_WHEEL_SIZE - 1))
+#define WHEEL_SLOT(t)		 (&wheel[WHEEL_INDEX(t)])
+
+u_int32_t
+mapping_hash(u_int32_t a, u_int32_t b)
+{
+	u_int32_t	 h;
+
+	h = (a ^ hash_seed) * 0x9e3779b1;
+	h ^= h >> 16;
+	h = (h ^ b) * 0x85ebca6b;
+	h ^= h >> 13;
+
+	return (h);
+}
+
+u_int32_t
+addr6_fold(const struct in6_addr *in6)
+{
+	u_int32_t	 w[4];
+
+	memcpy(w, in6, sizeof(w));
+
+	return (w[0] ^ w[1] ^ w[2] ^ w[3]);
+}
+
+#define INT_HASH(u, p, a, port) \
+	(mapping_hash((a), ((u) << 24) | ((p) << 16) | (port)))
+#define ADDR_HASH(a)		 (mapping_hash((a), 0))
+#define EXT_HASH(u, p, port) \
+	(mapping_hash(((u) << 24) | ((p) << 16) | (port), 0))
+
+#define M_V4(m)		 (!((m)->flags & MAPPING_F_INET6))
+
+/* Unchain mapping i from the chain starting at head */
+#define CHAIN_REMOVE(head, i, next) do {				\
+	u_int32_t	*_p;						\
+									\
+	for (_p = (head); *_p != (i); _p = &links[*_p].next)		\
+		;							\
+	*_p = links[(i)].next;						\
+} while (0)
+
+#define PORT_ISSET(pm, p)	 ((pm)->used[(p) >> 5] & (1U << ((p) & 31)))
+#define PORT_SET(pm, p)		 ((pm)->used[(p) >> 5] |= (1U << ((p) & 31)))
+#define PORT_CLR(pm, p)		 ((pm)->used[(p) >> 5] &= ~(1U << ((p) & 31)))
+
+void
+init_mappings(struct natpmpd *env)
+{
+	u_int32_t	 i;
+
+	port_lo = env->sc_port_lo;
+	port_hi = env->sc_port_hi;
+	nuplinks = env->sc_nuplinks;
+	if ((ports = calloc(nuplinks * 2, sizeof(*ports))) == NULL)
+		fatal("init_mappings");
+	for (i = 0; i < nuplinks * 2; i++)
+		ports[i].free = port_hi - port_lo + 1;
+
+	free_list = MAPPING_NONE;
+	if (grow_table() == -1)
+		fatal("init_mappings");
+
+	hash_seed = arc4random();
+	hash_size = MAPPING_HASH_SIZE;
+	hash_mask = hash_size - 1;
+	by_int = new_buckets(hash_size);
+	by_addr = new_buckets(hash_size);
+	by_ext = new_buckets(hash_size);
+
+	for (i = 0; i < EXPIRE_WHEEL_SIZE; i++)
+		wheel[i] = MAPPING_NONE;
+	wheel_last = clock_now();
+}
+
+/* Double the arrays, or leave them be if that can't be done */
+int
+grow_table(void)
+{
+	struct mapping		*t;
+	struct mapping_info	*mi;
+	struct mapping_link	*ml;
+	u_int32_t		 size;
+
+	size = table_size ? table_size * 2 : MAPPING_TABLE_SIZE;
+	if ((t = reallocarray(table, size, sizeof(*t))) == NULL)
+		return (-1);
+	table = t;
+	if ((mi = reallocarray(info, size, sizeof(*mi))) == NULL)
+		return (-1);
+	info = mi;
+	if ((ml = reallocarray(links, size, sizeof(*ml))) == NULL)
+		return (-1);
+	links = ml;
+	table_size = size;
+
+	return (0);
+}
+
+u_int32_t *
+new_buckets(u_int32_t size)
+{
+	u_int32_t	*b;
+
+	if ((b = reallocarray(NULL, size, sizeof(*b))) == NULL)
+		fatal("new_buckets");
+	memset(b, 0xff, size * sizeof(*b));
+
+	return (b);
+}
+
+void
+grow_mappings(void)
+{
+	u_int32_t	 i;
+
+	free(by_int);
+	free(by_addr);
+	free(by_ext);
+	hash_size *= 2;
+	hash_mask = hash_size - 1;
+	by_int = new_buckets(hash_size);
+	by_addr = new_buckets(hash_size);
+	by_ext = new_buckets(hash_size);
+
+	for (i = 0; i < table_used; i++)
+		if (table[i].flags & MAPPING_F_LINKED)
+			hash_mapping(i);
+}
+
+/* Chain mapping i into each hash table it belongs in */
+void
+hash_mapping(u_int32_t i)
+{
+	struct mapping		*m = &table[i];
+	struct mapping_link	*ml = &links[i];
+	u_int32_t		*b;
+
+	b = &by_int[INT_HASH(m->uplink, m->proto, m->key, m->rdr_port) &
+	    hash_mask];
+	ml->int_next = *b;
+	*b = i;
+	b = &by_addr[ADDR_HASH(m->key) & hash_mask];
+	ml->addr_next = *b;
+	*b = i;
+	if (M_V4(m)) {
+		b = &by_ext[EXT_HASH(m->uplink, m->proto, m->dst_port) &
+		    hash_mask];
+		ml->ext_next = *b;
+		*b = i;
+	}
+}
+
+struct mapping *
+alloc_mapping(void)
+{
+	u_int32_t	 i;
+
+	if (free_list != MAPPING_NONE) {
+		i = free_list;
+		free_list = links[i].int_next;
+	} else {
+		if (table_used == table_size && grow_table() == -1)
+			return (NULL);
+		i = table_used++;
+	}
+
+	memset(&table[i], 0, sizeof(table[i]));
+	memset(&info[i], 0, sizeof(info[i]));
+
+	return (&table[i]);
+}
+
+void
+free_mapping(struct mapping *m)
+{
+	u_int32_t	 i = m - table;
+
+	m->flags = 0;
+	links[i].int_next = free_list;
+	free_list = i;
+}
+
+u_int32_t
+mapping_index(struct mapping *m)
+{
+	return (m - table);
+}
+
+struct mapping *
+mapping_by_index(u_int32_t i)
+{
+	return (&table[i]);
+}
+
+struct mapping_info *
+get_mapping_info(struct mapping *m)
+{
+	return (&info[m - table]);
+}
+
+void
+get_mapping_addr(struct mapping *m, struct mapping_addr *ma)
+{
+	struct mapping_info	*mi = get_mapping_info(m);
+
+	memset(ma, 0, sizeof(*ma));
+	if (M_V4(m)) {
+		ma->ma_af = AF_INET;
+		ma->ma_rdr.s_addr = m->key;
+		ma->ma_dst = mi->mi_dst;
+	} else {
+		ma->ma_af = AF_INET6;
+		ma->ma_addr6 = mi->mi_addr6;
+	}
+	ma->ma_rdr_port = m->rdr_port;
+	ma->ma_dst_port = m->dst_port;
+}
+
+void
+set_mapping_addr(struct mapping *m, const struct mapping_addr *ma)
+{
+	struct mapping_info	*mi = get_mapping_info(m);
+
+	if (ma->ma_af == AF_INET6) {
+		m->flags |= MAPPING_F_INET6;
+		m->key = addr6_fold(&ma->ma_addr6);
+		mi->mi_addr6 = ma->ma_addr6;
+	} else {
+		m->flags &= ~MAPPING_F_INET6;
+		m->key = ma->ma_rdr.s_addr;
+		mi->mi_dst = ma->ma_dst;
+	}
+	m->rdr_port = ma->ma_rdr_port;
+	m->dst_port = ma->ma_dst_port;
+}
+
+u_int32_t
+count_mappings(void)
+{
+	return (mapping_count);
+}
+
+/* Iterate over every live mapping, in no particular order */
+struct mapping *
+first_mapping(void)
+{
+	u_int32_t	 i;
+
+	for (i = 0; i < table_used; i++)
+		if (table[i].flags & MAPPING_F_LINKED)
+			return (&table[i]);
+
+	return (NULL);
+}
+
+struct mapping *
+next_mapping(struct mapping *m)
+{
+	u_int32_t	 i;
+
+	for (i = m - table + 1; i < table_used; i++)
+		if (table[i].flags & MAPPING_F_LINKED)
+			return (&table[i]);
+
+	return (NULL);
+}
+
+struct port_map *
+port_map(u_int8_t uplink, u_int8_t proto)
+{
+	return (&ports[uplink * 2 + (proto == IPPROTO_TCP)]);
+}
+
+/* Whether mappings can be made for an uplink, it may have gone since */
+int
+valid_uplink(u_int8_t uplink)
+{
+	return (uplink < nuplinks);
+}
+
+/*
+ * Find a free external port, in network byte order, trying the preferred
+ * one first if it's within the configured range.  Otherwise start from a
+ * random port and take the first free one after it, skipping whole words
+ * of the bitmap at a time.  Returns 0 if the range is exhausted.
+ */
+in_port_t
+find_port(u_int8_t uplink, u_int8_t proto, in_port_t preferred)
+{
+	struct port_map	*pm;
+	u_int32_t	 p, w, bits, start;
+
+	if (!valid_uplink(uplink))
+		return (0);
+	pm = port_map(uplink, proto);
+	if (pm->free == 0)
+		return (0);
+
+	p = ntohs(preferred);
+	if (p >= port_lo && p <= port_hi && !PORT_ISSET(pm, p))
+		return (preferred);
+
+	start = port_lo + arc4random_uniform(port_hi - port_lo + 1);
+	p = start;
+	do {
+		w = p >> 5;
+		/* Ignore bits below p in the first word examined */
+		bits = ~pm->used[w] & (~0U << (p & 31));
+		if (bits != 0) {
+			p = (w << 5) + ffs(bits) - 1;
+			if (p >= port_lo && p <= port_hi)
+				return (htons(p));
+		}
+		p = (w + 1) << 5;
+		if (p > port_hi)
+			p = port_lo;
+	} while ((p >> 5) != (start >> 5));
+
+	/* The free ports can only be in the start word, below start */
+	for (p = start & ~31U; p < start; p++)
+		if (p >= port_lo && !PORT_ISSET(pm, p))
+			return (htons(p));
+
+	return (0);
+}
+
+void
+wheel_insert(u_int32_t i)
+{
+	u_int32_t	*slot = WHEEL_SLOT(table[i].expires);
+
+	links[i].wheel_slot = WHEEL_INDEX(table[i].expires);
+	links[i].wheel_prev = MAPPING_NONE;
+	links[i].wheel_next = *slot;
+	if (*slot != MAPPING_NONE)
+		links[*slot].wheel_prev = i;
+	*slot = i;
+}
+
+/* The slot it hangs off, which needn't match the expiry time any more */
+void
+wheel_remove(u_int32_t i)
+{
+	struct mapping_link	*ml = &links[i];
+
+	if (ml->wheel_prev != MAPPING_NONE)
+		links[ml->wheel_prev].wheel_next = ml->wheel_next;
+	else
+		wheel[ml->wheel_slot] = ml->wheel_next;
+	if (ml->wheel_next != MAPPING_NONE)
+		links[ml->wheel_next].wheel_prev = ml->wheel_prev;
+}
+
+/* Add a fully populated mapping, including expiry, to every index */
+void
+link_mapping(struct mapping *m)
+{
+	struct port_map	*pm;
+	u_int32_t	 i = m - table;
+
+	if (mapping_count >= hash_size)
+		grow_mappings();
+
+	if (M_V4(m)) {
+		pm = port_map(m->uplink, m->proto);
+		PORT_SET(pm, ntohs(m->dst_port));
+		pm->free--;
+	}
+
+	m->flags |= MAPPING_F_LINKED;
+	hash_mapping(i);
+	wheel_insert(i);
+	mapping_count++;
+	stats.mappings[m->proto == IPPROTO_TCP]++;
+}
+
+void
+unlink_mapping(struct mapping *m)
+{
+	struct port_map	*pm;
+	u_int32_t	 i = m - table;
+
+	if (M_V4(m)) {
+		pm = port_map(m->uplink, m->proto);
+		PORT_CLR(pm, ntohs(m->dst_port));
+		pm->free++;
+		CHAIN_REMOVE(&by_ext[EXT_HASH(m->uplink, m->proto,
+		    m->dst_port) & hash_mask], i, ext_next);
+	}
+
+	CHAIN_REMOVE(&by_int[INT_HASH(m->uplink, m->proto, m->key,
+	    m->rdr_port) & hash_mask], i, int_next);
+	CHAIN_REMOVE(&by_addr[ADDR_HASH(m->key) & hash_mask], i, addr_next);
+	wheel_remove(i);
+	m->flags &= ~MAPPING_F_LINKED;
+	mapping_count--;
+	stats.mappings[m->proto == IPPROTO_TCP]--;
+}
+
+void
+refresh_mapping(struct mapping *m, time_t expires)
+{
+	u_int32_t	 i = m - table;
+
+	/* Later is left for reap_mappings() to catch up with */
+	if (expires >= m->expires) {
+		m->expires = expires;
+		return;
+	}
+
+	wheel_remove(i);
+	m->expires = expires;
+	wheel_insert(i);
+}
+
+/*
+ * Call back for every mapping that has expired by now, the callback is
+ * expected to unlink it.  Returns the number of mappings expired.
+ */
+int
+reap_mappings(time_t now, void (*cb)(struct mapping *))
+{
+	u_int32_t	 i, next;
+	time_t		 t;
+	int		 count = 0;
+
+	/* Catch up by at most one full turn of the wheel */
+	t = wheel_last;
+	if (now - t >= EXPIRE_WHEEL_SIZE)
+		t = now - EXPIRE_WHEEL_SIZE + 1;
+
+	for (; t <= now; t++)
+		for (i = *WHEEL_SLOT(t); i != MAPPING_NONE; i = next) {
+			next = links[i].wheel_next;
+			if (table[i].expires > now) {
+				/* Renewed since, move it to where it's due */
+				if (links[i].wheel_slot !=
+				    WHEEL_INDEX(table[i].expires)) {
+					wheel_remove(i);
+					wheel_insert(i);
+				}
+				continue;
+			}
+			cb(&table[i]);
+			count++;
+		}
+
+	wheel_last = now + 1;
+
+	return (count);
+}
+
+struct mapping *
+lookup_mapping(u_int8_t uplink, u_int8_t proto, struct in_addr addr,
+    in_port_t port)
+{
+	struct mapping	*m;
+	u_int32_t	 i;
+
+	for (i = by_int[INT_HASH(uplink, proto, addr.s_addr, port) &
+	    hash_mask]; i != MAPPING_NONE; i = links[i].int_next) {
+		m = &table[i];
+		if (m->key == addr.s_addr && m->rdr_port == port &&
+		    m->uplink == uplink && m->proto == proto && M_V4(m))
+			return (m);
+	}
+
+	return (NULL);
+}
+
+struct mapping *
+lookup_mapping6(u_int8_t uplink, u_int8_t proto, struct in6_addr *addr,
+    in_port_t port)
+{
+	struct mapping	*m;
+	u_int32_t	 i, key = addr6_fold(addr);
+
+	for (i = by_int[INT_HASH(uplink, proto, key, port) & hash_mask];
+	    i != MAPPING_NONE; i = links[i].int_next) {
+		m = &table[i];
+		if (m->key == key && m->rdr_port == port &&
+		    m->uplink == uplink && m->proto == proto && !M_V4(m) &&
+		    IN6_ARE_ADDR_EQUAL(&info[i].mi_addr6, addr))
+			return (m);
+	}
+
+	return (NULL);
+}
+
+struct mapping *
+lookup_mapping_ext(u_int8_t uplink, u_int8_t proto, in_port_t port)
+{
+	struct mapping	*m;
+	u_int32_t	 i;
+
+	for (i = by_ext[EXT_HASH(uplink, proto, port) & hash_mask];
+	    i != MAPPING_NONE; i = links[i].ext_next) {
+		m = &table[i];
+		if (m->dst_port == port && m->uplink == uplink &&
+		    m->proto == proto)
+			return (m);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Iterate over every mapping for the given internal address, the bucket
+ * may also hold mappings for other addresses which are skipped.
+ */
+struct mapping *
+first_mapping_addr(struct in_addr addr)
+{
+	u_int32_t	 i;
+
+	for (i = by_addr[ADDR_HASH(addr.s_addr) & hash_mask];
+	    i != MAPPING_NONE; i = links[i].addr_next)
+		if (table[i].key == addr.s_addr && M_V4(&table[i]))
+			return (&table[i]);
+
+	return (NULL);
+}
+
+struct mapping *
+next_mapping_addr(struct mapping *m)
+{
+	u_int32_t	 i = m - table, key = m->key;
+
+	while ((i = links[i].addr_next) != MAPPING_NONE)
+		if (table[i].key == key && M_V4(&table[i]))
+			return (&table[i]);
+
+	return (NULL);
+}
+
+/*
+ * Count the mappings and pinholes held by the given internal address,
+ * across every uplink, giving up once there are max of them.
+ */
+u_int
+count_client_mappings(struct sockaddr *sa, u_int max)
+{
+	struct in6_addr	*addr6 = NULL;
+	u_int32_t	 i, key;
+	u_int		 count = 0;
+
+	if (sa->sa_family == AF_INET6) {
+		addr6 = &((struct sockaddr_in6 *)sa)->sin6_addr;
+		key = addr6_fold(addr6);
+	} else
+		key = ((struct sockaddr_in *)sa)->sin_addr.s_addr;
+
+	for (i = by_addr[ADDR_HASH(key) & hash_mask];
+	    i != MAPPING_NONE && count < max; i = links[i].addr_next) {
+		if (table[i].key != key || M_V4(&table[i]) != (addr6 == NULL))
+			continue;
+		if (addr6 != NULL &&
+		    !IN6_ARE_ADDR_EQUAL(&info[i].mi_addr6, addr6))
+			continue;
+		count++;
+	}
+
+	return (count);
+}
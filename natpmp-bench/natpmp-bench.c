@@ -0,0 +1,735 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <imsg.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "natpmpd.h"
+
+/*
+ * Load generator for natpmpd.  Each simulated client has its own socket
+ * bound to its own source address, as the daemon keys mappings on the
+ * address a request comes from, and has at most one request in flight
+ * like a real NAT-PMP client.  Responses are matched to the request in
+ * flight on the socket they arrive on.
+ */
+
+#define BENCH_PORT_BASE		 1024
+#define BENCH_PORTS		 64000
+
+#define STEP_NONE		 -1
+
+struct client {
+	int			 fd;
+	u_int			 id;
+	struct timespec		 sent;
+	u_int8_t		 opcode;
+	in_port_t		 port;		/* internal, of the request */
+	u_int			 step;		/* through a fixed sequence */
+	int			 recreate;	/* churn, slot to fill */
+};
+
+struct scenario {
+	const char		*name;
+	int			 setup;		/* create every mapping first */
+	int			(*pick)(struct client *, u_int8_t *,
+				    in_port_t *, u_int32_t *);
+};
+
+struct results {
+	u_int64_t		 sent;
+	u_int64_t		 received;
+	u_int64_t		 lost;
+	u_int64_t		 invalid;
+	u_int64_t		 codes[NATPMPD_BAD_OPCODE + 2];
+	u_int32_t		*samples;	/* usec */
+	size_t			 nsamples;
+};
+
+__dead void	 usage(void);
+in_port_t	 client_port(struct client *, u_int);
+void		 pick_mapping(struct client *, u_int, u_int8_t *,
+		    in_port_t *, u_int32_t *);
+int		 pick_mix(struct client *, u_int8_t *, in_port_t *,
+		    u_int32_t *);
+int		 pick_setup(struct client *, u_int8_t *, in_port_t *,
+		    u_int32_t *);
+int		 pick_renewal(struct client *, u_int8_t *, in_port_t *,
+		    u_int32_t *);
+int		 pick_churn(struct client *, u_int8_t *, in_port_t *,
+		    u_int32_t *);
+void		 open_clients(struct sockaddr_in *, struct in_addr *);
+int		 send_request(struct client *, int (*)(struct client *,
+		    u_int8_t *, in_port_t *, u_int32_t *));
+int		 recv_response(struct client *, struct results *);
+void		 run(const struct scenario *, u_int64_t, struct results *);
+int		 ctl_stats(const char *, struct natpmpd_stats *);
+int		 cmp_sample(const void *, const void *);
+u_int32_t	 percentile(struct results *, double);
+void		 report(const struct scenario *, struct results *, double,
+		    struct natpmpd_stats *, struct natpmpd_stats *);
+u_int64_t	 usec_since(struct timespec *, struct timespec *);
+
+static const struct scenario scenarios[] = {
+	{ "mix",	0,	pick_mix },
+	{ "renewal",	1,	pick_renewal },
+	{ "churn",	1,	pick_churn },
+	{ NULL,		0,	NULL }
+};
+
+static const struct scenario	 setup_phase = { "setup", 0, pick_setup };
+
+static const char *codes[NATPMPD_BAD_OPCODE + 2] = {
+	"success", "unsupported version", "not authorised",
+	"network failure", "out of resources", "unsupported opcode",
+	"other"
+};
+
+static struct client	*clients;
+static struct pollfd	*pfds;
+static u_int		*gens;		/* churn, per client and slot */
+static u_int		 nclients = 16;
+static u_int		 nmappings = 4;
+static u_int32_t	 lifetime = 3600;
+static u_int		 weights[3] = { 10, 45, 45 };	/* address, UDP, TCP */
+static u_int		 window;
+static u_int		 rate;
+static u_int		 timeout = 1000;		/* msec */
+
+__dead void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s [-a address] [-b address] [-c count] "
+	    "[-l lifetime]\n\t[-m mappings] [-n clients] [-o mix] [-r rate] "
+	    "[-s socket]\n\t[-t msec] [-w window] [mix | renewal | churn]\n",
+	    __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const struct scenario	*sc;
+	struct sockaddr_in	 server;
+	struct in_addr		 base, *basep = NULL;
+	struct natpmpd_stats	 before, after;
+	struct results		 res, setup;
+	struct timespec		 start, end;
+	const char		*sockname = NATPMPD_SOCKET;
+	const char		*errstr;
+	char			*s, *p;
+	u_int64_t		 count = 10000;
+	u_int			 i;
+	int			 ch, have_stats;
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons(NATPMPD_SERVER_PORT);
+	server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	while ((ch = getopt(argc, argv, "a:b:c:l:m:n:o:r:s:t:w:")) != -1) {
+		switch (ch) {
+		case 'a':
+			if (inet_pton(AF_INET, optarg, &server.sin_addr) != 1)
+				errx(1, "invalid address %s", optarg);
+			break;
+		case 'b':
+			if (inet_pton(AF_INET, optarg, &base) != 1)
+				errx(1, "invalid address %s", optarg);
+			basep = &base;
+			break;
+		case 'c':
+			count = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "count is %s: %s", errstr, optarg);
+			break;
+		case 'l':
+			lifetime = strtonum(optarg, 1, UINT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "lifetime is %s: %s", errstr, optarg);
+			break;
+		case 'm':
+			nmappings = strtonum(optarg, 1, 1024, &errstr);
+			if (errstr != NULL)
+				errx(1, "mappings is %s: %s", errstr, optarg);
+			break;
+		case 'n':
+			nclients = strtonum(optarg, 1, 65536, &errstr);
+			if (errstr != NULL)
+				errx(1, "clients is %s: %s", errstr, optarg);
+			break;
+		case 'o':
+			if ((s = strdup(optarg)) == NULL)
+				err(1, NULL);
+			for (i = 0, p = s; i < 3; i++) {
+				weights[i] = strtonum(strsep(&p, ":"), 0, 1000,
+				    &errstr);
+				if (errstr != NULL || (i < 2 && p == NULL))
+					errx(1, "mix must be address:udp:tcp");
+			}
+			if (p != NULL ||
+			    weights[0] + weights[1] + weights[2] == 0)
+				errx(1, "mix must be address:udp:tcp");
+			free(s);
+			break;
+		case 'r':
+			rate = strtonum(optarg, 0, 10000000, &errstr);
+			if (errstr != NULL)
+				errx(1, "rate is %s: %s", errstr, optarg);
+			break;
+		case 's':
+			sockname = optarg;
+			break;
+		case 't':
+			timeout = strtonum(optarg, 1, 60000, &errstr);
+			if (errstr != NULL)
+				errx(1, "timeout is %s: %s", errstr, optarg);
+			break;
+		case 'w':
+			window = strtonum(optarg, 1, 65536, &errstr);
+			if (errstr != NULL)
+				errx(1, "window is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1)
+		usage();
+	for (sc = scenarios; sc->name != NULL; sc++)
+		if (strcmp(argc ? argv[0] : "mix", sc->name) == 0)
+			break;
+	if (sc->name == NULL)
+		usage();
+
+	if (window == 0 || window > nclients)
+		window = nclients;
+	if (nclients * nmappings > BENCH_PORTS)
+		errx(1, "too many mappings, at most %u", BENCH_PORTS);
+	/* A renewal storm is exactly one round of every client */
+	if (sc->pick == pick_renewal)
+		count = (u_int64_t)nclients * (nmappings + 1);
+
+	open_clients(&server, basep);
+
+	if (sc->setup) {
+		memset(&setup, 0, sizeof(setup));
+		run(&setup_phase, (u_int64_t)nclients * nmappings, &setup);
+		if (setup.lost || setup.codes[NATPMPD_SUCCESS] != setup.sent)
+			warnx("setup: %llu of %llu mappings created",
+			    (unsigned long long)setup.codes[NATPMPD_SUCCESS],
+			    (unsigned long long)setup.sent);
+		for (i = 0; i < nclients; i++)
+			clients[i].step = 0;
+	}
+
+	memset(&res, 0, sizeof(res));
+	if ((res.samples = calloc(count, sizeof(*res.samples))) == NULL)
+		err(1, NULL);
+
+	have_stats = (ctl_stats(sockname, &before) == 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	run(sc, count, &res);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (have_stats && ctl_stats(sockname, &after) == -1)
+		have_stats = 0;
+
+	report(sc, &res, usec_since(&start, &end) / 1000000.0,
+	    have_stats ? &before : NULL, &after);
+
+	return (0);
+}
+
+/*
+ * Internal ports are never shared between live mappings, even if every
+ * client has the same address.  Churn moves a slot on by a whole round of
+ * every client's mappings at a time.
+ */
+in_port_t
+client_port(struct client *c, u_int slot)
+{
+	u_int	 n, round = nclients * nmappings;
+
+	n = gens[c->id * nmappings + slot] * round + c->id * nmappings + slot;
+
+	return (htons(BENCH_PORT_BASE + n % (BENCH_PORTS / round * round)));
+}
+
+/* The setup creates the even slots over UDP and the odd ones over TCP */
+void
+pick_mapping(struct client *c, u_int slot, u_int8_t *opcode,
+    in_port_t *port, u_int32_t *life)
+{
+	*opcode = 1 + slot % 2;
+	*port = client_port(c, slot);
+	*life = lifetime;
+}
+
+/* Anything at all, by weight, against one of the client's mappings */
+int
+pick_mix(struct client *c, u_int8_t *opcode, in_port_t *port,
+    u_int32_t *life)
+{
+	u_int	 r;
+
+	r = arc4random_uniform(weights[0] + weights[1] + weights[2]);
+	if (r < weights[0])
+		*opcode = 0;
+	else if (r < weights[0] + weights[1])
+		*opcode = 1;
+	else
+		*opcode = 2;
+	*port = client_port(c, arc4random_uniform(nmappings));
+	*life = lifetime;
+
+	return (1);
+}
+
+/* Every one of the client's mappings, once */
+int
+pick_setup(struct client *c, u_int8_t *opcode, in_port_t *port,
+    u_int32_t *life)
+{
+	if (c->step == nmappings)
+		return (0);
+
+	pick_mapping(c, c->step++, opcode, port, life);
+
+	return (1);
+}
+
+/*
+ * What every client does on seeing the epoch go backwards: ask for the
+ * address again and renew everything it had.
+ */
+int
+pick_renewal(struct client *c, u_int8_t *opcode, in_port_t *port,
+    u_int32_t *life)
+{
+	if (c->step > nmappings)
+		return (0);
+
+	if (c->step == 0) {
+		*opcode = 0;
+		*port = 0;
+		*life = 0;
+	} else
+		pick_mapping(c, c->step - 1, opcode, port, life);
+	c->step++;
+
+	return (1);
+}
+
+/*
+ * Delete one of the client's mappings, then create a new one in its
+ * place with a different internal port, so the total stays the same.
+ */
+int
+pick_churn(struct client *c, u_int8_t *opcode, in_port_t *port,
+    u_int32_t *life)
+{
+	u_int	 slot;
+
+	if (c->recreate != STEP_NONE) {
+		slot = c->recreate;
+		c->recreate = STEP_NONE;
+		gens[c->id * nmappings + slot]++;
+		pick_mapping(c, slot, opcode, port, life);
+	} else {
+		slot = arc4random_uniform(nmappings);
+		c->recreate = slot;
+		pick_mapping(c, slot, opcode, port, life);
+		*life = 0;
+	}
+
+	return (1);
+}
+
+void
+open_clients(struct sockaddr_in *server, struct in_addr *base)
+{
+	struct sockaddr_in	 sin;
+	struct rlimit		 rl;
+	struct client		*c;
+	u_int			 i;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < nclients + 16) {
+		rl.rlim_cur = nclients + 16;
+		if (rl.rlim_cur > rl.rlim_max ||
+		    setrlimit(RLIMIT_NOFILE, &rl) == -1)
+			errx(1, "not enough descriptors for %u clients",
+			    nclients);
+	}
+
+	if ((clients = calloc(nclients, sizeof(*clients))) == NULL ||
+	    (pfds = calloc(nclients, sizeof(*pfds))) == NULL ||
+	    (gens = calloc(nclients * nmappings, sizeof(*gens))) == NULL)
+		err(1, NULL);
+
+	for (i = 0; i < nclients; i++) {
+		c = &clients[i];
+		c->id = i;
+		c->recreate = STEP_NONE;
+
+		if ((c->fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+			err(1, "socket");
+		if (base != NULL) {
+			memset(&sin, 0, sizeof(sin));
+			sin.sin_family = AF_INET;
+			sin.sin_addr.s_addr = htonl(ntohl(base->s_addr) + i);
+			if (bind(c->fd, (struct sockaddr *)&sin,
+			    sizeof(sin)) == -1)
+				err(1, "bind: %s", inet_ntoa(sin.sin_addr));
+		}
+		if (connect(c->fd, (struct sockaddr *)server,
+		    sizeof(*server)) == -1)
+			err(1, "connect");
+		if (fcntl(c->fd, F_SETFL, O_NONBLOCK) == -1)
+			err(1, "fcntl");
+
+		pfds[i].fd = -1;
+		pfds[i].events = POLLIN;
+	}
+}
+
+/* Returns 1 if a request was sent, 0 if the client has nothing to send */
+int
+send_request(struct client *c, int (*pick)(struct client *, u_int8_t *,
+    in_port_t *, u_int32_t *))
+{
+	u_int8_t	 buf[12];
+	u_int32_t	 life;
+	size_t		 len;
+
+	if (pick(c, &c->opcode, &c->port, &life) == 0)
+		return (0);
+
+	memset(buf, 0, sizeof(buf));
+	buf[0] = NATPMP_VERSION;
+	buf[1] = c->opcode;
+	len = 2;
+	if (c->opcode != 0) {
+		memcpy(&buf[4], &c->port, sizeof(c->port));
+		life = htonl(life);
+		memcpy(&buf[8], &life, sizeof(life));
+		len = 12;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &c->sent);
+	if (send(c->fd, buf, len, 0) == -1)
+		warn("send");
+	pfds[c->id].fd = c->fd;
+
+	return (1);
+}
+
+/* Returns 1 once the request in flight has been answered */
+int
+recv_response(struct client *c, struct results *res)
+{
+	struct timespec	 now;
+	u_int8_t	 buf[NATPMPD_MAX_PACKET_SIZE];
+	u_int16_t	 result;
+	ssize_t		 n;
+
+	/* Nothing listening shows up here too, it times out as lost */
+	if ((n = recv(c->fd, buf, sizeof(buf), 0)) == -1)
+		return (0);
+
+	/* Something left over from a request that has timed out */
+	if (n < 4 || buf[0] != NATPMP_VERSION || buf[1] != (c->opcode | 0x80) ||
+	    (c->opcode != 0 && (n != 16 || memcmp(&buf[8], &c->port,
+	    sizeof(c->port)) != 0)) || (c->opcode == 0 && n != 12)) {
+		res->invalid++;
+		return (0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (res->samples != NULL)
+		res->samples[res->nsamples++] = usec_since(&c->sent, &now);
+
+	memcpy(&result, &buf[2], sizeof(result));
+	result = ntohs(result);
+	res->codes[(result <= NATPMPD_BAD_OPCODE) ? result :
+	    NATPMPD_BAD_OPCODE + 1]++;
+	res->received++;
+
+	return (1);
+}
+
+/*
+ * Keep up to a window of clients busy until count requests have been
+ * answered or given up on, or no client has anything left to send.
+ */
+void
+run(const struct scenario *sc, u_int64_t count, struct results *res)
+{
+	struct timespec	 now, next_send;
+	struct client	*c;
+	u_int64_t	 issued = 0, done = 0, wait;
+	u_int		 busy = 0, cursor = 0, idle, i;
+	int		 n, ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &next_send);
+
+	while (done < count) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		/* Fill the window, as fast as the rate allows */
+		for (idle = 0; busy < window && issued < count &&
+		    idle < nclients; cursor = (cursor + 1) % nclients) {
+			c = &clients[cursor];
+			if (pfds[cursor].fd != -1) {
+				idle++;
+				continue;
+			}
+			if (rate > 0 && timespeccmp(&now, &next_send, <))
+				break;
+			if (send_request(c, sc->pick) == 0) {
+				idle++;
+				continue;
+			}
+			idle = 0;
+			busy++;
+			issued++;
+			res->sent++;
+			if (rate > 0) {
+				next_send.tv_nsec += 1000000000 / rate;
+				while (next_send.tv_nsec >= 1000000000) {
+					next_send.tv_sec++;
+					next_send.tv_nsec -= 1000000000;
+				}
+			}
+		}
+
+		/* Every client has run out of things to do */
+		if (busy == 0 && (issued == count || idle >= nclients))
+			break;
+
+		ms = 100;
+		if (rate > 0 && busy < window && issued < count) {
+			wait = timespeccmp(&now, &next_send, <) ?
+			    usec_since(&now, &next_send) / 1000 : 0;
+			if (wait < (u_int64_t)ms)
+				ms = wait;
+		}
+		if ((n = poll(pfds, nclients, ms)) == -1) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		for (i = 0; i < nclients && (n > 0 || busy > 0); i++) {
+			if (pfds[i].fd == -1)
+				continue;
+			c = &clients[i];
+			if (pfds[i].revents & (POLLIN|POLLERR)) {
+				n--;
+				if (recv_response(c, res)) {
+					pfds[i].fd = -1;
+					busy--;
+					done++;
+					continue;
+				}
+			}
+			if (usec_since(&c->sent, &now) >= timeout * 1000ULL) {
+				pfds[i].fd = -1;
+				busy--;
+				done++;
+				res->lost++;
+			}
+		}
+	}
+}
+
+/* Fetch the daemon's counters over its control socket */
+int
+ctl_stats(const char *sockname, struct natpmpd_stats *total)
+{
+	struct sockaddr_un	 sun;
+	struct natpmpd_stats	 s;
+	struct imsgbuf		 ibuf;
+	struct imsg		 imsg;
+	ssize_t			 n;
+	int			 fd, done = 0;
+
+	memset(total, 0, sizeof(*total));
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return (-1);
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, sockname, sizeof(sun.sun_path));
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		warn("connect: %s, no ruleset counters", sockname);
+		close(fd);
+		return (-1);
+	}
+
+	imsg_init(&ibuf, fd);
+	imsg_compose(&ibuf, IMSG_CTL_SHOW_STATS, 0, 0, -1, NULL, 0);
+	while (ibuf.w.queued)
+		if (msgbuf_write(&ibuf.w) <= 0 && errno != EAGAIN)
+			goto fail;
+
+	while (!done) {
+		if ((n = imsg_read(&ibuf)) == -1 || n == 0)
+			goto fail;
+		while (!done) {
+			if ((n = imsg_get(&ibuf, &imsg)) == -1)
+				goto fail;
+			if (n == 0)
+				break;
+			if (imsg.hdr.type == IMSG_CTL_STATS &&
+			    imsg.hdr.len == IMSG_HEADER_SIZE + sizeof(s)) {
+				memcpy(&s, imsg.data, sizeof(s));
+				total->transactions += s.transactions;
+				total->commits += s.commits;
+				total->commit_failures += s.commit_failures;
+				total->busy_retries += s.busy_retries;
+				total->limited += s.limited;
+				total->renewals += s.renewals;
+			} else if (imsg.hdr.type == IMSG_CTL_END)
+				done = 1;
+			imsg_free(&imsg);
+		}
+	}
+
+	imsg_clear(&ibuf);
+	close(fd);
+	return (0);
+
+fail:
+	warnx("%s: lost control connection, no ruleset counters", sockname);
+	imsg_clear(&ibuf);
+	close(fd);
+	return (-1);
+}
+
+int
+cmp_sample(const void *a, const void *b)
+{
+	u_int32_t	 x = *(const u_int32_t *)a, y = *(const u_int32_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+u_int32_t
+percentile(struct results *res, double p)
+{
+	size_t	 i;
+
+	if (res->nsamples == 0)
+		return (0);
+
+	i = res->nsamples * p;
+	if (i >= res->nsamples)
+		i = res->nsamples - 1;
+
+	return (res->samples[i]);
+}
+
+void
+report(const struct scenario *sc, struct results *res, double secs,
+    struct natpmpd_stats *before, struct natpmpd_stats *after)
+{
+	u_int	 i;
+
+	qsort(res->samples, res->nsamples, sizeof(*res->samples), cmp_sample);
+
+	printf("Scenario %s, %u clients, %u mappings each, window %u\n",
+	    sc->name, nclients, nmappings, window);
+	printf("Requests:\n");
+	printf("  %-24s %llu\n", "sent", (unsigned long long)res->sent);
+	printf("  %-24s %llu\n", "answered",
+	    (unsigned long long)res->received);
+	printf("  %-24s %llu\n", "lost", (unsigned long long)res->lost);
+	printf("  %-24s %llu\n", "invalid responses",
+	    (unsigned long long)res->invalid);
+	printf("  %-24s %.3fs\n", "elapsed", secs);
+	printf("  %-24s %.0f/s\n", "throughput",
+	    (secs > 0) ? res->received / secs : 0);
+
+	printf("Results:\n");
+	for (i = 0; i < sizeof(codes) / sizeof(codes[0]); i++)
+		if (res->codes[i] > 0)
+			printf("  %-24s %llu\n", codes[i],
+			    (unsigned long long)res->codes[i]);
+
+	printf("Latency:\n");
+	printf("  %-24s %uus\n", "p50", percentile(res, 0.5));
+	printf("  %-24s %uus\n", "p99", percentile(res, 0.99));
+	printf("  %-24s %uus\n", "p99.9", percentile(res, 0.999));
+	printf("  %-24s %uus\n", "max", res->nsamples ?
+	    res->samples[res->nsamples - 1] : 0);
+
+	if (before == NULL)
+		return;
+
+	printf("Ruleset:\n");
+	printf("  %-24s %llu\n", "pf transactions",
+	    (unsigned long long)(after->transactions - before->transactions));
+	printf("  %-24s %llu\n", "commits",
+	    (unsigned long long)(after->commits - before->commits));
+	printf("  %-24s %llu\n", "commit failures",
+	    (unsigned long long)(after->commit_failures -
+	    before->commit_failures));
+	printf("  %-24s %llu\n", "busy retries",
+	    (unsigned long long)(after->busy_retries - before->busy_retries));
+	printf("  %-24s %llu\n", "rate limited",
+	    (unsigned long long)(after->limited - before->limited));
+	printf("  %-24s %llu\n", "renewals",
+	    (unsigned long long)(after->renewals - before->renewals));
+}
+
+u_int64_t
+usec_since(struct timespec *from, struct timespec *to)
+{
+	struct timespec	 ts;
+
+	timespecsub(to, from, &ts);
+
+	return ((u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
@@ -0,0 +1,417 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <imsg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "natpmpd.h"
+
+struct command {
+	const char	*words[2];
+	int		 type;
+};
+
+__dead void	 usage(void);
+void		 show_mapping(struct imsg *);
+void		 add_stats(struct natpmpd_stats *, struct imsg *);
+void		 show_stats(struct natpmpd_stats *);
+void		 show_events(struct imsg *);
+void		 print_addr(const char *, struct mapping_addr *, int);
+
+static const struct command commands[] = {
+	{ { "show", "stats" },		IMSG_CTL_SHOW_STATS },
+	{ { "show", "mappings" },	IMSG_CTL_SHOW_MAPPINGS },
+	{ { "flush", "mappings" },	IMSG_CTL_FLUSH_MAPPINGS },
+	{ { "monitor", NULL },		IMSG_CTL_MONITOR },
+	{ { NULL, NULL },		IMSG_NONE }
+};
+
+static const char *opcodes[STATS_OPCODES] = {
+	"address", "UDP mapping", "TCP mapping", "other"
+};
+
+static const char *results[STATS_RESULTS] = {
+	"success", "unsupported version", "not authorised",
+	"network failure", "out of resources", "unsupported opcode"
+};
+
+static const char *events[EVENT_MAX] = {
+	"created", "refreshed", "deleted", "expired", "port-collision",
+	"commit-failed", "dropped"
+};
+
+static const char *pcp_opcodes[STATS_PCP_OPCODES] = {
+	"announce", "map", "peer", "other"
+};
+
+static const char *pcp_results[STATS_PCP_RESULTS] = {
+	"success", "unsupported version", "not authorised",
+	"malformed request", "unsupported opcode", "unsupported option",
+	"malformed option", "network failure", "out of resources",
+	"unsupported protocol", "over quota", "cannot provide external",
+	"address mismatch", "excessive remote peers"
+};
+
+struct imsgbuf	*ibuf;
+
+__dead void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s [-s socket] command [argument ...]\n",
+	    __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_un	 sun;
+	const struct command	*cmd;
+	struct natpmpd_stats	 total;
+	struct imsg		 imsg;
+	const char		*sockname = NATPMPD_SOCKET;
+	int			 ch, ctl_sock, done = 0;
+	ssize_t			 n;
+
+	while ((ch = getopt(argc, argv, "s:")) != -1) {
+		switch (ch) {
+		case 's':
+			sockname = optarg;
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1 || argc > 2)
+		usage();
+	for (cmd = commands; cmd->words[0] != NULL; cmd++)
+		if (strcmp(argv[0], cmd->words[0]) == 0 &&
+		    (cmd->words[1] == NULL ? argc == 1 :
+		    argc == 2 && strcmp(argv[1], cmd->words[1]) == 0))
+			break;
+	if (cmd->words[0] == NULL)
+		usage();
+
+	if ((ctl_sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		err(1, "socket");
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strlcpy(sun.sun_path, sockname, sizeof(sun.sun_path));
+	if (connect(ctl_sock, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		err(1, "connect: %s", sockname);
+
+	if ((ibuf = malloc(sizeof(struct imsgbuf))) == NULL)
+		err(1, NULL);
+	imsg_init(ibuf, ctl_sock);
+
+	imsg_compose(ibuf, cmd->type, 0, 0, -1, NULL, 0);
+	while (ibuf->w.queued)
+		if (msgbuf_write(&ibuf->w) <= 0 && errno != EAGAIN)
+			err(1, "write error");
+
+	memset(&total, 0, sizeof(total));
+	if (cmd->type == IMSG_CTL_SHOW_MAPPINGS)
+		printf("%-8s %-5s %-21s %-21s %s\n", "ID", "Proto",
+		    "External", "Internal", "Expires");
+
+	while (!done) {
+		if ((n = imsg_read(ibuf)) == -1)
+			errx(1, "imsg_read error");
+		if (n == 0)
+			errx(1, "pipe closed");
+
+		while (!done) {
+			if ((n = imsg_get(ibuf, &imsg)) == -1)
+				errx(1, "imsg_get error");
+			if (n == 0)
+				break;
+
+			switch (imsg.hdr.type) {
+			case IMSG_CTL_STATS:
+				add_stats(&total, &imsg);
+				break;
+			case IMSG_CTL_MAPPING:
+				show_mapping(&imsg);
+				break;
+			case IMSG_CTL_EVENT:
+				show_events(&imsg);
+				break;
+			case IMSG_CTL_END:
+				done = 1;
+				break;
+			default:
+				break;
+			}
+			imsg_free(&imsg);
+		}
+	}
+	close(ctl_sock);
+	free(ibuf);
+
+	switch (cmd->type) {
+	case IMSG_CTL_SHOW_STATS:
+		show_stats(&total);
+		break;
+	case IMSG_CTL_FLUSH_MAPPINGS:
+		printf("mappings flushed\n");
+		break;
+	default:
+		break;
+	}
+
+	return (0);
+}
+
+void
+show_mapping(struct imsg *imsg)
+{
+	struct ctl_mapping	 cm;
+	char			 ext[INET6_ADDRSTRLEN + 8];
+	char			 in[INET6_ADDRSTRLEN + 8];
+	char			 addr[INET6_ADDRSTRLEN];
+
+	if (imsg->hdr.len != IMSG_HEADER_SIZE + sizeof(cm))
+		errx(1, "invalid mapping");
+	memcpy(&cm, imsg->data, sizeof(cm));
+
+	if (cm.addr.ma_af == AF_INET6) {
+		/* A pinhole, both ends are the same */
+		inet_ntop(AF_INET6, &cm.addr.ma_addr6, addr, sizeof(addr));
+		snprintf(ext, sizeof(ext), "[%s]:%u", addr,
+		    ntohs(cm.addr.ma_dst_port));
+		strlcpy(in, ext, sizeof(in));
+	} else {
+		inet_ntop(AF_INET, &cm.addr.ma_dst, addr, sizeof(addr));
+		snprintf(ext, sizeof(ext), "%s:%u", addr,
+		    ntohs(cm.addr.ma_dst_port));
+		inet_ntop(AF_INET, &cm.addr.ma_rdr, addr, sizeof(addr));
+		snprintf(in, sizeof(in), "%s:%u", addr,
+		    ntohs(cm.addr.ma_rdr_port));
+	}
+
+	printf("%-8u %-5s %-21s %-21s %us\n", cm.id,
+	    (cm.proto == IPPROTO_UDP) ? "udp" : "tcp", ext, in, cm.lifetime);
+}
+
+/* Every process sends its own counters, add them all up */
+void
+add_stats(struct natpmpd_stats *total, struct imsg *imsg)
+{
+	struct natpmpd_stats	 s;
+	u_int			 i;
+
+	if (imsg->hdr.len != IMSG_HEADER_SIZE + sizeof(s))
+		errx(1, "invalid stats");
+	memcpy(&s, imsg->data, sizeof(s));
+
+	for (i = 0; i < STATS_OPCODES; i++)
+		total->requests[i] += s.requests[i];
+	for (i = 0; i < STATS_RESULTS; i++)
+		total->results[i] += s.results[i];
+	for (i = 0; i < STATS_PCP_OPCODES; i++)
+		total->pcp_requests[i] += s.pcp_requests[i];
+	for (i = 0; i < STATS_PCP_RESULTS; i++)
+		total->pcp_results[i] += s.pcp_results[i];
+	total->dropped += s.dropped;
+	total->limited += s.limited;
+	total->over_quota += s.over_quota;
+	total->renewals += s.renewals;
+	total->announces += s.announces;
+	total->notified += s.notified;
+	total->mappings[0] += s.mappings[0];
+	total->mappings[1] += s.mappings[1];
+	total->flushes += s.flushes;
+	total->commits += s.commits;
+	total->commit_failures += s.commit_failures;
+	total->transactions += s.transactions;
+	total->ioctls += s.ioctls;
+	total->busy_retries += s.busy_retries;
+	total->busy_failures += s.busy_failures;
+	timeradd(&total->busy_stall, &s.busy_stall, &total->busy_stall);
+	total->events += s.events;
+	total->events_dropped += s.events_dropped;
+	for (i = 0; i < STATS_LATENCY; i++)
+		total->latency[i] += s.latency[i];
+}
+
+void
+show_stats(struct natpmpd_stats *s)
+{
+	char	 label[32];
+	u_int	 i;
+
+	printf("Requests:\n");
+	for (i = 0; i < STATS_OPCODES; i++)
+		printf("  %-24s %llu\n", opcodes[i],
+		    (unsigned long long)s->requests[i]);
+	printf("  %-24s %llu\n", "dropped",
+	    (unsigned long long)s->dropped);
+	printf("  %-24s %llu\n", "rate limited",
+	    (unsigned long long)s->limited);
+	printf("  %-24s %llu\n", "over quota",
+	    (unsigned long long)s->over_quota);
+	printf("  %-24s %llu\n", "renewals",
+	    (unsigned long long)s->renewals);
+
+	printf("Results:\n");
+	for (i = 0; i < STATS_RESULTS; i++)
+		printf("  %-24s %llu\n", results[i],
+		    (unsigned long long)s->results[i]);
+
+	printf("PCP requests:\n");
+	for (i = 0; i < STATS_PCP_OPCODES; i++)
+		printf("  %-24s %llu\n", pcp_opcodes[i],
+		    (unsigned long long)s->pcp_requests[i]);
+
+	printf("PCP results:\n");
+	for (i = 0; i < STATS_PCP_RESULTS; i++)
+		printf("  %-24s %llu\n", pcp_results[i],
+		    (unsigned long long)s->pcp_results[i]);
+
+	printf("Mappings:\n");
+	printf("  %-24s %llu\n", "UDP",
+	    (unsigned long long)s->mappings[0]);
+	printf("  %-24s %llu\n", "TCP",
+	    (unsigned long long)s->mappings[1]);
+
+	printf("Ruleset:\n");
+	printf("  %-24s %llu\n", "flushes",
+	    (unsigned long long)s->flushes);
+	printf("  %-24s %llu\n", "commits",
+	    (unsigned long long)s->commits);
+	printf("  %-24s %llu\n", "commit failures",
+	    (unsigned long long)s->commit_failures);
+	printf("  %-24s %llu\n", "pf transactions",
+	    (unsigned long long)s->transactions);
+	printf("  %-24s %llu\n", "pf ioctls",
+	    (unsigned long long)s->ioctls);
+	printf("  %-24s %llu\n", "busy retries",
+	    (unsigned long long)s->busy_retries);
+	printf("  %-24s %llu\n", "busy failures",
+	    (unsigned long long)s->busy_failures);
+	printf("  %-24s %lldms\n", "busy stall",
+	    (long long)s->busy_stall.tv_sec * 1000 +
+	    s->busy_stall.tv_usec / 1000);
+
+	printf("Announcements:\n");
+	printf("  %-24s %llu\n", "sent",
+	    (unsigned long long)s->announces);
+	printf("  %-24s %llu\n", "clients told unicast",
+	    (unsigned long long)s->notified);
+
+	printf("Events:\n");
+	printf("  %-24s %llu\n", "sent",
+	    (unsigned long long)s->events);
+	printf("  %-24s %llu\n", "dropped",
+	    (unsigned long long)s->events_dropped);
+
+	printf("Handler latency:\n");
+	for (i = 0; i < STATS_LATENCY; i++) {
+		if (s->latency[i] == 0)
+			continue;
+		if (i == STATS_LATENCY - 1)
+			snprintf(label, sizeof(label), ">= %uus", 1U << (i - 1));
+		else
+			snprintf(label, sizeof(label), "< %uus", 1U << i);
+		printf("  %-24s %llu\n", label,
+		    (unsigned long long)s->latency[i]);
+	}
+}
+
+/*
+ * A batch of events, one JSON object to a line.  Anything reading them
+ * from a pipe wants each batch as soon as it arrives.
+ */
+void
+show_events(struct imsg *imsg)
+{
+	struct ctl_event	 ev;
+	size_t			 len, off;
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	if (len % sizeof(ev) != 0)
+		errx(1, "invalid events");
+
+	for (off = 0; off < len; off += sizeof(ev)) {
+		memcpy(&ev, (u_int8_t *)imsg->data + off, sizeof(ev));
+		if (ev.type >= EVENT_MAX)
+			continue;
+
+		printf("{\"time\":%lld,\"event\":\"%s\"",
+		    (long long)ev.time, events[ev.type]);
+		switch (ev.type) {
+		case EVENT_DROPPED:
+			printf(",\"count\":%u", ev.count);
+			break;
+		case EVENT_COMMIT_FAILED:
+			printf(",\"count\":%u,\"error\":\"%s\"", ev.count,
+			    strerror(ev.error));
+			break;
+		default:
+			if (ev.type != EVENT_COLLISION || ev.id != 0)
+				printf(",\"id\":%u", ev.id);
+			printf(",\"uplink\":%u,\"proto\":\"%s\"", ev.uplink,
+			    (ev.proto == IPPROTO_UDP) ? "udp" : "tcp");
+			print_addr("external", &ev.addr, 0);
+			print_addr("internal", &ev.addr, 1);
+			printf(",\"lifetime\":%u", ev.lifetime);
+			break;
+		}
+		printf("}\n");
+	}
+	fflush(stdout);
+}
+
+void
+print_addr(const char *name, struct mapping_addr *ma, int internal)
+{
+	char	 addr[INET6_ADDRSTRLEN];
+
+	if (ma->ma_af == AF_INET6) {
+		/* A pinhole, both ends are the same */
+		inet_ntop(AF_INET6, &ma->ma_addr6, addr, sizeof(addr));
+		printf(",\"%s\":\"[%s]:%u\"", name, addr,
+		    ntohs(ma->ma_dst_port));
+	} else {
+		inet_ntop(AF_INET, internal ? &ma->ma_rdr : &ma->ma_dst, addr,
+		    sizeof(addr));
+		printf(",\"%s\":\"%s:%u\"", name, addr,
+		    ntohs(internal ? ma->ma_rdr_port : ma->ma_dst_port));
+	}
+}
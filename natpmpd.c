@@ -19,6 +19,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 
@@ -33,60 +35,94 @@
 #include <netdb.h>
 #include <errno.h>
 #include <event.h>
+#include <ifaddrs.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <err.h>
 #include <unistd.h>
-#include <assert.h>
 #include <pwd.h>
+#include <time.h>
 
 #include "natpmpd.h"
 
-struct natpmp_request {
-	u_int8_t		 version;
-	u_int8_t		 opcode;
-	/* The following only appears in mapping requests */
-	u_int16_t		 reserved;
-	u_int16_t		 port[2];
-	u_int32_t		 lifetime;
-};
-
-struct natpmp_response {
-	u_int8_t			 version;
-	u_int8_t			 opcode;
-	u_int16_t			 result;
-	u_int32_t			 sssoe;
-	/* The following only appears in response to valid requests */
-	union {
-		struct {
-			u_int32_t	 address;
-		} announce;
-		struct {
-			u_int16_t	 port[2];
-			u_int32_t	 lifetime;
-		} mapping;
-	} data;
+/* A response held back until the ruleset change it reports is made */
+struct natpmp_deferred {
+	int			 fd;
+	u_int			 worker;
+	struct sockaddr_storage	 ss;
+	socklen_t		 slen;
+	ssize_t			 len;
+	u_int8_t		 response[NATPMPD_MAX_PACKET_SIZE];
 };
 
 void		 handle_signal(int, short, void *);
+void		 reload_config(struct natpmpd *);
+void		 merge_config(struct natpmpd *, struct natpmpd *);
+void		 natpmp_dispatch_reader(int, short, void *);
+int		 set_listen_port(struct listen_addr *);
+int		 open_listener(struct listen_addr *);
+int		 set_multicast(struct listen_addr *);
+u_int		 addr6_ifindex(struct in6_addr *);
+struct listen_addr *find_listener(struct listen_addrs *, struct listen_addr *);
+void		 start_listener(struct natpmpd *, struct listen_addr *);
+void		 stop_listener(struct natpmpd *, struct listen_addr *);
+void		 shutdown_natpmpd(struct natpmpd *);
 __dead void	 usage(void);
-struct mapping	*init_mapping(void);
-void		 expire_mapping(int, short, void *);
+void		 expire_mapping(struct mapping *);
+void		 expire_mappings(int, short, void *);
+void		 build_announce(struct natpmpd *, struct uplink *);
+void		 announce_epoch(struct natpmpd *, struct uplink *);
 void		 announce_address(int, short, void *);
+void		 announce_send(int, struct uplink *, struct sockaddr *,
+		    socklen_t);
+void		 retarget_mappings(struct natpmpd *, struct uplink *);
+int		 client_cmp(const void *, const void *);
+void		 notify_clients(int, short, void *);
+void		 snapshot_timeout(int, short, void *);
 void		 route_handler(int, short, void *);
-int		 natpmp_remove_mapping(u_int8_t, struct sockaddr_in *);
-int		 natpmp_create_mapping(u_int8_t, struct sockaddr_in *,
-		     struct sockaddr_in *, u_int32_t);
-ssize_t		 natpmp_mapping(struct natpmp_response *, u_int8_t,
-		     struct sockaddr_in *, struct sockaddr_in *, u_int32_t,
-		     struct natpmpd *);
-void		 natpmp_handler(int, short, void *);
+void		 route_message(struct natpmpd *, struct rt_msghdr *, ssize_t);
+void		 get_rtaddrs(int, struct sockaddr *, char *,
+		    struct sockaddr **);
+struct uplink	*find_uplink(struct natpmpd *, const char *, size_t);
+void		 schedule_check(struct natpmpd *);
+void		 check_timeout(int, short, void *);
+void		 remove_mapping(struct mapping *, u_int8_t);
+void		 mapping_event(u_int8_t, struct mapping *);
+void		 collision_event(u_int8_t, u_int8_t, struct sockaddr_in *,
+		    struct sockaddr_in *, u_int32_t, struct mapping *);
+void		 natpmp_mapping(struct natpmpd *, struct natpmp_slot *,
+		     u_int8_t, struct natpmp_packet *, struct natpmp_packet *);
+u_int		 natpmp_recv(int, u_int);
+void		 natpmp_reply(struct natpmpd *, int, u_int,
+		     struct sockaddr_storage *, socklen_t, u_int8_t *, ssize_t);
+void		 natpmp_dispatch_worker(int, short, void *);
+void		 flush_workers(struct natpmpd *);
+void		 init_batch(struct natpmpd *);
 void		 check_interface(struct natpmpd *);
-int		 rebuild_rules(void);
-u_int32_t	 sssoe(struct natpmpd *);
+void		 check_uplink(struct natpmpd *, struct uplink *);
+void		 pfe_add_change(struct natpmpd *, struct mapping *);
+void		 pfe_send(struct natpmpd *, int);
+void		 rebuild_rules(struct natpmpd *);
+void		 queue_change(struct mapping *);
+void		 append_change(struct mapping *);
+void		 relabel_mapping(struct mapping *, u_int32_t);
+void		 commit_rules(struct natpmpd *);
+void		 finish_commit(int);
+void		 defer_response(struct natpmpd *, struct natpmp_slot *);
+void		 send_deferred(struct natpmpd *, struct natpmp_deferred *,
+		     u_int);
+void		 flush_changes(struct natpmpd *);
+void		 schedule_commit(struct natpmpd *);
+void		 commit_timeout(int, short, void *);
+void		 retry_commit(struct natpmpd *);
+void		 natpmp_dispatch_pfe(int, short, void *);
+int		 recover_mappings(struct natpmpd *);
+void		 record_latency(struct timespec *, struct timespec *);
+ssize_t		 natpmp_request_v0(struct natpmpd *, struct natpmp_slot *);
 
 struct timeval timeouts[NATPMPD_MAX_DELAY] = {
 	{  0,      0 },
@@ -101,37 +137,428 @@ struct timeval timeouts[NATPMPD_MAX_DELAY] = {
 	{ 64,      0 },
 };
 
-struct mapping {
-	u_int32_t		 proto;
-	struct sockaddr		 dst;
-	struct sockaddr		 rdr;
-	struct event		 ev;
-	LIST_ENTRY(mapping)	 entry;
-};
+/* Mappings whose sub-anchor needs to be (re)loaded or emptied, by index */
+u_int32_t		*changes;
+u_int			 nchanges, maxchanges;
+u_int32_t		 changes_gen;
 
-LIST_HEAD(, mapping) mappings = LIST_HEAD_INITIALIZER(mappings);
+/* Mappings in the batch the pf process is working on */
+u_int32_t		*committing;
+u_int			 ncommitting, maxcommitting;
+
+struct pfe_change	 pfe_changes[PFE_CHANGE_MAX];
+u_int			 npfe_changes;
+
+/* Responses waiting on the next batch, and on the one being committed */
+struct natpmp_deferred	*deferred, *committed;
+u_int			 ndeferred, maxdeferred, ncommitted, maxcommitted;
+
+u_int32_t mapping_id;
+
+struct natpmpd_stats	 stats;
+
+struct timespec		 reload_start;
+
+struct natpmp_slot	*slots;
+u_int			 nslots;
+#ifdef MSG_WAITFORONE
+struct mmsghdr		*msgs;
+#endif
 
 void
 handle_signal(int sig, short event, void *arg)
 {
-	struct mapping	*m;
+	struct natpmpd	*env = (struct natpmpd *)arg;
+
+	if (sig == SIGHUP) {
+		reload_config(env);
+		return;
+	}
 
 	log_info("exiting on signal %d", sig);
 
+	shutdown_natpmpd(env);
+	log_async(0);
+
+	exit(0);
+}
+
+void
+shutdown_natpmpd(struct natpmpd *env)
+{
+	struct mapping	*m;
+	u_int		 i;
+
+	/* Whatever is live now gets reloaded when we next start */
+	if (env->sc_snapshot != NULL)
+		state_write();
+
 	/* Remove every mapping and then rebuild the ruleset which should
-	 * hopefully result in an empty anchor after we're gone
+	 * hopefully result in an empty anchor after we're gone, unless it's
+	 * to be kept for the next run in which case every rule is reloaded
+	 * with the current expiry time
 	 */
-	for (m = LIST_FIRST(&mappings); m != NULL; m = LIST_NEXT(m, entry)) {
-		if (evtimer_pending(&m->ev, NULL))
-			evtimer_del(&m->ev);
-		LIST_REMOVE(m, entry);
-		free(m);
+	for (i = 0; i < nchanges; i++) {
+		m = mapping_by_index(changes[i]);
+		m->flags &= ~MAPPING_F_QUEUED;
+		if ((m->flags & (MAPPING_F_DEAD|MAPPING_F_COMMIT)) ==
+		    MAPPING_F_DEAD)
+			free_mapping(m);
+	}
+	nchanges = 0;
+	for (i = 0; i < ncommitting; i++) {
+		m = mapping_by_index(committing[i]);
+		m->flags &= ~MAPPING_F_COMMIT;
+		if (m->flags & MAPPING_F_DEAD)
+			free_mapping(m);
 	}
+	ncommitting = 0;
+	if (!(env->sc_flags & NATPMPD_F_KEEP_RULESET))
+		for (m = first_mapping(); m != NULL; m = next_mapping(m)) {
+			unlink_mapping(m);
+			free_mapping(m);
+		}
 
-	if (rebuild_rules() == -1)
+	/* The pf process finishes this off after we've gone */
+	rebuild_rules(env);
+	if (imsg_flush(&env->sc_iev_pfe->ibuf) == -1)
 		log_warn("unable to rebuild ruleset");
+}
 
-	exit(0);
+/*
+ * Ask the configuration reader to read the configuration again, we can
+ * no longer get at the file ourselves.  What it sends back is applied
+ * by merge_config().
+ */
+void
+reload_config(struct natpmpd *env)
+{
+	if (env->sc_reloading) {
+		log_warnx("already reloading the configuration");
+		return;
+	}
+
+	log_info("reloading configuration");
+	clock_gettime(CLOCK_MONOTONIC, &reload_start);
+
+	if (imsg_compose(&env->sc_iev_reader->ibuf, IMSG_RECONF, 0, 0, -1,
+	    NULL, 0) == -1) {
+		log_warn("reload_config");
+		return;
+	}
+	imsg_event_add(env->sc_iev_reader);
+	env->sc_reloading = 1;
+}
+
+/*
+ * Apply whatever can be changed on the fly from a configuration read
+ * again, leaving the mappings and the ruleset alone.  Listening sockets
+ * that are still wanted are kept as they are, only the ones added or
+ * removed are opened or closed.
+ */
+void
+merge_config(struct natpmpd *env, struct natpmpd *nconf)
+{
+	struct listen_addr	*la, *nla, *next;
+	struct imsgev		*iev;
+	struct timespec		 end;
+	u_int			 i, opened = 0, closed = 0;
+	int			 uplinks_changed = 0;
+
+	env->sc_reloading = 0;
+	if (nconf == NULL) {
+		log_warnx("configuration reload failed, keeping the old one");
+		return;
+	}
+
+	/*
+	 * Listeners are tied to uplinks by position, so if the uplinks
+	 * themselves have changed leave the sockets alone until a restart.
+	 */
+	if (nconf->sc_nuplinks != env->sc_nuplinks)
+		uplinks_changed = 1;
+	for (i = 0; !uplinks_changed && i < env->sc_nuplinks; i++)
+		if (strcmp(nconf->sc_uplinks[i].name, env->sc_uplinks[i].name))
+			uplinks_changed = 1;
+	if (uplinks_changed)
+		while ((la = TAILQ_FIRST(&nconf->listen_addrs)) != NULL) {
+			TAILQ_REMOVE(&nconf->listen_addrs, la, entry);
+			free(la);
+		}
+
+	/* Close anything that's gone, keep anything still wanted */
+	for (la = TAILQ_FIRST(&nconf->listen_addrs); la != NULL; la = next) {
+		next = TAILQ_NEXT(la, entry);
+		if (set_listen_port(la) == -1) {
+			log_warnx("cannot listen on %s, skipping",
+			    log_sockaddr((struct sockaddr *)&la->sa));
+			TAILQ_REMOVE(&nconf->listen_addrs, la, entry);
+			free(la);
+		}
+	}
+	for (la = TAILQ_FIRST(&env->listen_addrs);
+	    la != NULL && !uplinks_changed; la = next) {
+		next = TAILQ_NEXT(la, entry);
+		if ((nla = find_listener(&nconf->listen_addrs, la)) != NULL) {
+			TAILQ_REMOVE(&nconf->listen_addrs, nla, entry);
+			free(nla);
+			continue;
+		}
+		stop_listener(env, la);
+		closed++;
+	}
+
+	/* What's left is new */
+	i = 0;
+	while ((la = TAILQ_FIRST(&nconf->listen_addrs)) != NULL) {
+		TAILQ_REMOVE(&nconf->listen_addrs, la, entry);
+		if (open_listener(la) == -1) {
+			free(la);
+			continue;
+		}
+		if (env->sc_workers > 0)
+			la->worker = (i++ % env->sc_workers) + 1;
+		start_listener(env, la);
+		opened++;
+	}
+
+	/* Settings that can only be put in place with a restart */
+	if (uplinks_changed ||
+	    nconf->sc_port_lo != env->sc_port_lo ||
+	    nconf->sc_port_hi != env->sc_port_hi ||
+	    nconf->sc_batch != env->sc_batch ||
+	    nconf->sc_workers != env->sc_workers ||
+	    nconf->sc_log_buffer != env->sc_log_buffer ||
+	    (nconf->sc_snapshot == NULL) != (env->sc_snapshot == NULL) ||
+	    (nconf->sc_snapshot != NULL &&
+	    strcmp(nconf->sc_snapshot, env->sc_snapshot)) ||
+	    nconf->sc_filter != env->sc_filter ||
+	    nconf->sc_filter_delay != env->sc_filter_delay ||
+	    nconf->sc_filter_busy != env->sc_filter_busy ||
+	    (nconf->sc_flags ^ env->sc_flags) & NATPMPD_F_GROUP_RULES)
+		log_warnx("interface, port range, batch size, workers, "
+		    "log buffer, snapshot, filter and rule grouping changes "
+		    "need a restart");
+
+	/* Everything else */
+	env->sc_commit_delay = nconf->sc_commit_delay;
+	env->sc_commit_max = nconf->sc_commit_max;
+	env->sc_snapshot_interval = nconf->sc_snapshot_interval;
+	env->sc_limit_rate = nconf->sc_limit_rate;
+	env->sc_limit_burst = nconf->sc_limit_burst;
+	env->sc_limit_mappings = nconf->sc_limit_mappings;
+	env->sc_limit_lifetime = nconf->sc_limit_lifetime;
+	env->sc_unicast_rate = nconf->sc_unicast_rate;
+	env->sc_flags = (env->sc_flags & ~NATPMPD_F_KEEP_RULESET) |
+	    (nconf->sc_flags & NATPMPD_F_KEEP_RULESET);
+
+	memcpy(env->sc_log_level, nconf->sc_log_level,
+	    sizeof(env->sc_log_level));
+	memcpy(log_level, env->sc_log_level, sizeof(log_level));
+	for (i = 0; i <= env->sc_workers + 1; i++) {
+		if (i < env->sc_workers)
+			iev = &env->sc_iev_workers[i];
+		else if (i == env->sc_workers)
+			iev = env->sc_iev_pfe;
+		else
+			iev = env->sc_iev_reader;
+		if (imsg_compose(&iev->ibuf, IMSG_LOG_LEVEL, 0, 0, -1,
+		    log_level, sizeof(log_level)) == -1)
+			log_warn("merge_config");
+		imsg_event_add(iev);
+	}
+
+	free(nconf->sc_snapshot);
+	free(nconf);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	timespecsub(&end, &reload_start, &end);
+	log_info("configuration reloaded in %lldus, %u listener%s opened, "
+	    "%u closed", (long long)end.tv_sec * 1000000 + end.tv_nsec / 1000,
+	    opened, (opened == 1) ? "" : "s", closed);
+}
+
+/* Fill in the default port, if none was given */
+int
+set_listen_port(struct listen_addr *la)
+{
+	switch (la->sa.ss_family) {
+	case AF_INET:
+		if (((struct sockaddr_in *)&la->sa)->sin_port == 0)
+			((struct sockaddr_in *)&la->sa)->sin_port =
+			    htons(NATPMPD_SERVER_PORT);
+		break;
+	case AF_INET6:
+		if (((struct sockaddr_in6 *)&la->sa)->sin6_port == 0)
+			((struct sockaddr_in6 *)&la->sa)->sin6_port =
+			    htons(NATPMPD_SERVER_PORT);
+		break;
+	default:
+		return (-1);
+	}
+
+	return (0);
+}
+
+int
+open_listener(struct listen_addr *la)
+{
+	log_info("listening on %s:%d",
+	    log_sockaddr((struct sockaddr *)&la->sa),
+	    ntohs((la->sa.ss_family == AF_INET6) ?
+	    ((struct sockaddr_in6 *)&la->sa)->sin6_port :
+	    ((struct sockaddr_in *)&la->sa)->sin_port));
+
+	if ((la->fd = socket(la->sa.ss_family, SOCK_DGRAM, 0)) == -1) {
+		log_warn("socket");
+		return (-1);
+	}
+
+	if (fcntl(la->fd, F_SETFL, O_NONBLOCK) == -1 ||
+	    set_multicast(la) == -1) {
+		log_warn("cannot set up socket on %s",
+		    log_sockaddr((struct sockaddr *)&la->sa));
+		close(la->fd);
+		return (-1);
+	}
+
+	if (bind(la->fd, (struct sockaddr *)&la->sa,
+	    SA_LEN((struct sockaddr *)&la->sa)) == -1) {
+		log_warn("bind on %s failed, skipping",
+		    log_sockaddr((struct sockaddr *)&la->sa));
+		close(la->fd);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* Announcements go out of the interface the listening address is on */
+int
+set_multicast(struct listen_addr *la)
+{
+	struct sockaddr_in6	*sin6;
+	unsigned char		 loop = 0;
+	u_int			 loop6 = 0, ifindex;
+
+	switch (la->sa.ss_family) {
+	case AF_INET:
+		if (setsockopt(la->fd, IPPROTO_IP, IP_MULTICAST_IF,
+		    &(((struct sockaddr_in *)&la->sa)->sin_addr),
+		    sizeof(struct in_addr)) == -1 ||
+		    setsockopt(la->fd, IPPROTO_IP, IP_MULTICAST_LOOP,
+		    &loop, sizeof(loop)) == -1)
+			return (-1);
+		break;
+	case AF_INET6:
+		sin6 = (struct sockaddr_in6 *)&la->sa;
+		if ((ifindex = sin6->sin6_scope_id) == 0)
+			ifindex = addr6_ifindex(&sin6->sin6_addr);
+		if (setsockopt(la->fd, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+		    &ifindex, sizeof(ifindex)) == -1 ||
+		    setsockopt(la->fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP,
+		    &loop6, sizeof(loop6)) == -1)
+			return (-1);
+		break;
+	}
+
+	return (0);
+}
+
+/* The interface an IPv6 address is on, or 0 to leave it to the kernel */
+u_int
+addr6_ifindex(struct in6_addr *in6)
+{
+	struct ifaddrs		*ifap, *ifa;
+	struct sockaddr_in6	*sin6;
+	u_int			 ifindex = 0;
+
+	if (getifaddrs(&ifap) == -1) {
+		log_warn("getifaddrs");
+		return (0);
+	}
+
+	for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next) {
+		sin6 = (struct sockaddr_in6 *)ifa->ifa_addr;
+		if (sin6 != NULL && sin6->sin6_family == AF_INET6 &&
+		    IN6_ARE_ADDR_EQUAL(&sin6->sin6_addr, in6)) {
+			ifindex = if_nametoindex(ifa->ifa_name);
+			break;
+		}
+	}
+	freeifaddrs(ifap);
+
+	return (ifindex);
+}
+
+struct listen_addr *
+find_listener(struct listen_addrs *list, struct listen_addr *la)
+{
+	struct listen_addr	*l;
+
+	TAILQ_FOREACH(l, list, entry)
+		if (l->uplink == la->uplink &&
+		    l->sa.ss_family == la->sa.ss_family &&
+		    memcmp(&l->sa, &la->sa,
+		    SA_LEN((struct sockaddr *)&la->sa)) == 0)
+			break;
+
+	return (l);
+}
+
+/*
+ * Start reading from a socket opened by a reload, or hand it to the
+ * worker it has been given to.  We keep our own copy of the descriptor
+ * either way, for the announcements.
+ */
+void
+start_listener(struct natpmpd *env, struct listen_addr *la)
+{
+	struct imsgev	*iev;
+	int		 fd;
+
+	TAILQ_INSERT_TAIL(&env->listen_addrs, la, entry);
+
+	if (la->worker == 0) {
+		event_set(&la->ev, la->fd, EV_READ|EV_PERSIST,
+		    natpmp_handler, env);
+		event_add(&la->ev, NULL);
+		return;
+	}
+
+	iev = &env->sc_iev_workers[la->worker - 1];
+	if ((fd = dup(la->fd)) == -1 ||
+	    imsg_compose(&iev->ibuf, IMSG_LISTEN_ADD, 0, 0, fd, la,
+	    sizeof(*la)) == -1) {
+		log_warn("start_listener");
+		if (fd != -1)
+			close(fd);
+		return;
+	}
+	imsg_event_add(iev);
+}
+
+void
+stop_listener(struct natpmpd *env, struct listen_addr *la)
+{
+	struct imsgev	*iev;
+
+	log_info("no longer listening on %s",
+	    log_sockaddr((struct sockaddr *)&la->sa));
+
+	if (la->worker == 0)
+		event_del(&la->ev);
+	else {
+		iev = &env->sc_iev_workers[la->worker - 1];
+		if (imsg_compose(&iev->ibuf, IMSG_LISTEN_CLOSE, 0, 0, -1,
+		    &la->sa, sizeof(la->sa)) == -1)
+			log_warn("stop_listener");
+		imsg_event_add(iev);
+	}
+
+	close(la->fd);
+	TAILQ_REMOVE(&env->listen_addrs, la, entry);
+	free(la);
 }
 
 /* __dead is for lint */
@@ -149,147 +576,1029 @@ init_mapping(void)
 {
 	struct mapping	*m;
 
-	if ((m = calloc(1, sizeof(struct mapping))) == NULL)
+	if ((m = alloc_mapping()) == NULL)
 		return (NULL);
 
-	LIST_INSERT_HEAD(&mappings, m, entry);
+	get_mapping_info(m)->id = mapping_id++;
 
 	return (m);
 }
 
-void
-expire_mapping(int fd, short event, void *arg)
+/*
+ * Put back a mapping left over from an earlier run, unless it has since
+ * expired or no longer fits in with the configuration or the mappings
+ * restored already.
+ */
+int
+restore_mapping(u_int8_t uplink, u_int8_t proto, struct mapping_addr *ma,
+    time_t expires, time_t now)
 {
-	struct mapping	*m = (struct mapping *)arg;
+	struct mapping	*m;
+
+	if (expires <= now)
+		return (0);
+	if (proto != IPPROTO_UDP && proto != IPPROTO_TCP)
+		return (0);
+	switch (ma->ma_af) {
+	case AF_INET:
+		if (find_port(uplink, proto, ma->ma_dst_port) !=
+		    ma->ma_dst_port)
+			return (0);
+		if (lookup_mapping(uplink, proto, ma->ma_rdr,
+		    ma->ma_rdr_port) != NULL)
+			return (0);
+		break;
+	case AF_INET6:
+		if (!valid_uplink(uplink) ||
+		    ma->ma_rdr_port != ma->ma_dst_port)
+			return (0);
+		if (lookup_mapping6(uplink, proto, &ma->ma_addr6,
+		    ma->ma_rdr_port) != NULL)
+			return (0);
+		break;
+	default:
+		return (0);
+	}
+
+	if ((m = init_mapping()) == NULL)
+		fatal("restore_mapping");
+	m->proto = proto;
+	m->uplink = uplink;
+	set_mapping_addr(m, ma);
+	m->expires = expires;
+	link_mapping(m);
 
-	log_info("expiring mapping");
+	return (1);
+}
 
+void
+expire_mapping(struct mapping *m)
+{
 	/*
 	 * TODO Draft says we should send TCP RST packets to both client and
 	 *      remote peer in the case of any active states when this expiry
 	 *      event fires.  How hard is that to do with pf?
 	 */
 
-	LIST_REMOVE(m, entry);
-	free(m);
+	remove_mapping(m, EVENT_EXPIRED);
+}
 
-	if (rebuild_rules() == -1)
-		log_warn("unable to rebuild ruleset");
+/* Write out the mappings every so often, if anything has changed */
+void
+snapshot_timeout(int fd, short event, void *arg)
+{
+	struct natpmpd		*env = (struct natpmpd *)arg;
+	struct timeval		 tv;
+	static u_int32_t	 gen;
+
+	/* Renewals don't count as changes but do move the expiry times */
+	if ((gen != changes_gen || count_mappings() > 0) &&
+	    state_write() == 0)
+		gen = changes_gen;
+
+	tv.tv_sec = env->sc_snapshot_interval;
+	tv.tv_usec = 0;
+	evtimer_add(&env->sc_snapshot_ev, &tv);
 }
 
-int
-rebuild_rules(void)
+/*
+ * Runs once a second, reaping every mapping that has expired since the
+ * last run and then updating the ruleset for all of them in one go.
+ */
+void
+expire_mappings(int fd, short event, void *arg)
+{
+	struct natpmpd	*env = (struct natpmpd *)arg;
+	struct timeval	 tv = { 1, 0 };
+	int		 count;
+
+	clock_update();
+	if ((count = reap_mappings(clock_now(), expire_mapping)) > 0) {
+		if (log_check(LOGC_MAPPING, LOG_INFO))
+			log_info("expiring %d mapping%s", count,
+			    (count == 1) ? "" : "s");
+
+		schedule_commit(env);
+	}
+
+	evtimer_add(&env->sc_expire_ev, &tv);
+}
+
+/*
+ * Queue a change for the pf process, sending them on a message's worth
+ * at a time.
+ */
+void
+pfe_add_change(struct natpmpd *env, struct mapping *m)
+{
+	struct pfe_change	*c;
+
+	if (npfe_changes == PFE_CHANGE_MAX)
+		pfe_send(env, IMSG_PF_CHANGE);
+
+	c = &pfe_changes[npfe_changes++];
+	memset(c, 0, sizeof(*c));
+	c->id = get_mapping_info(m)->id;
+	c->proto = m->proto;
+	c->remove = (m->flags & MAPPING_F_DEAD) ? 1 : 0;
+	c->uplink = m->uplink;
+	get_mapping_addr(m, &c->addr);
+	c->expires = m->expires;
+	get_mapping_info(m)->label = m->expires;
+}
+
+/*
+ * Send any changes still queued followed by a message of the given type,
+ * there's nothing useful to be done if that can't be queued.
+ */
+void
+pfe_send(struct natpmpd *env, int type)
+{
+	struct imsgbuf	*ibuf = &env->sc_iev_pfe->ibuf;
+
+	if (npfe_changes > 0) {
+		if (imsg_compose(ibuf, IMSG_PF_CHANGE, 0, 0, -1, pfe_changes,
+		    npfe_changes * sizeof(*pfe_changes)) == -1)
+			fatal("pfe_send");
+		npfe_changes = 0;
+	}
+
+	if (type != IMSG_PF_CHANGE &&
+	    imsg_compose(ibuf, type, 0, 0, -1, NULL, 0) == -1)
+		fatal("pfe_send");
+
+	imsg_event_add(env->sc_iev_pfe);
+}
+
+/*
+ * Replace the whole anchor, emptying every sub-anchor beneath it and
+ * reloading one for each live mapping.  This is only needed at startup
+ * and shutdown, everything else goes through commit_rules().
+ */
+void
+rebuild_rules(struct natpmpd *env)
 {
 	struct mapping	*m;
 
-	if (prepare_commit() == -1)
-		goto fail;
-	for (m = LIST_FIRST(&mappings); m != NULL; m = LIST_NEXT(m, entry))
-		if (add_rdr(m->proto, &m->dst, &m->rdr) == -1)
-			goto fail;
-	if (do_commit() == -1) {
-		if (errno != EBUSY)
-			goto fail;
-		usleep(5000);
-		if (do_commit() == -1)
-			goto fail;
+	for (m = first_mapping(); m != NULL; m = next_mapping(m))
+		pfe_add_change(env, m);
+	pfe_send(env, IMSG_PF_FLUSH);
+	env->sc_pfe_busy = 1;
+	stats.flushes++;
+}
+
+void
+queue_change(struct mapping *m)
+{
+	changes_gen++;
+
+	if (m->flags & MAPPING_F_QUEUED)
+		return;
+
+	append_change(m);
+}
+
+void
+append_change(struct mapping *m)
+{
+	u_int32_t	*c;
+	u_int		 size;
+
+	if (nchanges == maxchanges) {
+		size = maxchanges ? maxchanges * 2 : 256;
+		if ((c = reallocarray(changes, size, sizeof(*c))) == NULL)
+			fatal("append_change");
+		changes = c;
+		maxchanges = size;
+	}
+
+	m->flags |= MAPPING_F_QUEUED;
+	changes[nchanges++] = mapping_index(m);
+}
+
+/*
+ * Hand every queued change to the pf process as one batch.  The mappings
+ * move over to the commit list until it reports back, a mapping changing
+ * again in the meantime gets queued for the next batch as usual.
+ */
+void
+commit_rules(struct natpmpd *env)
+{
+	struct mapping	*m;
+	u_int32_t	*c;
+	u_int		 i, size;
+
+	for (i = 0; i < nchanges; i++) {
+		m = mapping_by_index(changes[i]);
+		m->flags &= ~MAPPING_F_QUEUED;
+		m->flags |= MAPPING_F_COMMIT;
+		pfe_add_change(env, m);
+	}
+
+	/* The queue becomes the batch, the last one has been dealt with */
+	c = committing;
+	committing = changes;
+	changes = c;
+	size = maxcommitting;
+	maxcommitting = maxchanges;
+	maxchanges = size;
+	ncommitting = nchanges;
+	nchanges = 0;
+
+	pfe_send(env, IMSG_PF_COMMIT);
+	env->sc_pfe_busy = 1;
+	stats.commits++;
+}
+
+/*
+ * The pf process has finished with the last batch.  If it failed the
+ * changes are queued again and go out along with the next batch.
+ */
+void
+finish_commit(int error)
+{
+	struct mapping	*m;
+	u_int		 i;
+
+	for (i = 0; i < ncommitting; i++) {
+		m = mapping_by_index(committing[i]);
+		m->flags &= ~MAPPING_F_COMMIT;
+		if (m->flags & MAPPING_F_QUEUED)
+			continue;
+		if (error)
+			append_change(m);
+		else if (m->flags & MAPPING_F_DEAD)
+			free_mapping(m);
+	}
+	ncommitting = 0;
+}
+
+void
+defer_response(struct natpmpd *env, struct natpmp_slot *slot)
+{
+	struct natpmp_deferred	*d;
+	u_int			 size;
+
+	/* Only likely to fill up while the pf process is backing off */
+	if (ndeferred >= maxdeferred) {
+		size = maxdeferred * 2;
+		if ((d = recallocarray(deferred, maxdeferred, size,
+		    sizeof(*d))) == NULL) {
+			/* Answer now rather than not at all */
+			natpmp_reply(env, slot->fd, slot->worker, &slot->ss,
+			    slot->slen, slot->response, slot->rlen);
+			return;
+		}
+		deferred = d;
+		maxdeferred = size;
+	}
+
+	d = &deferred[ndeferred++];
+	d->fd = slot->fd;
+	d->worker = slot->worker;
+	memcpy(&d->ss, &slot->ss, sizeof(d->ss));
+	d->slen = slot->slen;
+	d->len = slot->rlen;
+	memcpy(d->response, slot->response, sizeof(d->response));
+}
+
+void
+send_deferred(struct natpmpd *env, struct natpmp_deferred *d, u_int n)
+{
+	u_int	 i;
+
+	for (i = 0; i < n; i++)
+		natpmp_reply(env, d[i].fd, d[i].worker, &d[i].ss, d[i].slen,
+		    d[i].response, d[i].len);
+
+	flush_workers(env);
+}
+
+/*
+ * A renewal only moves the expiry in the table, the rule in pf keeps the
+ * one in its label and that's all recovery after a crash has to go on.
+ * Once the label has less than half of the renewed lifetime left, or is
+ * later than the new expiry, the rule goes out again with the next batch.
+ * It's not a change the client has to wait for, so its response isn't
+ * held back.
+ */
+void
+relabel_mapping(struct mapping *m, u_int32_t lifetime)
+{
+	time_t	 label = get_mapping_info(m)->label;
+
+	if (m->flags & MAPPING_F_QUEUED)
+		return;
+	if (label >= clock_now() + lifetime / 2 && label <= m->expires)
+		return;
+
+	append_change(m);
+}
+
+/*
+ * Send every queued ruleset change off to be committed, holding back the
+ * responses waiting on them until the pf process reports back.  Only one
+ * batch is outstanding at a time, asking for another in the meantime
+ * just means it's sent as soon as the current one is done.
+ */
+void
+flush_changes(struct natpmpd *env)
+{
+	struct natpmp_deferred	*d;
+	u_int			 size;
+
+	/*
+	 * Backing off from a failed commit, however many changes pile up
+	 * in the meantime, the timer sends them.
+	 */
+	if (env->sc_commit_backoff > 0 &&
+	    evtimer_pending(&env->sc_commit_ev, NULL))
+		return;
+
+	if (evtimer_pending(&env->sc_commit_ev, NULL))
+		evtimer_del(&env->sc_commit_ev);
+
+	if (env->sc_pfe_busy) {
+		env->sc_commit_wanted = 1;
+		return;
+	}
+	env->sc_commit_wanted = 0;
+
+	if (nchanges == 0) {
+		send_deferred(env, deferred, ndeferred);
+		ndeferred = 0;
+		return;
 	}
-	return (0);
 
-fail:
-	do_rollback();
-	return (-1);
+	commit_rules(env);
+
+	/* These responses now wait on the batch just sent */
+	d = committed;
+	committed = deferred;
+	deferred = d;
+	size = maxcommitted;
+	maxcommitted = maxdeferred;
+	maxdeferred = size;
+	ncommitted = ndeferred;
+	ndeferred = 0;
 }
 
-u_int32_t
-sssoe(struct natpmpd *env)
+/*
+ * Commit the queued changes now if there's no commit delay or enough of
+ * them have built up, otherwise make sure they're committed once the
+ * delay has passed.
+ */
+void
+schedule_commit(struct natpmpd *env)
 {
 	struct timeval	 tv;
 
-	gettimeofday(&tv, NULL);
+	if (nchanges == 0 && ndeferred == 0)
+		return;
+
+	if (env->sc_commit_delay == 0 || nchanges >= env->sc_commit_max) {
+		flush_changes(env);
+		return;
+	}
+
+	if (evtimer_pending(&env->sc_commit_ev, NULL))
+		return;
 
-	return (tv.tv_sec - env->sc_starttime.tv_sec);
+	tv.tv_sec = env->sc_commit_delay / 1000;
+	tv.tv_usec = (env->sc_commit_delay % 1000) * 1000;
+	evtimer_add(&env->sc_commit_ev, &tv);
 }
 
 void
-announce_address(int fd, short event, void *arg)
+commit_timeout(int fd, short event, void *arg)
+{
+	flush_changes((struct natpmpd *)arg);
+}
+
+/*
+ * The pf process gave up on a batch and its changes are queued again,
+ * but nothing else need come along to commit them.  Try again later,
+ * and later still each time it fails, rather than hammer a busy ruleset.
+ */
+void
+retry_commit(struct natpmpd *env)
+{
+	struct timeval	 tv;
+
+	if (env->sc_commit_backoff == 0)
+		env->sc_commit_backoff =
+		    NATPMPD_COMMIT_BACKOFF << NATPMPD_COMMIT_RETRIES;
+	else if ((env->sc_commit_backoff *= 2) > NATPMPD_MAX_COMMIT_BACKOFF)
+		env->sc_commit_backoff = NATPMPD_MAX_COMMIT_BACKOFF;
+
+	tv.tv_sec = env->sc_commit_backoff / 1000;
+	tv.tv_usec = (env->sc_commit_backoff % 1000) * 1000;
+	evtimer_del(&env->sc_commit_ev);
+	evtimer_add(&env->sc_commit_ev, &tv);
+}
+
+/*
+ * Results from the pf process.  Once a batch is done the responses held
+ * back for it can go out, followed by the next batch if one's waiting.
+ */
+void
+natpmp_dispatch_pfe(int fd, short event, void *arg)
+{
+	struct natpmpd		*env = (struct natpmpd *)arg;
+	struct imsgev		*iev = env->sc_iev_pfe;
+	struct imsgbuf		*ibuf = &iev->ibuf;
+	struct imsg		 imsg;
+	struct pfe_result	 res;
+	struct ctl_event	*ev;
+	ssize_t			 n;
+
+	if (event & EV_READ) {
+		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
+			fatal("imsg_read error");
+		if (n == 0)	/* connection closed */
+			fatalx("lost pf process");
+	}
+	if (event & EV_WRITE) {
+		if ((n = msgbuf_write(&ibuf->w)) == -1 && errno != EAGAIN)
+			fatal("msgbuf_write");
+	}
+
+	for (;;) {
+		if ((n = imsg_get(ibuf, &imsg)) == -1)
+			fatal("natpmp_dispatch_pfe: imsg_get error");
+		if (n == 0)
+			break;
+
+		switch (imsg.hdr.type) {
+		case IMSG_PF_RESULT:
+			if (imsg.hdr.len != IMSG_HEADER_SIZE + sizeof(res))
+				fatalx("natpmp_dispatch_pfe: invalid result");
+			memcpy(&res, imsg.data, sizeof(res));
+			env->sc_pfe_busy = 0;
+
+			if (res.retries > 0) {
+				stats.busy_retries += res.retries;
+				timeradd(&stats.busy_stall, &res.stall,
+				    &stats.busy_stall);
+				if (res.error)
+					stats.busy_failures++;
+			}
+
+			if (res.retries > 0 &&
+			    log_check(LOGC_RULESET, LOG_INFO))
+				log_info("ruleset %s after %u retries, "
+				    "stalled %lldms (%llu retries, %llu "
+				    "failures, %lldms stalled in total)",
+				    res.error ? "still busy" : "updated",
+				    res.retries,
+				    (long long)res.stall.tv_sec * 1000 +
+				    res.stall.tv_usec / 1000,
+				    stats.busy_retries, stats.busy_failures,
+				    (long long)stats.busy_stall.tv_sec * 1000 +
+				    stats.busy_stall.tv_usec / 1000);
+
+			if (res.flush) {
+				/* Only happens at startup */
+				if (res.error) {
+					errno = res.error;
+					fatal("unable to flush ruleset");
+				}
+			} else {
+				if (res.error) {
+					errno = res.error;
+					if (log_check(LOGC_RULESET, LOG_CRIT))
+						log_warn("unable to update "
+						    "ruleset");
+					stats.commit_failures++;
+					if ((ev = control_event(
+					    EVENT_COMMIT_FAILED)) != NULL) {
+						ev->count = ncommitting;
+						ev->error = res.error;
+					}
+				}
+				finish_commit(res.error);
+
+				send_deferred(env, committed, ncommitted);
+				ncommitted = 0;
+
+				if (res.error) {
+					retry_commit(env);
+					break;
+				}
+				env->sc_commit_backoff = 0;
+			}
+
+			if (env->sc_commit_wanted)
+				flush_changes(env);
+			break;
+		case IMSG_STATS:
+			control_relay_stats(&imsg);
+			break;
+		default:
+			log_warnx("natpmp_dispatch_pfe: unexpected imsg %d",
+			    imsg.hdr.type);
+			break;
+		}
+		imsg_free(&imsg);
+	}
+
+	imsg_event_add(iev);
+}
+
+/*
+ * A configuration read again, a piece at a time.  It's put back together
+ * and applied once it's all here.
+ */
+void
+natpmp_dispatch_reader(int fd, short event, void *arg)
 {
 	struct natpmpd		*env = (struct natpmpd *)arg;
+	struct imsgev		*iev = env->sc_iev_reader;
+	struct imsgbuf		*ibuf = &iev->ibuf;
+	struct imsg		 imsg;
+	struct listen_addr	*la;
+	static struct natpmpd	*nconf;
+	size_t			 len;
+	ssize_t			 n;
+
+	if (event & EV_READ) {
+		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
+			fatal("imsg_read error");
+		if (n == 0)	/* connection closed */
+			fatalx("lost configuration reader");
+	}
+	if (event & EV_WRITE) {
+		if ((n = msgbuf_write(&ibuf->w)) == -1 && errno != EAGAIN)
+			fatal("msgbuf_write");
+	}
+
+	for (;;) {
+		if ((n = imsg_get(ibuf, &imsg)) == -1)
+			fatal("natpmp_dispatch_reader: imsg_get error");
+		if (n == 0)
+			break;
+
+		len = imsg.hdr.len - IMSG_HEADER_SIZE;
+		switch (imsg.hdr.type) {
+		case IMSG_RECONF_CONF:
+			if (len != sizeof(*nconf) || nconf != NULL)
+				fatalx("natpmp_dispatch_reader: "
+				    "invalid configuration");
+			if ((nconf = malloc(sizeof(*nconf))) == NULL)
+				fatal("natpmp_dispatch_reader");
+			memcpy(nconf, imsg.data, sizeof(*nconf));
+			nconf->sc_confpath = env->sc_confpath;
+			nconf->sc_snapshot = NULL;
+			TAILQ_INIT(&nconf->listen_addrs);
+			break;
+		case IMSG_RECONF_LISTEN:
+			if (len != sizeof(*la) || nconf == NULL)
+				fatalx("natpmp_dispatch_reader: "
+				    "invalid listen address");
+			if ((la = malloc(sizeof(*la))) == NULL)
+				fatal("natpmp_dispatch_reader");
+			memcpy(la, imsg.data, sizeof(*la));
+			la->fd = -1;
+			TAILQ_INSERT_TAIL(&nconf->listen_addrs, la, entry);
+			break;
+		case IMSG_RECONF_SNAPSHOT:
+			if (len == 0 || nconf == NULL ||
+			    nconf->sc_snapshot != NULL ||
+			    ((char *)imsg.data)[len - 1] != '\0')
+				fatalx("natpmp_dispatch_reader: "
+				    "invalid snapshot");
+			if ((nconf->sc_snapshot = strdup(imsg.data)) == NULL)
+				fatal("natpmp_dispatch_reader");
+			break;
+		case IMSG_RECONF_END:
+			merge_config(env, nconf);
+			nconf = NULL;
+			break;
+		default:
+			log_warnx("natpmp_dispatch_reader: unexpected imsg %d",
+			    imsg.hdr.type);
+			break;
+		}
+		imsg_free(&imsg);
+	}
+
+	imsg_event_add(iev);
+}
+
+/*
+ * Ask the pf process for the mappings still loaded beneath our anchor and
+ * wait for them all to arrive, this only happens at startup before there
+ * is anything else going on.  They all get loaded again with the initial
+ * flush, under new ids.
+ */
+int
+recover_mappings(struct natpmpd *env)
+{
+	struct imsgbuf		*ibuf = &env->sc_iev_pfe->ibuf;
+	struct imsg		 imsg;
+	struct pfe_change	*c;
+	ssize_t			 n;
+	size_t			 len;
+	time_t			 now;
+	u_int			 i;
+	int			 count = 0, done = 0;
+
+	if (imsg_compose(ibuf, IMSG_PF_RECOVER, 0, 0, -1, NULL, 0) == -1 ||
+	    imsg_flush(ibuf) == -1)
+		fatal("recover_mappings");
+
+	clock_update();
+	now = clock_now();
+	while (!done) {
+		if ((n = imsg_read(ibuf)) == -1)
+			fatal("imsg_read error");
+		if (n == 0)
+			fatalx("lost pf process");
+
+		while (!done) {
+			if ((n = imsg_get(ibuf, &imsg)) == -1)
+				fatal("recover_mappings: imsg_get error");
+			if (n == 0)
+				break;
+
+			switch (imsg.hdr.type) {
+			case IMSG_PF_CHANGE:
+				len = imsg.hdr.len - IMSG_HEADER_SIZE;
+				if (len % sizeof(*c))
+					fatalx("recover_mappings: "
+					    "invalid mapping");
+				c = imsg.data;
+				for (i = 0; i < len / sizeof(*c); i++, c++)
+					count += restore_mapping(c->uplink,
+					    c->proto, &c->addr, c->expires,
+					    now);
+				break;
+			case IMSG_PF_RECOVER:
+				done = 1;
+				break;
+			default:
+				log_warnx("recover_mappings: "
+				    "unexpected imsg %d", imsg.hdr.type);
+				break;
+			}
+			imsg_free(&imsg);
+		}
+	}
+
+	return (count);
+}
+
+/* Build the announcements for the uplink's new address */
+void
+build_announce(struct natpmpd *env, struct uplink *u)
+{
+	struct natpmp_packet	 msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.version = NATPMP_VERSION;
+	msg.opcode = 0x80;
+	msg.result = NATPMPD_SUCCESS;
+	msg.address = u->address;
+	natpmp_encode(u->announce, &msg);
+
+	/* PCP clients are told the same way, with an unsolicited ANNOUNCE */
+	pcp_announce(env, u->announce_pcp);
+}
+
+/* Only the time since the epoch differs from one sending to the next */
+void
+announce_epoch(struct natpmpd *env, struct uplink *u)
+{
+	u_int32_t	 epoch;
+
+	clock_update();
+	epoch = sssoe(env);
+	natpmp_encode_epoch(u->announce, epoch);
+	pcp_encode_epoch(u->announce_pcp, epoch);
+}
+
+/*
+ * Send the announcements out of every address listening for the uplink,
+ * a burst of listeners at a time so a router with a great many of them
+ * doesn't spend one long stretch doing nothing else.  The next step of
+ * the backoff starts once the last burst has gone.
+ */
+void
+announce_address(int fd, short event, void *arg)
+{
+	struct uplink		*u = (struct uplink *)arg;
+	struct natpmpd		*env = u->env;
 	struct sockaddr_in	 sock;
-	u_int8_t		 packet[NATPMPD_MAX_PACKET_SIZE];
-	struct natpmp_response	*r;
+	struct sockaddr_in6	 sock6;
 	struct listen_addr	*la;
+	struct timeval		 tv;
+	u_int			 skip, sent;
 
-	/* Sending to 224.0.0.1:5350 */
+	/* Sending to 224.0.0.1:5350, or [ff02::1]:5350 */
 	memset(&sock, 0, sizeof(sock));
+	sock.sin_len = sizeof(struct sockaddr_in);
 	sock.sin_family = AF_INET;
 	sock.sin_addr.s_addr = htonl(INADDR_ALLHOSTS_GROUP);
 	sock.sin_port = htons(NATPMPD_CLIENT_PORT);
+	memset(&sock6, 0, sizeof(sock6));
+	sock6.sin6_len = sizeof(struct sockaddr_in6);
+	sock6.sin6_family = AF_INET6;
+	sock6.sin6_addr = in6addr_linklocal_allnodes;
+	sock6.sin6_port = htons(NATPMPD_CLIENT_PORT);
+
+	announce_epoch(env, u);
+
+	skip = u->announce_pos;
+	sent = 0;
+	TAILQ_FOREACH(la, &env->listen_addrs, entry) {
+		if (la->uplink != u->id)
+			continue;
+		if (skip > 0) {
+			skip--;
+			continue;
+		}
+		if (sent == NATPMPD_ANNOUNCE_BURST)
+			break;
 
-	/* Create the address announce packet */
-	assert(sizeof(struct natpmp_response) <= NATPMPD_MAX_PACKET_SIZE);
-	r = (struct natpmp_response *)packet;
-	memset(r, 0, sizeof(struct natpmp_response));
-
-	r->version = NATPMPD_MAX_VERSION;
-	r->opcode = 0x80;
-	r->result = NATPMPD_SUCCESS;
-	r->sssoe = htonl(sssoe(env));
-	r->data.announce.address = env->sc_address.s_addr;
-
-	/* Loop through all of our listening addresses and send the packet */
-	for (la = TAILQ_FIRST(&env->listen_addrs); la;
-	    la = TAILQ_NEXT(la, entry)) {
-		if (sendto(la->fd, packet, 12, 0,
-		    (struct sockaddr *)&sock, sizeof(sock)) < 0)
-			log_warn("sendto");
+		/* NAT-PMP is IPv4 only, PCP is announced either way */
+		if (la->sa.ss_family == AF_INET6)
+			announce_send(la->fd, u, (struct sockaddr *)&sock6,
+			    sizeof(sock6));
+		else
+			announce_send(la->fd, u, (struct sockaddr *)&sock,
+			    sizeof(sock));
+		sent++;
+	}
+
+	/* More listeners to go, after a pause */
+	if (la != NULL) {
+		u->announce_pos += sent;
+		tv.tv_sec = 0;
+		tv.tv_usec = NATPMPD_ANNOUNCE_STAGGER * 1000;
+		evtimer_add(&u->announce_ev, &tv);
+		return;
 	}
 
-	env->sc_delay++;
+	u->announce_pos = 0;
+	u->delay++;
 
 	/* If we haven't sent 10 announcements yet, queue up another */
-	if (env->sc_delay < NATPMPD_MAX_DELAY)
-		evtimer_add(&env->sc_announce_ev, &timeouts[env->sc_delay]);
+	if (u->delay < NATPMPD_MAX_DELAY)
+		evtimer_add(&u->announce_ev, &timeouts[u->delay]);
 }
 
+/* Both announcements out of one listener, in the one call if possible */
 void
-route_handler(int fd, short event, void *arg)
+announce_send(int fd, struct uplink *u, struct sockaddr *sa, socklen_t slen)
 {
-	struct natpmpd			*env = (struct natpmpd *)arg;
-	char				 msg[RTM_MAXSIZE];
-	struct rt_msghdr		*rtm = (struct rt_msghdr *)&msg;
-	struct ifa_msghdr		*ifam;
-	struct if_announcemsghdr	*ifan;
-	ssize_t				 len;
-	char				*cp;
-	int				 i;
+	struct iovec		 iov[2];
+	u_int			 i, n = 0;
+#ifdef MSG_WAITFORONE
+	struct mmsghdr		 mmsg[2];
+	int			 sent;
+#endif
+
+	if (sa->sa_family == AF_INET) {
+		iov[n].iov_base = u->announce;
+		iov[n++].iov_len = sizeof(u->announce);
+	}
+	iov[n].iov_base = u->announce_pcp;
+	iov[n++].iov_len = sizeof(u->announce_pcp);
+
+#ifdef MSG_WAITFORONE
+	memset(mmsg, 0, sizeof(mmsg));
+	for (i = 0; i < n; i++) {
+		mmsg[i].msg_hdr.msg_name = sa;
+		mmsg[i].msg_hdr.msg_namelen = slen;
+		mmsg[i].msg_hdr.msg_iov = &iov[i];
+		mmsg[i].msg_hdr.msg_iovlen = 1;
+	}
 
-	len = read(fd, msg, sizeof(msg));
+	/* On error skip the datagram that failed and carry on */
+	for (i = 0; i < n; i += (sent > 0) ? sent : 1)
+		if ((sent = sendmmsg(fd, &mmsg[i], n - i, 0)) == -1)
+			log_warn("sendmmsg");
+		else
+			stats.announces += sent;
+#else
+	for (i = 0; i < n; i++)
+		if (sendto(fd, iov[i].iov_base, iov[i].iov_len, 0, sa,
+		    slen) < 0)
+			log_warn("sendto");
+		else
+			stats.announces++;
+#endif
+}
 
-	if (rtm->rtm_version != RTM_VERSION)
+/*
+ * The uplink has a new address.  Point the rule for every mapping on it
+ * at the new address, all in the one batch, rather than leaving each one
+ * broken until its client notices and asks again.  If the clients are to
+ * be told unicast, the ones holding the mappings are noted on the way.
+ */
+void
+retarget_mappings(struct natpmpd *env, struct uplink *u)
+{
+	struct mapping		*m;
+	struct mapping_info	*mi;
+	in_addr_t		*a;
+	u_int			 i, n, size, count = 0;
+
+	u->nnotify = 0;
+	u->notify_pos = 0;
+	for (m = first_mapping(); m != NULL; m = next_mapping(m)) {
+		if (m->uplink != u->id || (m->flags & MAPPING_F_INET6))
+			continue;
+
+		mi = get_mapping_info(m);
+		if (mi->mi_dst.s_addr != u->address.s_addr) {
+			mi->mi_dst = u->address;
+			queue_change(m);
+			count++;
+		}
+
+		if (env->sc_unicast_rate == 0)
+			continue;
+		if (u->nnotify == u->maxnotify) {
+			size = u->maxnotify ? u->maxnotify * 2 : 256;
+			if ((a = reallocarray(u->notify, size,
+			    sizeof(*a))) == NULL) {
+				log_warn("retarget_mappings");
+				continue;
+			}
+			u->notify = a;
+			u->maxnotify = size;
+		}
+		u->notify[u->nnotify++] = m->key;
+	}
+
+	/* Clients usually hold a few mappings, each needs telling once */
+	if (u->nnotify > 1) {
+		qsort(u->notify, u->nnotify, sizeof(*u->notify), client_cmp);
+		for (i = 1, n = 1; i < u->nnotify; i++)
+			if (u->notify[i] != u->notify[n - 1])
+				u->notify[n++] = u->notify[i];
+		u->nnotify = n;
+	}
+
+	if (count == 0)
+		return;
+
+	/* Just the one line for the lot, however many there are */
+	if (log_check(LOGC_MAPPING, LOG_INFO))
+		log_info("moving %u mapping%s on %s to %s", count,
+		    (count == 1) ? "" : "s", u->name, inet_ntoa(u->address));
+	flush_changes(env);
+}
+
+int
+client_cmp(const void *a, const void *b)
+{
+	in_addr_t	 x = *(const in_addr_t *)a, y = *(const in_addr_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/*
+ * Send the announcements straight to each client noted above, as many at
+ * a time as the rate allows.  They go out of the first IPv4 address
+ * listening for the uplink, the one the clients most likely talk to.
+ * Only the once, the multicast announcements carry on repeating as
+ * usual.
+ */
+void
+notify_clients(int fd, short event, void *arg)
+{
+	struct uplink		*u = (struct uplink *)arg;
+	struct natpmpd		*env = u->env;
+	struct listen_addr	*la;
+	struct sockaddr_in	 sock;
+	struct timeval		 tv;
+	u_int			 n, msec;
+
+	/* Turned off by a reload, or nowhere to send from */
+	TAILQ_FOREACH(la, &env->listen_addrs, entry)
+		if (la->uplink == u->id && la->sa.ss_family == AF_INET)
+			break;
+	if (env->sc_unicast_rate == 0 || la == NULL) {
+		u->nnotify = 0;
 		return;
+	}
+
+	/* Slow rates send one client at a time, further apart */
+	msec = NATPMPD_UNICAST_TICK;
+	if ((n = env->sc_unicast_rate * msec / 1000) == 0) {
+		n = 1;
+		msec = 1000 / env->sc_unicast_rate;
+	}
+
+	announce_epoch(env, u);
+
+	memset(&sock, 0, sizeof(sock));
+	sock.sin_len = sizeof(struct sockaddr_in);
+	sock.sin_family = AF_INET;
+	sock.sin_port = htons(NATPMPD_CLIENT_PORT);
+	for (; n > 0 && u->notify_pos < u->nnotify; n--) {
+		sock.sin_addr.s_addr = u->notify[u->notify_pos++];
+		announce_send(la->fd, u, (struct sockaddr *)&sock,
+		    sizeof(sock));
+		stats.notified++;
+	}
+
+	if (u->notify_pos < u->nnotify) {
+		tv.tv_sec = msec / 1000;
+		tv.tv_usec = (msec % 1000) * 1000;
+		evtimer_add(&u->notify_ev, &tv);
+	}
+}
+
+void
+route_handler(int fd, short event, void *arg)
+{
+	struct natpmpd		*env = (struct natpmpd *)arg;
+	union {
+		struct rt_msghdr	 rtm;
+		char			 buf[RTM_MAXSIZE];
+	}			 msg;
+	ssize_t			 len;
+
+	/* Read everything queued up, one message at a time */
+	for (;;) {
+		if ((len = read(fd, &msg, sizeof(msg))) == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				log_warn("route_handler: read");
+			return;
+		}
+		if (len == 0)
+			fatalx("routing socket closed");
+
+		if ((size_t)len < offsetof(struct rt_msghdr, rtm_type) + 1 ||
+		    len < msg.rtm.rtm_msglen ||
+		    msg.rtm.rtm_version != RTM_VERSION)
+			continue;
+
+		route_message(env, &msg.rtm, msg.rtm.rtm_msglen);
+	}
+}
+
+/*
+ * Work out from the message itself whether the address of one of our
+ * uplinks could have changed.  Adding the address it already has or
+ * removing one of its aliases can't have, anything else means looking
+ * at the interfaces again shortly, so a burst of messages only leads to
+ * the one check.
+ */
+void
+route_message(struct natpmpd *env, struct rt_msghdr *rtm, ssize_t len)
+{
+	struct ifa_msghdr		*ifam;
+	struct if_announcemsghdr	*ifan;
+	struct sockaddr			*rti_info[RTAX_MAX];
+	struct sockaddr_dl		*sdl;
+	struct sockaddr_in		*sin;
+	struct uplink			*u;
 
 	switch (rtm->rtm_type) {
 	case RTM_NEWADDR:
 		/* FALLTHROUGH */
 	case RTM_DELADDR:
 		ifam = (struct ifa_msghdr *)rtm;
-		cp = ((char *)(ifam + 1));
+		if ((size_t)len < sizeof(*ifam) || ifam->ifam_hdrlen > len)
+			return;
+		get_rtaddrs(ifam->ifam_addrs,
+		    (struct sockaddr *)((char *)ifam + ifam->ifam_hdrlen),
+		    (char *)ifam + len, rti_info);
+
 		/* We only care about matching the interface name */
-		for (i = 1; ifam->ifam_addrs && i <= RTA_IFP; i <<= 1)
-			if (i & ifam->ifam_addrs) {
-				if (i == RTA_IFP && (strcmp(env->sc_interface,
-				    ((struct sockaddr_dl *)cp)->sdl_data) == 0))
-					check_interface(env);
-				cp += SA_RLEN((struct sockaddr *)cp);
-			}
+		sdl = (struct sockaddr_dl *)rti_info[RTAX_IFP];
+		if (sdl == NULL || sdl->sdl_family != AF_LINK ||
+		    (u = find_uplink(env, sdl->sdl_data,
+		    sdl->sdl_nlen)) == NULL)
+			return;
+
+		sin = (struct sockaddr_in *)rti_info[RTAX_IFA];
+		if (sin != NULL && sin->sin_family == AF_INET) {
+			if (rtm->rtm_type == RTM_NEWADDR &&
+			    sin->sin_addr.s_addr == u->address.s_addr)
+				return;
+			if (rtm->rtm_type == RTM_DELADDR &&
+			    u->address.s_addr != htonl(INADDR_ANY) &&
+			    sin->sin_addr.s_addr != u->address.s_addr)
+				return;
+		}
+		schedule_check(env);
 		break;
 	case RTM_IFANNOUNCE:
 		ifan = (struct if_announcemsghdr *)rtm;
+		if ((size_t)len < sizeof(*ifan))
+			return;
 		/* Interface got destroyed (PPPoE, etc.) */
 		if ((ifan->ifan_what == IFAN_DEPARTURE)
-		    && (strcmp(env->sc_interface, ifan->ifan_name) == 0))
-			check_interface(env);
+		    && find_uplink(env, ifan->ifan_name,
+		    strnlen(ifan->ifan_name, sizeof(ifan->ifan_name))) != NULL)
+			schedule_check(env);
 		break;
 	default:
 		return;
@@ -297,120 +1606,345 @@ route_handler(int fd, short event, void *arg)
 	}
 }
 
+/* The uplink on the interface named by the first len bytes of name */
+struct uplink *
+find_uplink(struct natpmpd *env, const char *name, size_t len)
+{
+	struct uplink	*u;
+	u_int		 i;
+
+	for (i = 0; i < env->sc_nuplinks; i++) {
+		u = &env->sc_uplinks[i];
+		if (strlen(u->name) == len && strncmp(u->name, name, len) == 0)
+			return (u);
+	}
+
+	return (NULL);
+}
+
+/* Pick out the addresses following a routing message, up to end */
+void
+get_rtaddrs(int addrs, struct sockaddr *sa, char *end,
+    struct sockaddr **rti_info)
+{
+	int	 i;
+
+	for (i = 0; i < RTAX_MAX; i++) {
+		rti_info[i] = NULL;
+		if ((addrs & (1 << i)) == 0)
+			continue;
+		if ((char *)sa + sizeof(sa->sa_len) > end ||
+		    (char *)sa + SA_RLEN(sa) > end) {
+			addrs = 0;
+			continue;
+		}
+		rti_info[i] = sa;
+		sa = (struct sockaddr *)((char *)sa + SA_RLEN(sa));
+	}
+}
+
+void
+schedule_check(struct natpmpd *env)
+{
+	struct timeval	 tv;
+
+	if (evtimer_pending(&env->sc_ifcheck_ev, NULL))
+		return;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = NATPMPD_IFCHECK_DELAY * 1000;
+	evtimer_add(&env->sc_ifcheck_ev, &tv);
+}
+
+void
+check_timeout(int fd, short event, void *arg)
+{
+	check_interface((struct natpmpd *)arg);
+}
+
+/* Take a mapping out of service, it is freed once its rule is gone */
+void
+remove_mapping(struct mapping *m, u_int8_t event)
+{
+	mapping_event(event, m);
+	unlink_mapping(m);
+	m->flags |= MAPPING_F_DEAD;
+	queue_change(m);
+}
+
+/* Tell anyone monitoring what has become of a mapping */
+void
+mapping_event(u_int8_t type, struct mapping *m)
+{
+	struct ctl_event	*ev;
+
+	if ((ev = control_event(type)) == NULL)
+		return;
+
+	ev->proto = m->proto;
+	ev->uplink = m->uplink;
+	ev->id = get_mapping_info(m)->id;
+	get_mapping_addr(m, &ev->addr);
+	ev->lifetime = (m->expires > ev->time) ? m->expires - ev->time : 0;
+}
+
+/* The external port asked for was taken, m is what was made instead */
+void
+collision_event(u_int8_t uplink, u_int8_t proto, struct sockaddr_in *rdr,
+    struct sockaddr_in *dst, u_int32_t lifetime, struct mapping *m)
+{
+	struct ctl_event	*ev;
+
+	if ((ev = control_event(EVENT_COLLISION)) == NULL)
+		return;
+
+	ev->proto = proto;
+	ev->uplink = uplink;
+	ev->id = (m != NULL) ? get_mapping_info(m)->id : 0;
+	ev->addr.ma_af = AF_INET;
+	ev->addr.ma_rdr = rdr->sin_addr;
+	ev->addr.ma_rdr_port = rdr->sin_port;
+	ev->addr.ma_dst = dst->sin_addr;
+	ev->addr.ma_dst_port = dst->sin_port;
+	ev->lifetime = lifetime;
+}
+
+/* Remove every mapping, returning how many there were */
+u_int
+flush_mappings(struct natpmpd *env)
+{
+	struct mapping	*m;
+	u_int		 count;
+
+	count = 0;
+	for (m = first_mapping(); m != NULL; m = next_mapping(m)) {
+		remove_mapping(m, EVENT_DELETED);
+		count++;
+	}
+	schedule_commit(env);
+
+	return (count);
+}
+
 int
-natpmp_remove_mapping(u_int8_t proto, struct sockaddr_in *rdr)
+natpmp_remove_mapping(u_int8_t uplink, u_int8_t proto,
+    struct sockaddr_in *rdr)
 {
-	struct sockaddr_in	*sa;
-	struct mapping		*m;
+	struct mapping		*m, *next;
 	int			 count;
 
-	count = 0;
-	for (m = LIST_FIRST(&mappings); m; m = LIST_NEXT(m, entry)) {
-		sa = (struct sockaddr_in *)&m->rdr;
-		if ((m->proto == proto)
-		    && (memcmp(&sa->sin_addr, &rdr->sin_addr, sizeof(struct in_addr)) == 0)
-		    && ((rdr->sin_port == 0)
-			|| (sa->sin_port == rdr->sin_port))) {
-
-			/* Remove the expiry timer */
-			if (evtimer_pending(&m->ev, NULL))
-				evtimer_del(&m->ev);
-
-			/* Remove the mapping */
-			LIST_REMOVE(m, entry);
-			free(m);
+	if (rdr->sin_port != 0) {
+		if ((m = lookup_mapping(uplink, proto, rdr->sin_addr,
+		    rdr->sin_port)) == NULL)
+			return (0);
+		remove_mapping(m, EVENT_DELETED);
+		return (1);
+	}
 
-			count++;
-		}
+	count = 0;
+	for (m = first_mapping_addr(rdr->sin_addr); m; m = next) {
+		next = next_mapping_addr(m);
+		if (m->uplink != uplink || m->proto != proto)
+			continue;
+		remove_mapping(m, EVENT_DELETED);
+		count++;
 	}
 
 	return (count);
 }
 
+/*
+ * Create a mapping, or refresh the one already there.  A PCP client
+ * passes its nonce, which is given to the mapping, and can insist on the
+ * exact external port it asked for.
+ */
 int
-natpmp_create_mapping(u_int8_t proto, struct sockaddr_in *rdr,
-    struct sockaddr_in *dst, u_int32_t lifetime)
+natpmp_create_mapping(u_int8_t uplink, u_int8_t proto,
+    struct sockaddr_in *rdr, struct sockaddr_in *dst, u_int32_t lifetime,
+    const u_int8_t *nonce, int exact)
 {
 	struct mapping		*m;
 	struct mapping		*r;
-	struct timeval		 tv;
-	struct sockaddr_in	*sa;
+	struct mapping_addr	 ma;
+	in_port_t		 port;
+	time_t			 expires;
+	int			 collision = 0;
 
-	memset(&tv, 0, sizeof(tv));
-	tv.tv_sec = lifetime;
+	expires = clock_now() + lifetime;
 
-	/* Check for any mapping for the given internal address and port.
-	 * Remember any matching mapping where the internal address and port
-	 * match, but for a different protocol
-	 */
-	for (m = LIST_FIRST(&mappings), r = NULL; m; m = LIST_NEXT(m, entry)) {
-		if ((m->proto != proto) &&
-		    (memcmp(&m->rdr, rdr, sizeof(m->rdr)) == 0))
-			r = m;
-		if ((m->proto == proto) &&
-		    (memcmp(&m->rdr, rdr, sizeof(m->rdr)) == 0))
-			break;
-	}
-
-	if (m != NULL) {
+	/* Check for any mapping for the given internal address and port */
+	if ((m = lookup_mapping(uplink, proto, rdr->sin_addr,
+	    rdr->sin_port)) != NULL) {
 		/*
 		 * Update the requested external port from the live mapping 
 		 * if it differs.
 		 */
-		if (memcmp(&m->dst, dst, sizeof(m->dst)) != 0) {
-			fprintf(stderr, "Existing mapping with different port\n");
-			sa = (struct sockaddr_in *)&m->dst;
-			dst->sin_port = sa->sin_port;
+		if (m->dst_port != dst->sin_port) {
+			log_debug("existing mapping with different port");
+			dst->sin_port = m->dst_port;
 		}
 
-		/* Refresh the expiry timer */
-		if (evtimer_pending(&m->ev, NULL))
-			evtimer_del(&m->ev);
-		evtimer_add(&m->ev, &tv);
+		/* Refresh the expiry time */
+		refresh_mapping(m, expires);
+		relabel_mapping(m, lifetime);
+		if (nonce != NULL)
+			memcpy(get_mapping_info(m)->nonce, nonce,
+			    PCP_NONCE_LEN);
+		mapping_event(EVENT_REFRESHED, m);
 
 		return (0);
 	}
 
-	if((m = init_mapping()) == NULL)
-		fatal("init_mapping");
+	/* Remember any mapping where the internal address and port match,
+	 * but for a different protocol
+	 */
+	r = lookup_mapping(uplink,
+	    (proto == IPPROTO_UDP) ? IPPROTO_TCP : IPPROTO_UDP,
+	    rdr->sin_addr, rdr->sin_port);
 
 	/* If we found a "related" mapping use the port from that as per the
-	 * draft, otherwise conjure up a random one
+	 * draft, otherwise try the client's preferred port before falling
+	 * back to a random free one
 	 */
-	if (r != NULL) {
-		sa = (struct sockaddr_in *)&r->dst;
-		dst->sin_port = sa->sin_port;
-	} else
-		/* Check for collisions? */
-		dst->sin_port = htons(IPPORT_HIFIRSTAUTO +
-		    arc4random_uniform(IPPORT_HILASTAUTO - IPPORT_HIFIRSTAUTO));
+	port = 0;
+	if (r != NULL && !exact) {
+		port = find_port(uplink, proto, r->dst_port);
+		if (port != r->dst_port)
+			port = 0;
+	}
+	if (port == 0) {
+		port = find_port(uplink, proto, dst->sin_port);
+		collision = (dst->sin_port != 0 && port != dst->sin_port);
+	}
+	if (port == 0 || (exact && collision)) {
+		if (collision)
+			collision_event(uplink, proto, rdr, dst, lifetime,
+			    NULL);
+		return (-1);
+	}
+
+	/* Any mapping looked up before this may have moved */
+	if ((m = init_mapping()) == NULL)
+		fatal("init_mapping");
+
+	memset(&ma, 0, sizeof(ma));
+	ma.ma_af = AF_INET;
+	ma.ma_rdr = rdr->sin_addr;
+	ma.ma_rdr_port = rdr->sin_port;
+	ma.ma_dst = dst->sin_addr;
+	ma.ma_dst_port = port;
 
 	m->proto = proto;
-	memcpy(&m->dst, dst, sizeof(m->dst));
-	memcpy(&m->rdr, rdr, sizeof(m->rdr));
+	m->uplink = uplink;
+	set_mapping_addr(m, &ma);
+	m->expires = expires;
+	if (nonce != NULL)
+		memcpy(get_mapping_info(m)->nonce, nonce, PCP_NONCE_LEN);
+	link_mapping(m);
+
+	queue_change(m);
+	mapping_event(EVENT_CREATED, m);
+	if (collision)
+		collision_event(uplink, proto, rdr, dst, lifetime, m);
+	dst->sin_port = port;
+
+	return (1);
+}
 
-	evtimer_set(&m->ev, expire_mapping, m);
-	evtimer_add(&m->ev, &tv);
+int
+natpmp_remove_pinhole(u_int8_t uplink, u_int8_t proto,
+    struct sockaddr_in6 *rdr)
+{
+	struct mapping	*m;
+
+	if ((m = lookup_mapping6(uplink, proto, &rdr->sin6_addr,
+	    rdr->sin6_port)) == NULL)
+		return (0);
+	remove_mapping(m, EVENT_DELETED);
 
 	return (1);
 }
 
-ssize_t
-natpmp_mapping(struct natpmp_response *response, u_int8_t proto,
-    struct sockaddr_in *rdr, struct sockaddr_in *dst, u_int32_t lifetime,
-    struct natpmpd *env)
+/*
+ * Open a pinhole through to an IPv6 host, or refresh the one already
+ * there.  Nothing is translated so there is no port to pick.
+ */
+int
+natpmp_create_pinhole(u_int8_t uplink, u_int8_t proto,
+    struct sockaddr_in6 *rdr, u_int32_t lifetime, const u_int8_t *nonce)
 {
-	int				 count;
-	char				 rdr_ip[INET_ADDRSTRLEN];
-	char				 dst_ip[INET_ADDRSTRLEN];
+	struct mapping		*m;
+	struct mapping_addr	 ma;
+	time_t			 expires;
+
+	expires = clock_now() + lifetime;
+
+	if ((m = lookup_mapping6(uplink, proto, &rdr->sin6_addr,
+	    rdr->sin6_port)) != NULL) {
+		refresh_mapping(m, expires);
+		relabel_mapping(m, lifetime);
+		if (nonce != NULL)
+			memcpy(get_mapping_info(m)->nonce, nonce,
+			    PCP_NONCE_LEN);
+		mapping_event(EVENT_REFRESHED, m);
+		return (0);
+	}
+
+	if ((m = init_mapping()) == NULL)
+		fatal("init_mapping");
+
+	memset(&ma, 0, sizeof(ma));
+	ma.ma_af = AF_INET6;
+	ma.ma_addr6 = rdr->sin6_addr;
+	ma.ma_rdr_port = ma.ma_dst_port = rdr->sin6_port;
 
-	inet_ntop(AF_INET, &rdr->sin_addr, rdr_ip, INET_ADDRSTRLEN);
-	inet_ntop(AF_INET, &dst->sin_addr, dst_ip, INET_ADDRSTRLEN);
+	m->proto = proto;
+	m->uplink = uplink;
+	set_mapping_addr(m, &ma);
+	m->expires = expires;
+	if (nonce != NULL)
+		memcpy(get_mapping_info(m)->nonce, nonce, PCP_NONCE_LEN);
+	link_mapping(m);
+
+	queue_change(m);
+	mapping_event(EVENT_CREATED, m);
+
+	return (1);
+}
+
+/*
+ * A mapping request, decoded.  Most are renewals, answered without the
+ * internal and external addresses ever being put together.
+ */
+void
+natpmp_mapping(struct natpmpd *env, struct natpmp_slot *slot, u_int8_t proto,
+    struct natpmp_packet *request, struct natpmp_packet *response)
+{
+	struct uplink		*u = &env->sc_uplinks[slot->uplink];
+	struct sockaddr_in	*client = (struct sockaddr_in *)&slot->ss;
+	struct mapping		*m;
+	struct sockaddr_in	 rdr, dst;
+	int			 count;
+	char			 rdr_ip[INET_ADDRSTRLEN];
+	char			 dst_ip[INET_ADDRSTRLEN];
 
-	log_info("%s request, %s:%d -> %s:%d, expires in %d seconds",
-	    (proto == IPPROTO_UDP) ? "UDP" : "TCP",
-	    dst_ip, ntohs(dst->sin_port), rdr_ip, ntohs(rdr->sin_port),
-	    ntohl(lifetime));
+	/*
+	 * Never longer than the server allows, that's what's granted and
+	 * so what the response says.
+	 */
+	if (request->lifetime > env->sc_limit_lifetime)
+		request->lifetime = env->sc_limit_lifetime;
+
+	/* Don't format anything that's not going to be logged */
+	if (log_check(LOGC_REQUEST, LOG_INFO)) {
+		inet_ntop(AF_INET, &client->sin_addr, rdr_ip, INET_ADDRSTRLEN);
+		inet_ntop(AF_INET, &u->address, dst_ip, INET_ADDRSTRLEN);
+
+		log_info("%s request, %s:%d -> %s:%d, expires in %u seconds",
+		    (proto == IPPROTO_UDP) ? "UDP" : "TCP",
+		    dst_ip, ntohs(request->ext_port), rdr_ip,
+		    ntohs(request->int_port), request->lifetime);
+	}
 
 	/* From the spec:
 	 *
@@ -425,116 +1959,166 @@ natpmp_mapping(struct natpmp_response *response, u_int8_t proto,
 	 * |   *   |       |   *   |       |   *   |       | Delete all
 	 * +-------+-------+-------+-------+-------+-------+
 	 */
-	count = 0;
-	if (rdr->sin_port > 0) {
-		if (lifetime > 0) {
-			/* Create mapping with preferred or random port */
-			count = natpmp_create_mapping(proto, rdr, dst,
-			    ntohl(lifetime));
+	response->int_port = request->int_port;
+	response->ext_port = 0;
+	response->lifetime = 0;
+
+	/* A client asking too often gets nothing done for it at all */
+	if (!client_allow(env, (struct sockaddr *)&slot->ss)) {
+		if (log_check(LOGC_REQUEST, LOG_DEBUG))
+			log_debug("rate limiting %s",
+			    log_sockaddr((struct sockaddr *)&slot->ss));
+		response->result = NATPMPD_NO_RESOURCES;
+		return;
+	}
+
+	/*
+	 * By far the most common request is a client renewing a mapping it
+	 * already has, which only needs the expiry pushing back.
+	 */
+	if (request->int_port > 0 && request->lifetime > 0 &&
+	    (m = lookup_mapping(slot->uplink, proto, client->sin_addr,
+	    request->int_port)) != NULL && m->dst_port == request->ext_port) {
+		refresh_mapping(m, clock_now() + request->lifetime);
+		relabel_mapping(m, request->lifetime);
+		stats.renewals++;
+		mapping_event(EVENT_REFRESHED, m);
+
+		response->ext_port = request->ext_port;
+		response->lifetime = request->lifetime;
+		return;
+	}
 
-			response->data.mapping.port[0] = rdr->sin_port;
-			response->data.mapping.port[1] = dst->sin_port;
-			response->data.mapping.lifetime = lifetime;
+	memcpy(&rdr, client, sizeof(rdr));
+	rdr.sin_port = request->int_port;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_len = sizeof(struct sockaddr_in);
+	dst.sin_family = AF_INET;
+	dst.sin_addr = u->address;
+	dst.sin_port = request->ext_port;
+
+	if (rdr.sin_port > 0) {
+		if (request->lifetime > 0) {
+			/* Create mapping with preferred or random port */
+			if (lookup_mapping(slot->uplink, proto, rdr.sin_addr,
+			    rdr.sin_port) == NULL &&
+			    !client_quota(env, (struct sockaddr *)&rdr)) {
+				if (log_check(LOGC_MAPPING, LOG_INFO))
+					log_info("%s is over its mapping "
+					    "quota", log_sockaddr(
+					    (struct sockaddr *)&rdr));
+				count = -1;
+			} else if ((count = natpmp_create_mapping(slot->uplink,
+			    proto, &rdr, &dst, request->lifetime, NULL,
+			    0)) == -1 && log_check(LOGC_MAPPING, LOG_CRIT))
+				log_warnx("no free ports for mapping");
+
+			/* Over quota, or every external port is in use */
+			if (count == -1)
+				response->result = NATPMPD_NO_RESOURCES;
+			else {
+				response->ext_port = dst.sin_port;
+				response->lifetime = request->lifetime;
+			}
 		} else {
 			/* Delete single mapping */
-			count = natpmp_remove_mapping(proto, rdr);
+			count = natpmp_remove_mapping(slot->uplink, proto,
+			    &rdr);
 
-			if (count > 1)
-				log_warn("%d mappings removed", count);
-			else
+			if (count > 1 && log_check(LOGC_MAPPING, LOG_CRIT))
+				log_warnx("%d mappings removed", count);
+			else if (log_check(LOGC_MAPPING, LOG_INFO))
 				log_info("mapping removed");
-
-			response->data.mapping.port[0] = rdr->sin_port;
-			response->data.mapping.port[1] = 0;
-			response->data.mapping.lifetime = 0;
 		}
 	} else {
 		/* Delete all mappings */
-		count = natpmp_remove_mapping(proto, rdr);
-
-		log_info("%d mappings removed", count);
+		count = natpmp_remove_mapping(slot->uplink, proto, &rdr);
 
-		response->data.mapping.port[0] = 0;
-		response->data.mapping.port[1] = 0;
-		response->data.mapping.lifetime = 0;
+		if (log_check(LOGC_MAPPING, LOG_INFO))
+			log_info("%d mappings removed", count);
 	}
-
-	if (count)
-		if (rebuild_rules() == -1)
-			log_warn("unable to rebuild ruleset");
-
-	return (16);
 }
 
-void
-natpmp_handler(int fd, short event, void *arg)
+/* Each protocol version we speak, indexed by the version number */
+static ssize_t	(*const versions[])(struct natpmpd *, struct natpmp_slot *) = {
+	[NATPMP_VERSION] =	natpmp_request_v0,
+	[PCP_VERSION] =		pcp_request
+};
+
+/*
+ * Hand the request to whichever version it is for.  Anything else gets
+ * told which version we'd rather it spoke, in a PCP response.
+ */
+ssize_t
+natpmp_request(struct natpmpd *env, struct natpmp_slot *slot)
 {
-	struct natpmpd		*env = (struct natpmpd *)arg;
-	struct sockaddr_storage	 ss;
-	u_int8_t		 request_storage[NATPMPD_MAX_PACKET_SIZE];
-	u_int8_t		 response_storage[NATPMPD_MAX_PACKET_SIZE];
-	struct natpmp_request	*request;
-	struct natpmp_response	*response;
-	socklen_t		 slen;
-	ssize_t			 len;
-	struct sockaddr_in	 dst;
-	struct sockaddr_in	 rdr;
-	u_int8_t		 proto;
-	char			 src_ip[INET_ADDRSTRLEN];
+	u_int8_t		 version;
 
-	slen = sizeof(ss);
-	if ((len = recvfrom(fd, request_storage, sizeof(request_storage), 0,
-	    (struct sockaddr *)&ss, &slen)) < 1 )
-		return;
+	/* Need at least 2 bytes to be able to do anything useful */
+	if (slot->len < 2) {
+		stats.dropped++;
+		return (0);
+	}
 
-	inet_ntop(AF_INET, &((struct sockaddr_in *)&ss)->sin_addr, src_ip,
-	    INET_ADDRSTRLEN);
+	version = slot->request[0];
+	if (version < sizeof(versions) / sizeof(versions[0]) &&
+	    versions[version] != NULL)
+		return (versions[version](env, slot));
 
-	/* Need at least 2 bytes to be able to do anything useful */
-	if (len < 2)
-		return;
+	if (log_check(LOGC_REQUEST, LOG_CRIT))
+		log_warnx("ignoring version %d request from %s", version,
+		    log_sockaddr((struct sockaddr *)&slot->ss));
 
-	assert(sizeof(struct natpmp_request) <= NATPMPD_MAX_PACKET_SIZE);
-	assert(sizeof(struct natpmp_response) <= NATPMPD_MAX_PACKET_SIZE);
+	return (pcp_unsupported(env, slot));
+}
 
-	request = (struct natpmp_request *)&request_storage;
-	response = (struct natpmp_response *)&response_storage;
-	response->version = NATPMPD_MAX_VERSION;
-	response->sssoe = htonl(sssoe(env));
+ssize_t
+natpmp_request_v0(struct natpmpd *env, struct natpmp_slot *slot)
+{
+	struct natpmp_packet	 request, response;
+	ssize_t			 len = slot->len, rlen;
+	struct uplink		*u = &env->sc_uplinks[slot->uplink];
+	u_int8_t		 proto;
 
-	/* No opcode in a request should be greater than 127 */
-	if (request->opcode & 0x80)
-		return;
+	natpmp_decode(slot->request, len, &request);
 
-	if (request->version > NATPMPD_MAX_VERSION) {
-		log_warnx("ignoring version %d request from %s:%d",
-		    request->version, src_ip,
-		    ntohs(((struct sockaddr_in *)&ss)->sin_port));
+	/* No opcode in a request should be greater than 127 */
+	if (request.opcode & 0x80) {
+		stats.dropped++;
+		return (0);
+	}
 
-		response->opcode = 0x80;
-		response->result = NATPMPD_BAD_VERSION;
-		len = sendto(fd, response_storage, 8, 0,
-		    (struct sockaddr *)&ss, slen);
-		return;
+	/* NAT-PMP is IPv4 only, an IPv6 client has to use PCP */
+	if (slot->ss.ss_family != AF_INET) {
+		stats.dropped++;
+		return (0);
 	}
 
+	/* Set the MSB of the opcode to indicate a response */
+	memset(&response, 0, sizeof(response));
+	response.version = NATPMP_VERSION;
+	response.opcode = request.opcode | 0x80;
+	response.sssoe = sssoe(env);
+
 	/* We don't have an external address */
-	if (env->sc_address.s_addr == htonl(INADDR_ANY))
-		response->result = NATPMPD_NETWORK_FAILURE;
+	if (u->address.s_addr == htonl(INADDR_ANY))
+		response.result = NATPMPD_NETWORK_FAILURE;
 	else
-		response->result = NATPMPD_SUCCESS;
+		response.result = NATPMPD_SUCCESS;
 
 	proto = 0;
-	switch (request->opcode) {
+	switch (request.opcode) {
 	case 0:
-		if (len != 2) {
-			log_warn("address request, expected 2 bytes, got %d",
-			    len);
-			return;
+		if (len != NATPMP_HDR_LEN) {
+			if (log_check(LOGC_REQUEST, LOG_CRIT))
+				log_warnx("address request, expected %d bytes, "
+				    "got %zd", NATPMP_HDR_LEN, len);
+			stats.dropped++;
+			return (0);
 		}
 
-		response->data.announce.address = env->sc_address.s_addr;
-		len = 12;
+		response.address = u->address;
 		break;
 	case 1:
 		proto = IPPROTO_UDP;
@@ -543,50 +2127,388 @@ natpmp_handler(int fd, short event, void *arg)
 		if (proto == 0)
 			proto = IPPROTO_TCP;
 
-		if (len != 12) {
-			log_warn("mapping request, expected 12 bytes, got %d",
-			    len);
-			return;
+		if (len != NATPMP_MAP_LEN) {
+			if (log_check(LOGC_REQUEST, LOG_CRIT))
+				log_warnx("mapping request, expected %d bytes, "
+				    "got %zd", NATPMP_MAP_LEN, len);
+			stats.dropped++;
+			return (0);
 		}
 
-		memcpy(&rdr, &ss, sizeof(rdr));
-		memcpy(&rdr.sin_port, &request->port[0], sizeof(u_int16_t));
-
-		memset(&dst, 0, sizeof(dst));
-		dst.sin_family = AF_INET;
-		dst.sin_addr = env->sc_address;
-		memcpy(&dst.sin_port, &request->port[1], sizeof(u_int16_t));
+		/* Only the parent can touch the mappings */
+		if (env->sc_worker) {
+			natpmp_forward(env, slot);
+			return (0);
+		}
 
-		len = natpmp_mapping(response, proto, &rdr, &dst,
-		    request->lifetime, env);
+		natpmp_mapping(env, slot, proto, &request, &response);
 		break;
 	default:
 		/* Unsupported opcodes get the whole request returned */
-		memcpy(response, request, len);
-		response->result = NATPMPD_BAD_OPCODE;
+		memcpy(slot->response, slot->request, len);
+		response.result = NATPMPD_BAD_OPCODE;
 		break;
 	}
 
-	/* Set the MSB of the opcode to indicate a response */
-	response->opcode = request->opcode | 0x80;
+	stats.requests[(request.opcode < STATS_OPCODES - 1) ?
+	    request.opcode : STATS_OPCODES - 1]++;
+	stats.results[response.result]++;
+
+	/* Anything after the header of an unknown one is left as it came */
+	rlen = natpmp_encode(slot->response, &response);
+	if (request.opcode > 2 && len > rlen)
+		rlen = len;
+
+	return (rlen);
+}
+
+/*
+ * Read up to a batch worth of requests off the socket, returning how many
+ * were read.
+ */
+u_int
+natpmp_recv(int fd, u_int uplink)
+{
+	struct natpmp_slot	*slot;
+	u_int			 i, n;
+#ifdef MSG_WAITFORONE
+	int			 count;
+
+	for (i = 0; i < nslots; i++) {
+		slot = &slots[i];
+		slot->fd = fd;
+		slot->uplink = uplink;
+		slot->worker = 0;
+		slot->iov.iov_base = slot->request;
+		slot->iov.iov_len = sizeof(slot->request);
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name = &slot->ss;
+		msgs[i].msg_hdr.msg_namelen = sizeof(slot->ss);
+		msgs[i].msg_hdr.msg_iov = &slot->iov;
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	if ((count = recvmmsg(fd, msgs, nslots, MSG_DONTWAIT, NULL)) < 1)
+		return (0);
+
+	for (i = 0, n = count; i < n; i++) {
+		slots[i].slen = msgs[i].msg_hdr.msg_namelen;
+		slots[i].len = msgs[i].msg_len;
+	}
+#else
+	for (n = 0; n < nslots; n++) {
+		slot = &slots[n];
+		slot->fd = fd;
+		slot->uplink = uplink;
+		slot->worker = 0;
+		slot->slen = sizeof(slot->ss);
+		if ((slot->len = recvfrom(fd, slot->request,
+		    sizeof(slot->request), 0, (struct sockaddr *)&slot->ss,
+		    &slot->slen)) == -1)
+			break;
+	}
+#endif
+
+	return (n);
+}
+
+/* Send the responses in the first n slots, skipping any without one */
+void
+natpmp_send(int fd, struct natpmp_slot *batch, u_int n)
+{
+	struct natpmp_slot	*slot;
+	u_int			 i;
+#ifdef MSG_WAITFORONE
+	u_int			 count;
+	int			 sent;
+
+	for (i = 0, count = 0; i < n; i++) {
+		slot = &batch[i];
+		if (slot->rlen == 0)
+			continue;
+		slot->iov.iov_base = slot->response;
+		slot->iov.iov_len = slot->rlen;
+		memset(&msgs[count], 0, sizeof(msgs[count]));
+		msgs[count].msg_hdr.msg_name = &slot->ss;
+		msgs[count].msg_hdr.msg_namelen = slot->slen;
+		msgs[count].msg_hdr.msg_iov = &slot->iov;
+		msgs[count].msg_hdr.msg_iovlen = 1;
+		count++;
+	}
+
+	/* On error skip the datagram that failed and carry on */
+	for (i = 0; i < count; i += (sent > 0) ? sent : 1)
+		sent = sendmmsg(fd, &msgs[i], count - i, 0);
+#else
+	for (i = 0; i < n; i++) {
+		slot = &batch[i];
+		if (slot->rlen == 0)
+			continue;
+		sendto(fd, slot->response, slot->rlen, 0,
+		    (struct sockaddr *)&slot->ss, slot->slen);
+	}
+#endif
+}
+
+/*
+ * Drain a batch of requests from the socket.  Any response reporting a
+ * ruleset change is held back until that change has been committed, the
+ * rest are sent straight away.
+ */
+void
+natpmp_handler(int fd, short event, void *arg)
+{
+	struct natpmpd		*env = (struct natpmpd *)arg;
+	struct listen_addr	*la;
+	struct timespec		 start, end;
+	u_int32_t		 gen;
+	u_int			 i, n;
+
+	/* Everything in the batch is handled as of the same time */
+	start = *clock_update();
+
+	/* There are only ever a handful of sockets */
+	TAILQ_FOREACH(la, &env->listen_addrs, entry)
+		if (la->fd == fd)
+			break;
+	if (la == NULL)
+		return;
+
+	if ((n = natpmp_recv(fd, la->uplink)) == 0)
+		return;
+
+	for (i = 0; i < n; i++) {
+		gen = changes_gen;
+		slots[i].rlen = natpmp_request(env, &slots[i]);
+		if (slots[i].rlen > 0 && gen != changes_gen) {
+			defer_response(env, &slots[i]);
+			slots[i].rlen = 0;
+		}
+
+		/* Enough changes have built up, don't wait any longer */
+		if (env->sc_commit_delay > 0 &&
+		    nchanges >= env->sc_commit_max)
+			flush_changes(env);
+	}
+
+	if (env->sc_worker)
+		imsg_event_add(env->sc_iev_parent);
+	else
+		schedule_commit(env);
+
+	natpmp_send(fd, slots, n);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	record_latency(&start, &end);
+}
+
+/* Histogram of time spent per batch, in power of two microseconds */
+void
+record_latency(struct timespec *start, struct timespec *end)
+{
+	struct timespec	 ts;
+	u_int64_t	 usec;
+	u_int		 i;
+
+	timespecsub(end, start, &ts);
+	usec = (u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	for (i = 0; usec > 0 && i < STATS_LATENCY - 1; i++)
+		usec >>= 1;
+	stats.latency[i]++;
+}
+
+/* Pass a mapping request from a worker up to the parent */
+void
+natpmp_forward(struct natpmpd *env, struct natpmp_slot *slot)
+{
+	struct natpmp_msg	 msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.fd = slot->fd;
+	msg.uplink = slot->uplink;
+	msg.slen = slot->slen;
+	memcpy(&msg.ss, &slot->ss, sizeof(msg.ss));
+	msg.len = slot->len;
+	memcpy(msg.data, slot->request, slot->len);
+
+	if (imsg_compose(&env->sc_iev_parent->ibuf, IMSG_REQUEST, 0, 0, -1,
+	    &msg, sizeof(msg)) == -1)
+		log_warn("natpmp_forward");
+}
+
+/*
+ * Send a response either straight out of the listening socket or back
+ * down to the worker that owns it.
+ */
+void
+natpmp_reply(struct natpmpd *env, int fd, u_int worker,
+    struct sockaddr_storage *ss, socklen_t slen, u_int8_t *response,
+    ssize_t len)
+{
+	struct natpmp_msg	 msg;
+
+	if (worker == 0) {
+		sendto(fd, response, len, 0, (struct sockaddr *)ss, slen);
+		return;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.fd = fd;
+	msg.slen = slen;
+	memcpy(&msg.ss, ss, sizeof(msg.ss));
+	msg.len = len;
+	memcpy(msg.data, response, len);
+
+	if (imsg_compose(&env->sc_iev_workers[worker - 1].ibuf,
+	    IMSG_RESPONSE, 0, 0, -1, &msg, sizeof(msg)) == -1)
+		log_warn("natpmp_reply");
+}
+
+void
+flush_workers(struct natpmpd *env)
+{
+	u_int	 i;
+
+	for (i = 0; i < env->sc_workers; i++)
+		if (env->sc_iev_workers[i].ibuf.w.queued)
+			imsg_event_add(&env->sc_iev_workers[i]);
+}
+
+/*
+ * Mapping requests forwarded by a worker, handled just as if they had
+ * been read off one of our own sockets.
+ */
+void
+natpmp_dispatch_worker(int fd, short event, void *arg)
+{
+	struct imsgev		*iev = (struct imsgev *)arg;
+	struct natpmpd		*env = (struct natpmpd *)iev->data;
+	struct imsgbuf		*ibuf = &iev->ibuf;
+	struct imsg		 imsg;
+	struct natpmp_msg	 msg;
+	struct natpmp_slot	 slot;
+	u_int32_t		 gen;
+	ssize_t			 n;
+	u_int			 worker;
+
+	worker = iev - env->sc_iev_workers + 1;
+
+	if (event & EV_READ) {
+		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
+			fatal("imsg_read error");
+		if (n == 0) {
+			/* connection closed */
+			log_warnx("lost worker %u", worker);
+			shutdown_natpmpd(env);
+			log_async(0);
+			exit(1);
+		}
+	}
+	if (event & EV_WRITE) {
+		if ((n = msgbuf_write(&ibuf->w)) == -1 && errno != EAGAIN)
+			fatal("msgbuf_write");
+	}
+
+	/* Forwarded requests are handled as of now, like a batch */
+	clock_update();
+
+	for (;;) {
+		if ((n = imsg_get(ibuf, &imsg)) == -1)
+			fatal("natpmp_dispatch_worker: imsg_get error");
+		if (n == 0)
+			break;
+
+		switch (imsg.hdr.type) {
+		case IMSG_REQUEST:
+			if (imsg.hdr.len != IMSG_HEADER_SIZE + sizeof(msg))
+				fatalx("natpmp_dispatch_worker: "
+				    "invalid request");
+			memcpy(&msg, imsg.data, sizeof(msg));
+			if (msg.len > sizeof(msg.data) ||
+			    msg.slen > sizeof(msg.ss) ||
+			    msg.uplink >= env->sc_nuplinks)
+				fatalx("natpmp_dispatch_worker: "
+				    "invalid request length");
+
+			memset(&slot, 0, sizeof(slot));
+			slot.fd = msg.fd;
+			slot.uplink = msg.uplink;
+			slot.worker = worker;
+			memcpy(&slot.ss, &msg.ss, sizeof(slot.ss));
+			slot.slen = msg.slen;
+			slot.len = msg.len;
+			memcpy(slot.request, msg.data, msg.len);
+
+			gen = changes_gen;
+			if ((slot.rlen = natpmp_request(env, &slot)) > 0) {
+				if (gen != changes_gen)
+					defer_response(env, &slot);
+				else
+					natpmp_reply(env, slot.fd, worker,
+					    &slot.ss, slot.slen,
+					    slot.response, slot.rlen);
+			}
+
+			if (env->sc_commit_delay > 0 &&
+			    nchanges >= env->sc_commit_max)
+				flush_changes(env);
+			break;
+		case IMSG_STATS:
+			control_relay_stats(&imsg);
+			break;
+		default:
+			log_warnx("natpmp_dispatch_worker: unexpected "
+			    "imsg %d", imsg.hdr.type);
+			break;
+		}
+		imsg_free(&imsg);
+	}
+
+	schedule_commit(env);
 
-	len = sendto(fd, response_storage, len, 0, (struct sockaddr *)&ss, slen);
+	flush_workers(env);
+	imsg_event_add(iev);
+}
+
+void
+init_batch(struct natpmpd *env)
+{
+	nslots = env->sc_batch;
+	if ((slots = calloc(nslots, sizeof(*slots))) == NULL)
+		fatal("init_batch");
+
+	/* Enough for a batch beyond the point a commit is normally forced */
+	maxdeferred = maxcommitted = env->sc_batch + env->sc_commit_max;
+	if ((deferred = calloc(maxdeferred, sizeof(*deferred))) == NULL ||
+	    (committed = calloc(maxcommitted, sizeof(*committed))) == NULL)
+		fatal("init_batch");
+#ifdef MSG_WAITFORONE
+	if ((msgs = calloc(nslots, sizeof(*msgs))) == NULL)
+		fatal("init_batch");
+#endif
 }
 
 void
 check_interface(struct natpmpd *env)
+{
+	u_int	 i;
+
+	for (i = 0; i < env->sc_nuplinks; i++)
+		check_uplink(env, &env->sc_uplinks[i]);
+}
+
+void
+check_uplink(struct natpmpd *env, struct uplink *u)
 {
 	struct sockaddr_in	*ifaddr;
 	struct ifreq		 ifr;
-	int			 s;
+	struct uplink_address	 ua;
+	u_int			 i;
 
 	memset(&ifr, 0, sizeof(struct ifreq));
-	strncpy(ifr.ifr_name, env->sc_interface, IF_NAMESIZE);
-
-	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
-		fatal("socket");
+	strncpy(ifr.ifr_name, u->name, IF_NAMESIZE);
 
-	if (ioctl(s, SIOCGIFADDR, &ifr) == -1)
+	if (ioctl(env->sc_ifsock, SIOCGIFADDR, &ifr) == -1)
 		/* PPPoE device might not exist or be functional yet, etc. */
 		switch (errno) {
 		case ENXIO:
@@ -598,33 +2520,49 @@ check_interface(struct natpmpd *env)
 			/* NOTREACHED */
 		}
 
-	close(s);
-
 	if (ifr.ifr_addr.sa_family == AF_INET) {
 		ifaddr = (struct sockaddr_in *)&ifr.ifr_addr;
 
 		/* Primary address hasn't changed */
-		if (memcmp(&env->sc_address, &ifaddr->sin_addr,
+		if (memcmp(&u->address, &ifaddr->sin_addr,
 		    sizeof(struct in_addr)) == 0)
 			return;
 
-		memcpy(&env->sc_address, &ifaddr->sin_addr,
+		memcpy(&u->address, &ifaddr->sin_addr,
 		    sizeof(struct in_addr));
 	} else
-		env->sc_address.s_addr = htonl(INADDR_ANY);
+		u->address.s_addr = htonl(INADDR_ANY);
+
+	/* Workers answer address requests themselves */
+	memset(&ua, 0, sizeof(ua));
+	ua.uplink = u->id;
+	ua.address = u->address;
+	for (i = 0; i < env->sc_workers; i++) {
+		imsg_compose(&env->sc_iev_workers[i].ibuf, IMSG_ADDRESS, 0, 0,
+		    -1, &ua, sizeof(ua));
+		imsg_event_add(&env->sc_iev_workers[i]);
+	}
 
 	/* If the address changed again while we were still announcing the
 	 * old one, cancel the pending announcement before starting again
 	 */
-	if (evtimer_pending(&env->sc_announce_ev, NULL))
-		evtimer_del(&env->sc_announce_ev);
+	if (evtimer_pending(&u->announce_ev, NULL))
+		evtimer_del(&u->announce_ev);
+	if (evtimer_pending(&u->notify_ev, NULL))
+		evtimer_del(&u->notify_ev);
 
 	/* Don't announce an interface having 0.0.0.0 as an address */
-	if (env->sc_address.s_addr == htonl(INADDR_ANY))
+	if (u->address.s_addr == htonl(INADDR_ANY))
 		return;
 
-	env->sc_delay = 0;
-	evtimer_add(&env->sc_announce_ev, &timeouts[env->sc_delay]);
+	build_announce(env, u);
+	u->announce_pos = 0;
+	u->delay = 0;
+	evtimer_add(&u->announce_ev, &timeouts[u->delay]);
+
+	retarget_mappings(env, u);
+	if (u->nnotify > 0)
+		notify_clients(0, 0, u);
 }
 
 int
@@ -635,7 +2573,6 @@ main(int argc, char *argv[])
 	int			 noaction = 0;
 	const char		*conffile = CONF_FILE;
 	u_int			 flags = 0;
-	unsigned char		 loop = 0;
 	struct passwd		*pw;
 	struct event		 rt_ev;
 	int			 rt_fd;
@@ -645,6 +2582,8 @@ main(int argc, char *argv[])
 	struct event		 ev_sighup;
 	struct event		 ev_sigint;
 	struct event		 ev_sigterm;
+	u_int			 i, nlisten;
+	int			 restored;
 
 	log_init(1);	/* log to stderr until daemonized */
 
@@ -690,57 +2629,53 @@ main(int argc, char *argv[])
 		errx(1, "unknown user %s", NATPMPD_USER);
 
 	log_init(debug);
+	memcpy(log_level, env->sc_log_level, sizeof(log_level));
 
 	if (!debug) {
 		if (daemon(1, 0) == -1)
 			err(1, "failed to daemonize");
 	}
 
-	gettimeofday(&env->sc_starttime, NULL);
+	init_clock();
 
-	/* Initialise the packet filter and clear out our anchor */
-	init_filter(NULL, NULL, 0);
-	if (rebuild_rules() == -1)
-		fatal("rebuild_rules");
+	init_mappings(env);
+	init_limits();
+	init_batch(env);
 
-	for (la = TAILQ_FIRST(&env->listen_addrs); la; ) {
-		switch (la->sa.ss_family) {
-		case AF_INET:
-			if (((struct sockaddr_in *)&la->sa)->sin_port == 0)
-				((struct sockaddr_in *)&la->sa)->sin_port =
-				    htons(NATPMPD_SERVER_PORT);
-			break;
-		case AF_INET6:
-		default:
-			fatalx("king bula sez: af borked");
-		}
+	/* Everything to do with the packet filter happens in its own process */
+	if ((env->sc_iev_pfe = calloc(1, sizeof(struct imsgev))) == NULL)
+		fatal("calloc");
+	start_pfe(env, pw, env->sc_iev_pfe);
 
-		log_info("listening on %s:%d",
-		    log_sockaddr((struct sockaddr *)&la->sa),
-		    NATPMPD_SERVER_PORT);
+	/* Reloads need someone who can still read the configuration */
+	if ((env->sc_iev_reader = calloc(1, sizeof(struct imsgev))) == NULL)
+		fatal("calloc");
+	start_reader(env, conffile, env->sc_iev_reader);
 
-		if ((la->fd = socket(la->sa.ss_family, SOCK_DGRAM, 0)) == -1)
-			fatal("socket");
+	if (control_init() == -1)
+		fatalx("control socket setup failed");
 
-		if (fcntl(la->fd, F_SETFL, O_NONBLOCK) == -1)
-			fatal("fcntl");
+	/* Pick up where we left off, the snapshot lives outside the chroot */
+	if (env->sc_snapshot != NULL) {
+		if (state_open(env->sc_snapshot) == -1)
+			fatalx("cannot open snapshot");
+		if ((restored = state_load()) > 0)
+			log_info("restored %d mapping%s from %s", restored,
+			    (restored == 1) ? "" : "s", env->sc_snapshot);
+	}
 
-		if (setsockopt(la->fd, IPPROTO_IP, IP_MULTICAST_IF,
-		    &(((struct sockaddr_in *)&la->sa)->sin_addr),
-		    sizeof(struct in_addr)) == -1)
-			fatal("setsockopt");
+	/* Anything else still in the ruleset from the last run */
+	if ((restored = recover_mappings(env)) > 0)
+		log_info("recovered %d mapping%s from the ruleset", restored,
+		    (restored == 1) ? "" : "s");
 
-		if (setsockopt(la->fd, IPPROTO_IP, IP_MULTICAST_LOOP,
-		    &loop, sizeof(loop)) == -1)
-			fatal("setsockopt");
+	for (la = TAILQ_FIRST(&env->listen_addrs); la; ) {
+		if (set_listen_port(la) == -1)
+			fatalx("listen address of unknown family");
 
-		if (bind(la->fd, (struct sockaddr *)&la->sa,
-		    SA_LEN((struct sockaddr *)&la->sa)) == -1) {
+		if (open_listener(la) == -1) {
 			struct listen_addr	*nla;
 
-			log_warn("bind on %s failed, skipping",
-			    log_sockaddr((struct sockaddr *)&la->sa));
-			close(la->fd);
 			nla = TAILQ_NEXT(la, entry);
 			TAILQ_REMOVE(&env->listen_addrs, la, entry);
 			free(la);
@@ -753,6 +2688,12 @@ main(int argc, char *argv[])
 
 	if ((rt_fd = socket(PF_ROUTE, SOCK_RAW, 0)) < 0)
 		fatal("socket");
+	if (fcntl(rt_fd, F_SETFL, O_NONBLOCK) == -1)
+		fatal("fcntl");
+
+	/* Kept open for looking up the interface address */
+	if ((env->sc_ifsock = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+		fatal("socket");
 
 	/* Hopefully this is enough? */
 	rtfilter = ROUTE_FILTER(RTM_NEWADDR) | ROUTE_FILTER(RTM_DELADDR) |
@@ -773,6 +2714,31 @@ main(int argc, char *argv[])
 	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
 		fatal("cannot drop privileges");
 
+	/*
+	 * Share the listening sockets out between the workers, there's no
+	 * point having more workers than sockets.  SO_REUSEPORT isn't of
+	 * any use here as it doesn't spread unicast datagrams across the
+	 * sockets bound to the same address.
+	 */
+	nlisten = 0;
+	TAILQ_FOREACH(la, &env->listen_addrs, entry)
+		nlisten++;
+	if (env->sc_workers > nlisten) {
+		log_info("only %u listening sockets, using %u workers",
+		    nlisten, nlisten);
+		env->sc_workers = nlisten;
+	}
+	if (env->sc_workers > 0) {
+		if ((env->sc_iev_workers = calloc(env->sc_workers,
+		    sizeof(struct imsgev))) == NULL)
+			fatal("calloc");
+		i = 0;
+		TAILQ_FOREACH(la, &env->listen_addrs, entry)
+			la->worker = (i++ % env->sc_workers) + 1;
+		for (i = 0; i < env->sc_workers; i++)
+			start_worker(env, i + 1, &env->sc_iev_workers[i]);
+	}
+
 	event_init();
 
 	signal(SIGPIPE, SIG_IGN);
@@ -783,19 +2749,67 @@ main(int argc, char *argv[])
 	signal_add(&ev_sigint, NULL);
 	signal_add(&ev_sigterm, NULL);
 
+	/* With workers the parent only uses the sockets for announcements */
 	for (la = TAILQ_FIRST(&env->listen_addrs); la; ) {
-		event_set(&la->ev, la->fd, EV_READ|EV_PERSIST,
-		    natpmp_handler, env);
-		event_add(&la->ev, NULL);
+		if (la->worker == 0) {
+			event_set(&la->ev, la->fd, EV_READ|EV_PERSIST,
+			    natpmp_handler, env);
+			event_add(&la->ev, NULL);
+		}
 		la = TAILQ_NEXT(la, entry);
 	}
 
+	env->sc_iev_pfe->handler = natpmp_dispatch_pfe;
+	env->sc_iev_pfe->data = env;
+	event_set(&env->sc_iev_pfe->ev, env->sc_iev_pfe->ibuf.fd, EV_READ,
+	    natpmp_dispatch_pfe, env);
+	event_add(&env->sc_iev_pfe->ev, NULL);
+
+	env->sc_iev_reader->handler = natpmp_dispatch_reader;
+	env->sc_iev_reader->data = env;
+	event_set(&env->sc_iev_reader->ev, env->sc_iev_reader->ibuf.fd,
+	    EV_READ, natpmp_dispatch_reader, env);
+	event_add(&env->sc_iev_reader->ev, NULL);
+
+	/* Reload our anchor with just the mappings restored above */
+	rebuild_rules(env);
+
+	for (i = 0; i < env->sc_workers; i++) {
+		env->sc_iev_workers[i].handler = natpmp_dispatch_worker;
+		env->sc_iev_workers[i].data = env;
+		event_set(&env->sc_iev_workers[i].ev,
+		    env->sc_iev_workers[i].ibuf.fd, EV_READ,
+		    natpmp_dispatch_worker, &env->sc_iev_workers[i]);
+		event_add(&env->sc_iev_workers[i].ev, NULL);
+	}
+
+	log_async(env->sc_log_buffer);
+
+	if (control_listen(env) == -1)
+		fatalx("control socket listen failed");
+
 	event_set(&rt_ev, rt_fd, EV_READ|EV_PERSIST, route_handler, env);
 	event_add(&rt_ev, NULL);
 
-	evtimer_set(&env->sc_announce_ev, announce_address, env);
+	for (i = 0; i < env->sc_nuplinks; i++) {
+		env->sc_uplinks[i].env = env;
+		evtimer_set(&env->sc_uplinks[i].announce_ev, announce_address,
+		    &env->sc_uplinks[i]);
+		evtimer_set(&env->sc_uplinks[i].notify_ev, notify_clients,
+		    &env->sc_uplinks[i]);
+	}
+	evtimer_set(&env->sc_ifcheck_ev, check_timeout, env);
 	check_interface(env);
 
+	evtimer_set(&env->sc_commit_ev, commit_timeout, env);
+	evtimer_set(&env->sc_expire_ev, expire_mappings, env);
+	expire_mappings(0, 0, env);
+
+	if (env->sc_snapshot != NULL) {
+		evtimer_set(&env->sc_snapshot_ev, snapshot_timeout, env);
+		snapshot_timeout(0, 0, env);
+	}
+
 	event_dispatch();
 
 	return (0);
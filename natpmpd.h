@@ -22,26 +22,31 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 #include <netinet/in.h>
 
 #include <net/if.h>
 
 #include <event.h>
+#include <imsg.h>
 #include <netdb.h>
+#include <pwd.h>
+#include <syslog.h>
 
 #define SALIGN			 (sizeof(long) - 1)
 #define SA_RLEN(sa)		 ((sa)->sa_len ? (((sa)->sa_len + SALIGN) & ~SALIGN) : (SALIGN + 1))
 
 #define NATPMPD_USER		 "_natpmpd"
 #define CONF_FILE		 "/etc/natpmpd.conf"
+#define NATPMPD_SOCKET		 "/var/run/natpmpd.sock"
 
 #define NATPMPD_SERVER_PORT 	 5351
 #define NATPMPD_CLIENT_PORT	 5350
 
 #define NATPMPD_ANCHOR		 "natpmpd"
 
-#define NATPMPD_MAX_VERSION	 0
+#define NATPMP_VERSION		 0
 
 #define NATPMPD_SUCCESS		 0
 #define NATPMPD_BAD_VERSION	 1
@@ -50,9 +55,328 @@
 #define NATPMPD_NO_RESOURCES	 4
 #define NATPMPD_BAD_OPCODE	 5
 
+/* RFC 6887 */
+#define PCP_VERSION		 2
+
+#define PCP_OP_ANNOUNCE		 0
+#define PCP_OP_MAP		 1
+#define PCP_OP_PEER		 2
+
+#define PCP_SUCCESS		 0
+#define PCP_UNSUPP_VERSION	 1
+#define PCP_NOT_AUTHORIZED	 2
+#define PCP_MALFORMED_REQUEST	 3
+#define PCP_UNSUPP_OPCODE	 4
+#define PCP_UNSUPP_OPTION	 5
+#define PCP_MALFORMED_OPTION	 6
+#define PCP_NETWORK_FAILURE	 7
+#define PCP_NO_RESOURCES	 8
+#define PCP_UNSUPP_PROTOCOL	 9
+#define PCP_USER_EX_QUOTA	 10
+#define PCP_CANNOT_PROVIDE_EXTERNAL 11
+#define PCP_ADDRESS_MISMATCH	 12
+#define PCP_EXCESSIVE_REMOTE_PEERS 13
+
+#define PCP_OPT_THIRD_PARTY	 1
+#define PCP_OPT_PREFER_FAILURE	 2
+#define PCP_OPT_FILTER		 3
+
+#define PCP_NONCE_LEN		 12
+
+/* Lengths on the wire, see wire.c */
+#define NATPMP_HDR_LEN		 2	/* any request */
+#define NATPMP_MAP_LEN		 12	/* a mapping request */
+#define NATPMP_RESPONSE_LEN	 8	/* just the header */
+#define NATPMP_ADDR_RESPONSE_LEN 12
+#define NATPMP_MAP_RESPONSE_LEN	 16
+#define PCP_HDR_LEN		 24
+#define PCP_MAP_LEN		 36
+#define PCP_PEER_LEN		 56
+#define PCP_OPT_HDR_LEN		 4
+
 #define NATPMPD_MAX_DELAY	 10
+#define NATPMPD_ANNOUNCE_BURST	 32	/* listeners at a time */
+#define NATPMPD_ANNOUNCE_STAGGER 5	/* msec between them */
+#define NATPMPD_ANNOUNCE_LEN	 NATPMP_ADDR_RESPONSE_LEN
+#define PCP_ANNOUNCE_LEN	 PCP_HDR_LEN
+#define NATPMPD_UNICAST_RATE	 1000	/* clients per second */
+#define NATPMPD_MAX_UNICAST_RATE 100000
+#define NATPMPD_UNICAST_TICK	 10	/* msec */
+
+#define NATPMPD_MAX_PACKET_SIZE	 1100	/* the PCP limit */
+
+#define NATPMPD_BATCH		 64
+#define NATPMPD_MAX_BATCH	 1024
+
+#define NATPMPD_COMMIT_MAX	 256
+#define NATPMPD_MAX_COMMIT_MAX	 4096
+#define NATPMPD_MAX_COMMIT_DELAY 1000	/* msec */
+#define NATPMPD_COMMIT_RETRIES	 8
+#define NATPMPD_COMMIT_BACKOFF	 5	/* msec, doubled every retry */
+#define NATPMPD_MAX_COMMIT_BACKOFF 30000	/* msec, after failed commits */
+
+#define NATPMPD_MAX_WORKERS	 64
+
+#define NATPMPD_MAX_UPLINKS	 32
+
+#define NATPMPD_MAX_LOG_BUFFER	 65536
+
+#define NATPMPD_SNAPSHOT_INTERVAL 60	/* seconds */
+
+#define NATPMPD_IFCHECK_DELAY	 100	/* msec */
+
+#define NATPMPD_LIMIT_BURST	 50	/* unless one is given */
+#define NATPMPD_MAX_LIMIT	 1000
+#define NATPMPD_MAX_LIMIT_MAPPINGS 65535
+#define NATPMPD_LIMIT_LIFETIME	 86400	/* seconds */
+#define NATPMPD_MAX_LIMIT_LIFETIME 31536000
+
+#define NATPMPD_MAX_FILTER_DELAY 10000	/* msec */
+
+/* Classes of log message, each with its own level */
+enum log_class {
+	LOGC_GENERAL,
+	LOGC_REQUEST,
+	LOGC_MAPPING,
+	LOGC_RULESET,
+	LOGC_MAX
+};
+
+enum imsg_type {
+	IMSG_NONE,
+	IMSG_REQUEST,
+	IMSG_RESPONSE,
+	IMSG_ADDRESS,
+	IMSG_LISTEN_ADD,
+	IMSG_LISTEN_CLOSE,
+	IMSG_LOG_LEVEL,
+	IMSG_PF_CHANGE,
+	IMSG_PF_COMMIT,
+	IMSG_PF_FLUSH,
+	IMSG_PF_RESULT,
+	IMSG_PF_RECOVER,
+	IMSG_STATS,
+	IMSG_CTL_SHOW_STATS,
+	IMSG_CTL_SHOW_MAPPINGS,
+	IMSG_CTL_FLUSH_MAPPINGS,
+	IMSG_CTL_STATS,
+	IMSG_CTL_MAPPING,
+	IMSG_CTL_END,
+	IMSG_CTL_MONITOR,
+	IMSG_CTL_EVENT,
+	IMSG_RECONF,
+	IMSG_RECONF_CONF,
+	IMSG_RECONF_LISTEN,
+	IMSG_RECONF_SNAPSHOT,
+	IMSG_RECONF_END
+};
+
+#define STATS_OPCODES		 4	/* address, UDP, TCP, anything else */
+#define STATS_RESULTS		 (NATPMPD_BAD_OPCODE + 1)
+#define STATS_PCP_OPCODES	 4	/* announce, map, peer, anything else */
+#define STATS_PCP_RESULTS	 (PCP_EXCESSIVE_REMOTE_PEERS + 1)
+#define STATS_LATENCY		 16	/* powers of two, in usec */
+
+/*
+ * Counters kept by every process.  Each one only ever touches its own
+ * copy and is single-threaded so they're never locked.
+ */
+struct natpmpd_stats {
+	u_int64_t		 requests[STATS_OPCODES];
+	u_int64_t		 results[STATS_RESULTS];
+	u_int64_t		 pcp_requests[STATS_PCP_OPCODES];
+	u_int64_t		 pcp_results[STATS_PCP_RESULTS];
+	u_int64_t		 dropped;
+	u_int64_t		 limited;
+	u_int64_t		 over_quota;
+	u_int64_t		 renewals;
+	u_int64_t		 announces;
+	u_int64_t		 notified;
+	u_int64_t		 mappings[2];		/* UDP, TCP */
+	u_int64_t		 flushes;
+	u_int64_t		 commits;
+	u_int64_t		 commit_failures;
+	u_int64_t		 transactions;
+	u_int64_t		 ioctls;
+	u_int64_t		 busy_retries;
+	u_int64_t		 busy_failures;
+	struct timeval		 busy_stall;
+	u_int64_t		 events;
+	u_int64_t		 events_dropped;
+	u_int64_t		 latency[STATS_LATENCY];
+};
+
+/*
+ * Where a mapping points.  An IPv4 mapping redirects an external port on
+ * the uplink's address to an internal address and port.  An IPv6 one is
+ * a pinhole, passing traffic through to the internal address and port
+ * untranslated, so the one address and port are both.
+ */
+struct mapping_addr {
+	union {
+		struct {
+			struct in_addr	 rdr;		/* internal */
+			struct in_addr	 dst;		/* external */
+		}			 in4;
+		struct in6_addr		 in6;
+	}			 ma_u;
+	in_port_t		 ma_rdr_port;
+	in_port_t		 ma_dst_port;
+	sa_family_t		 ma_af;
+};
+#define ma_rdr			 ma_u.in4.rdr
+#define ma_dst			 ma_u.in4.dst
+#define ma_addr6		 ma_u.in6
+
+/* A mapping as reported over the control socket */
+struct ctl_mapping {
+	u_int32_t		 id;
+	u_int8_t		 proto;
+	struct mapping_addr	 addr;
+	u_int32_t		 lifetime;
+};
+
+/*
+ * Something that happened to a mapping, as streamed to anyone monitoring
+ * over the control socket.  A collision has the address and port that
+ * were asked for, and the id of the mapping made instead if there was
+ * one.  A failed commit has how many changes it took with it, and a
+ * dropped event how many events were lost before it.
+ */
+#define EVENT_CREATED		 0
+#define EVENT_REFRESHED		 1
+#define EVENT_DELETED		 2
+#define EVENT_EXPIRED		 3
+#define EVENT_COLLISION		 4
+#define EVENT_COMMIT_FAILED	 5
+#define EVENT_DROPPED		 6
+#define EVENT_MAX		 7
+
+struct ctl_event {
+	u_int8_t		 type;
+	u_int8_t		 proto;
+	u_int8_t		 uplink;
+	u_int32_t		 id;
+	time_t			 time;
+	struct mapping_addr	 addr;
+	u_int32_t		 lifetime;
+	u_int32_t		 count;
+	int			 error;
+};
 
-#define NATPMPD_MAX_PACKET_SIZE	 16
+struct imsgev {
+	struct imsgbuf		 ibuf;
+	void			(*handler)(int, short, void *);
+	struct event		 ev;
+	void			*data;
+	short			 events;
+};
+
+/* A request or response passed between a worker and the parent */
+struct natpmp_msg {
+	int			 fd;
+	u_int			 uplink;
+	socklen_t		 slen;
+	struct sockaddr_storage	 ss;
+	u_int16_t		 len;
+	u_int8_t		 data[NATPMPD_MAX_PACKET_SIZE];
+};
+
+/* A sub-anchor to load or empty, sent to the pf process */
+struct pfe_change {
+	u_int32_t		 id;
+	u_int8_t		 proto;
+	u_int8_t		 remove;
+	u_int8_t		 uplink;
+	struct mapping_addr	 addr;
+	time_t			 expires;
+};
+#define PFE_CHANGE_MAX		 ((MAX_IMSGSIZE - IMSG_HEADER_SIZE) / \
+				    sizeof(struct pfe_change))
+
+/* The outcome of a batch of changes, sent back by the pf process */
+struct pfe_result {
+	int			 error;
+	int			 flush;
+	u_int			 retries;
+	struct timeval		 stall;
+};
+
+/*
+ * How the pf process gets at the ruleset.  A transaction is a
+ * prepare_commit, an add_anchor for every sub-anchor to be replaced and
+ * optionally flush_anchors, then begin_commit, an add_rule for each rule
+ * to load and do_commit, or do_rollback on any failure.  Sub-anchors are
+ * named relative to ours.
+ */
+#define FILTER_ANCHOR_LEN	 16
+
+struct natpmpd;
+
+struct filter_backend {
+	const char		*name;
+	int			(*init)(struct natpmpd *);
+	int			(*prepare_commit)(void);
+	int			(*add_anchor)(const char *);
+	int			(*flush_anchors)(void);
+	int			(*read_anchors)(void (*)(struct pfe_change *));
+	int			(*begin_commit)(void);
+	int			(*add_rule)(int, struct pfe_change *);
+	int			(*do_commit)(void);
+	int			(*do_rollback)(void);
+};
+
+/* One request and its response within a batch */
+struct natpmp_slot {
+	int			 fd;
+	u_int			 worker;
+	u_int			 uplink;
+	struct sockaddr_storage	 ss;
+	socklen_t		 slen;
+	ssize_t			 len;
+	ssize_t			 rlen;
+	struct iovec		 iov;
+	u_int8_t		 request[NATPMPD_MAX_PACKET_SIZE];
+	u_int8_t		 response[NATPMPD_MAX_PACKET_SIZE];
+};
+
+/*
+ * Messages decoded from, or to be encoded onto, the wire.  Addresses and
+ * ports stay in network order, the rest is in host order.
+ */
+struct natpmp_packet {
+	u_int8_t		 version;
+	u_int8_t		 opcode;
+	u_int16_t		 result;	/* responses only */
+	u_int32_t		 sssoe;		/* responses only */
+	in_port_t		 int_port;
+	in_port_t		 ext_port;
+	u_int32_t		 lifetime;
+	struct in_addr		 address;	/* responses only */
+};
+
+struct pcp_packet {
+	u_int8_t		 version;
+	u_int8_t		 opcode;
+	u_int8_t		 result;	/* responses only */
+	u_int32_t		 lifetime;
+	u_int32_t		 epoch;		/* responses only */
+	struct in6_addr		 client;	/* requests only */
+};
+
+/* MAP data, which PEER data starts with */
+struct pcp_map {
+	u_int8_t		 nonce[PCP_NONCE_LEN];
+	u_int8_t		 proto;
+	in_port_t		 int_port;
+	in_port_t		 ext_port;
+	struct in6_addr		 ext_addr;
+};
+
+struct pcp_option {
+	u_int8_t		 code;
+	u_int16_t		 len;		/* without the padding */
+};
 
 struct address {
 	struct sockaddr_storage	 ss;
@@ -63,6 +387,8 @@ struct listen_addr {
 	TAILQ_ENTRY(listen_addr)	 entry;
 	struct sockaddr_storage		 sa;
 	int				 fd;
+	u_int				 worker;
+	u_int				 uplink;
 	struct event			 ev;
 };
 
@@ -77,24 +403,128 @@ struct ntp_addr_wrap {
 	u_int8_t		 pool;
 };
 
+/*
+ * A mapping, cut down to what lookups and the expiry look at.  The key
+ * is the internal address, folded down to 32 bits for IPv6.  Everything
+ * else is in the mapping_info that goes with it.
+ */
+struct mapping {
+	u_int32_t		 key;
+	in_port_t		 rdr_port;
+	in_port_t		 dst_port;
+	u_int32_t		 expires;
+	u_int8_t		 proto;
+	u_int8_t		 uplink;
+	u_int8_t		 flags;
+#define MAPPING_F_QUEUED	 0x01
+#define MAPPING_F_DEAD		 0x02
+#define MAPPING_F_COMMIT	 0x04
+#define MAPPING_F_INET6		 0x08
+#define MAPPING_F_LINKED	 0x10
+	u_int8_t		 pad;
+};
+
+struct mapping_info {
+	u_int32_t		 id;
+	u_int32_t		 label;		/* expiry loaded into pf */
+	u_int8_t		 nonce[PCP_NONCE_LEN];	/* zero if unowned */
+	union {
+		struct in_addr	 dst;		/* external */
+		struct in6_addr	 in6;		/* both */
+	}			 mi_u;
+};
+#define mi_dst			 mi_u.dst
+#define mi_addr6		 mi_u.in6
+
+/*
+ * An internet-facing interface.  Each one has its own external address
+ * and announcements, and its own external ports to hand out.  The
+ * announcements are built when the address changes, only the time since
+ * the epoch is filled in each time they are sent.  The clients holding
+ * mappings can also be told directly, a few at a time.
+ */
+struct uplink {
+	u_int			 id;
+	char			 name[IF_NAMESIZE];
+	struct in_addr		 address;
+	int			 delay;
+	u_int			 announce_pos;	/* listeners done */
+	u_int8_t		 announce[NATPMPD_ANNOUNCE_LEN];
+	u_int8_t		 announce_pcp[PCP_ANNOUNCE_LEN];
+	struct event		 announce_ev;
+	in_addr_t		*notify;	/* clients to tell */
+	u_int			 nnotify, maxnotify;
+	u_int			 notify_pos;	/* clients done */
+	struct event		 notify_ev;
+	struct natpmpd		*env;
+};
+
+/* The address of an uplink, as passed down to the workers */
+struct uplink_address {
+	u_int			 uplink;
+	struct in_addr		 address;
+};
+
 struct natpmpd {
 	u_int8_t		 sc_flags;
-#define NATPMPD_F_VERBOSE	 0x01;
+#define NATPMPD_F_VERBOSE	 0x01
+#define NATPMPD_F_KEEP_RULESET	 0x02
+#define NATPMPD_F_GROUP_RULES	 0x04
 
 	const char		*sc_confpath;
-	struct in_addr		 sc_address;
 	TAILQ_HEAD(listen_addrs, listen_addr)		 listen_addrs;
 	u_int8_t					 listen_all;
-	char		 	 sc_interface[IF_NAMESIZE];
-	struct timeval		 sc_starttime;
-	int			 sc_delay;
-	struct event		 sc_announce_ev;
+	struct uplink		 sc_uplinks[NATPMPD_MAX_UPLINKS];
+	u_int			 sc_nuplinks;
+	u_int16_t		 sc_port_lo;
+	u_int16_t		 sc_port_hi;
+	u_int			 sc_batch;
+	u_int			 sc_commit_delay;	/* msec */
+	u_int			 sc_commit_max;
+	u_int			 sc_workers;
+	int			 sc_log_level[LOGC_MAX];
+	u_int			 sc_log_buffer;
+	char			*sc_snapshot;
+	u_int			 sc_snapshot_interval;
+	u_int			 sc_limit_rate;		/* per second */
+	u_int			 sc_limit_burst;
+	u_int			 sc_limit_mappings;
+	u_int			 sc_limit_lifetime;	/* seconds */
+	u_int			 sc_unicast_rate;	/* 0 if off */
+	u_int8_t		 sc_filter;
+#define FILTER_PF		 0
+#define FILTER_MEMORY		 1
+	u_int			 sc_filter_delay;	/* msec, per commit */
+	u_int			 sc_filter_busy;	/* percent of commits */
+	u_int			 sc_worker;		/* 0 in the parent */
+	struct imsgev		*sc_iev_workers;
+	struct imsgev		*sc_iev_parent;
+	struct imsgev		*sc_iev_pfe;
+	struct imsgev		*sc_iev_reader;
+	u_int8_t		 sc_reloading;
+	u_int8_t		 sc_pfe_busy;
+	u_int8_t		 sc_commit_wanted;
+	u_int			 sc_commit_backoff;	/* msec, 0 if working */
 	struct event		 sc_expire_ev;
+	struct event		 sc_commit_ev;
+	struct event		 sc_snapshot_ev;
+	struct event		 sc_ifcheck_ev;
+	int			 sc_ifsock;
 };
 
 /* prototypes */
+/* control.c */
+int		 control_init(void);
+int		 control_listen(struct natpmpd *);
+void		 control_close(void);
+void		 control_relay_stats(struct imsg *);
+struct ctl_event *control_event(u_int8_t);
+
 /* log.c */
+extern int	 log_level[LOGC_MAX];
+#define log_check(c, pri)	((pri) <= log_level[(c)])
 void		 log_init(int);
+void		 log_async(u_int);
 void		 vlog(int, const char *, va_list);
 void		 log_warn(const char *, ...);
 void		 log_warnx(const char *, ...);
@@ -104,17 +534,118 @@ void		 fatal(const char *);
 void		 fatalx(const char *);
 const char *	 log_sockaddr(struct sockaddr *);
 
+/* mapping.c */
+void		 init_mappings(struct natpmpd *);
+struct mapping	*alloc_mapping(void);
+void		 free_mapping(struct mapping *);
+u_int32_t	 mapping_index(struct mapping *);
+struct mapping	*mapping_by_index(u_int32_t);
+struct mapping_info *get_mapping_info(struct mapping *);
+void		 get_mapping_addr(struct mapping *, struct mapping_addr *);
+void		 set_mapping_addr(struct mapping *,
+		    const struct mapping_addr *);
+u_int32_t	 count_mappings(void);
+struct mapping	*first_mapping(void);
+struct mapping	*next_mapping(struct mapping *);
+int		 valid_uplink(u_int8_t);
+in_port_t	 find_port(u_int8_t, u_int8_t, in_port_t);
+void		 link_mapping(struct mapping *);
+void		 unlink_mapping(struct mapping *);
+void		 refresh_mapping(struct mapping *, time_t);
+int		 reap_mappings(time_t, void (*)(struct mapping *));
+struct mapping	*lookup_mapping(u_int8_t, u_int8_t, struct in_addr,
+		    in_port_t);
+struct mapping	*lookup_mapping6(u_int8_t, u_int8_t, struct in6_addr *,
+		    in_port_t);
+struct mapping	*lookup_mapping_ext(u_int8_t, u_int8_t, in_port_t);
+struct mapping	*first_mapping_addr(struct in_addr);
+struct mapping	*next_mapping_addr(struct mapping *);
+u_int		 count_client_mappings(struct sockaddr *, u_int);
+
+/* natpmpd.c */
+extern struct natpmpd_stats	 stats;
+struct mapping	*init_mapping(void);
+int		 restore_mapping(u_int8_t, u_int8_t, struct mapping_addr *,
+		    time_t, time_t);
+u_int		 flush_mappings(struct natpmpd *);
+int		 natpmp_remove_mapping(u_int8_t, u_int8_t,
+		    struct sockaddr_in *);
+int		 natpmp_create_mapping(u_int8_t, u_int8_t, struct sockaddr_in *,
+		    struct sockaddr_in *, u_int32_t, const u_int8_t *, int);
+int		 natpmp_remove_pinhole(u_int8_t, u_int8_t,
+		    struct sockaddr_in6 *);
+int		 natpmp_create_pinhole(u_int8_t, u_int8_t,
+		    struct sockaddr_in6 *, u_int32_t, const u_int8_t *);
+void		 natpmp_forward(struct natpmpd *, struct natpmp_slot *);
+ssize_t		 natpmp_request(struct natpmpd *, struct natpmp_slot *);
+void		 natpmp_send(int, struct natpmp_slot *, u_int);
+void		 natpmp_handler(int, short, void *);
+
+/* pcp.c */
+ssize_t		 pcp_request(struct natpmpd *, struct natpmp_slot *);
+ssize_t		 pcp_unsupported(struct natpmpd *, struct natpmp_slot *);
+ssize_t		 pcp_announce(struct natpmpd *, u_int8_t *);
+
+/* pfe.c */
+pid_t		 start_pfe(struct natpmpd *, struct passwd *, struct imsgev *);
+
+/* reader.c */
+pid_t		 start_reader(struct natpmpd *, const char *,
+		    struct imsgev *);
+
+/* worker.c */
+void		 imsg_event_add(struct imsgev *);
+pid_t		 start_worker(struct natpmpd *, u_int, struct imsgev *);
+
+/* limit.c */
+void		 init_limits(void);
+int		 client_allow(struct natpmpd *, struct sockaddr *);
+int		 client_quota(struct natpmpd *, struct sockaddr *);
+
+/* state.c */
+int		 state_open(const char *);
+void		 state_close(void);
+int		 state_load(void);
+int		 state_write(void);
+
 /* parse.y */
 struct natpmpd	*parse_config(const char *, u_int);
 int		 host(const char *, struct ntp_addr **);
 int		 host_dns(const char *, struct ntp_addr **);
 
 /* filter.c */
-void		 init_filter(char *, char *, int);
+void		 init_filter(struct natpmpd *, char *, char *, int);
 int		 prepare_commit(void);
-int		 add_rdr(u_int8_t, struct sockaddr *, struct sockaddr *);
+int		 add_anchor(const char *);
+int		 flush_anchors(void);
+int		 read_anchors(void (*)(struct pfe_change *));
+int		 begin_commit(void);
+int		 add_rule(int, struct pfe_change *);
 int		 do_commit(void);
 int		 do_rollback(void);
 void		 expire_rules(int, short, void *);
 
+/* filter_mem.c */
+extern const struct filter_backend	 mem_backend;
+
+/* wire.c */
+int		 natpmp_decode(const u_int8_t *, size_t,
+		    struct natpmp_packet *);
+size_t		 natpmp_encode(u_int8_t *, const struct natpmp_packet *);
+void		 natpmp_encode_epoch(u_int8_t *, u_int32_t);
+int		 pcp_decode(const u_int8_t *, size_t, struct pcp_packet *);
+size_t		 pcp_encode(u_int8_t *, const struct pcp_packet *);
+void		 pcp_encode_epoch(u_int8_t *, u_int32_t);
+void		 pcp_decode_map(const u_int8_t *, struct pcp_map *);
+void		 pcp_encode_map(u_int8_t *, const struct pcp_map *);
+ssize_t		 pcp_decode_option(const u_int8_t *, size_t,
+		    struct pcp_option *);
+
+/* clock.c */
+void		 init_clock(void);
+const struct timespec	*clock_update(void);
+time_t		 clock_now(void);
+u_int32_t	 clock_msec(void);
+u_int32_t	 sssoe(struct natpmpd *);
+
 #endif
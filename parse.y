@@ -62,6 +62,8 @@ int		 lookup(char *);
 int		 lgetc(int);
 int		 lungetc(int);
 int		 findeol(void);
+int		 log_class_byname(const char *);
+int		 log_level_byname(const char *, int *);
 
 struct natpmpd			*conf;
 
@@ -86,10 +88,26 @@ typedef struct {
 
 %token	LISTEN ON
 %token	INTERFACE
+%token	PORT RANGE
+%token	BATCH SIZE
+%token	COMMIT DELAY MAX
+%token	WORKERS
+%token	LOG BUFFER
+%token	SNAPSHOT INTERVAL
+%token	KEEP RULESET
+%token	LIMIT RATE BURST MAPPINGS LIFETIME
+%token	FILTER BUSY
+%token	GROUP RULES
+%token	ANNOUNCE UNICAST
 %token	ERROR
 %token	<v.string>		STRING
 %token	<v.number>		NUMBER
 %type	<v.addr>		address
+%type	<v.string>		logclass
+%type	<v.string>		uplink
+%type	<v.number>		msec
+%type	<v.number>		burst
+%type	<v.number>		unicastrate
 %%
 
 grammar		: /* empty */
@@ -98,9 +116,26 @@ grammar		: /* empty */
 		| grammar error '\n'		{ file->errors++; }
 		;
 
-main		: LISTEN ON address	{
+main		: LISTEN ON address uplink	{
 			struct listen_addr	*la;
 			struct ntp_addr		*h, *next;
+			u_int			 i = 0;
+
+			/* Without a name, the first interface declared */
+			if ($4 != NULL) {
+				for (i = 0; i < conf->sc_nuplinks; i++)
+					if (strcmp(conf->sc_uplinks[i].name,
+					    $4) == 0)
+						break;
+				if (i == conf->sc_nuplinks) {
+					yyerror("unknown interface \"%s\"", $4);
+					free($4);
+					free($3->name);
+					free($3);
+					YYERROR;
+				}
+				free($4);
+			}
 
 			if ((h = $3->a) == NULL &&
 			    (host_dns($3->name, &h) == -1 || !h)) {
@@ -121,6 +156,7 @@ main		: LISTEN ON address	{
 				if (la == NULL)
 					fatal("listen on calloc");
 				la->fd = -1;
+				la->uplink = i;
 				memcpy(&la->sa, &h->ss,
 				    sizeof(struct sockaddr_storage));
 				TAILQ_INSERT_TAIL(&conf->listen_addrs, la,
@@ -131,15 +167,285 @@ main		: LISTEN ON address	{
 			free($3);
 		}
 		| INTERFACE STRING {
-			if (strlcpy(conf->sc_interface, $2,
-			    sizeof(conf->sc_interface)) >=
-			    sizeof(conf->sc_interface)) {
+			struct uplink	*u;
+			u_int		 i;
+
+			for (i = 0; i < conf->sc_nuplinks; i++)
+				if (strcmp(conf->sc_uplinks[i].name, $2) == 0) {
+					yyerror("interface \"%s\" already "
+					    "declared", $2);
+					free($2);
+					YYERROR;
+				}
+			if (conf->sc_nuplinks == NATPMPD_MAX_UPLINKS) {
+				yyerror("too many interfaces, at most %d",
+				    NATPMPD_MAX_UPLINKS);
+				free($2);
+				YYERROR;
+			}
+			u = &conf->sc_uplinks[conf->sc_nuplinks];
+			if (strlcpy(u->name, $2, sizeof(u->name)) >=
+			    sizeof(u->name)) {
 				yyerror("interface name too long");
 				free($2);
 				YYERROR;
 			}
+			u->id = conf->sc_nuplinks++;
 			free($2);
 		}
+		| PORT RANGE STRING {
+			const char	*errstr;
+			char		*sep;
+			long long	 lo, hi;
+
+			if ((sep = strchr($3, ':')) == NULL) {
+				yyerror("port range must be low:high");
+				free($3);
+				YYERROR;
+			}
+			*sep++ = '\0';
+			lo = strtonum($3, 1, USHRT_MAX, &errstr);
+			if (errstr == NULL)
+				hi = strtonum(sep, 1, USHRT_MAX, &errstr);
+			if (errstr != NULL) {
+				yyerror("port range %s", errstr);
+				free($3);
+				YYERROR;
+			}
+			free($3);
+			if (lo > hi) {
+				yyerror("invalid port range");
+				YYERROR;
+			}
+			conf->sc_port_lo = lo;
+			conf->sc_port_hi = hi;
+		}
+		| BATCH SIZE NUMBER {
+			if ($3 < 1 || $3 > NATPMPD_MAX_BATCH) {
+				yyerror("batch size must be between 1 and %d",
+				    NATPMPD_MAX_BATCH);
+				YYERROR;
+			}
+			conf->sc_batch = $3;
+		}
+		| COMMIT DELAY msec {
+			if ($3 > NATPMPD_MAX_COMMIT_DELAY) {
+				yyerror("commit delay must be at most %dms",
+				    NATPMPD_MAX_COMMIT_DELAY);
+				YYERROR;
+			}
+			conf->sc_commit_delay = $3;
+		}
+		| COMMIT MAX NUMBER {
+			if ($3 < 1 || $3 > NATPMPD_MAX_COMMIT_MAX) {
+				yyerror("commit max must be between 1 and %d",
+				    NATPMPD_MAX_COMMIT_MAX);
+				YYERROR;
+			}
+			conf->sc_commit_max = $3;
+		}
+		| WORKERS NUMBER {
+			if ($2 < 0 || $2 > NATPMPD_MAX_WORKERS) {
+				yyerror("workers must be between 0 and %d",
+				    NATPMPD_MAX_WORKERS);
+				YYERROR;
+			}
+			conf->sc_workers = $2;
+		}
+		| SNAPSHOT STRING {
+			if (*$2 != '/') {
+				yyerror("snapshot path must be absolute");
+				free($2);
+				YYERROR;
+			}
+			free(conf->sc_snapshot);
+			conf->sc_snapshot = $2;
+		}
+		| SNAPSHOT INTERVAL NUMBER {
+			if ($3 < 1 || $3 > 86400) {
+				yyerror("snapshot interval must be between 1 "
+				    "and 86400 seconds");
+				YYERROR;
+			}
+			conf->sc_snapshot_interval = $3;
+		}
+		| LIMIT RATE NUMBER burst {
+			if ($3 < 0 || $3 > NATPMPD_MAX_LIMIT) {
+				yyerror("limit rate must be between 0 and %d",
+				    NATPMPD_MAX_LIMIT);
+				YYERROR;
+			}
+			conf->sc_limit_rate = $3;
+			conf->sc_limit_burst = ($4 > 0) ? $4 :
+			    NATPMPD_LIMIT_BURST;
+		}
+		| LIMIT MAPPINGS NUMBER {
+			if ($3 < 0 || $3 > NATPMPD_MAX_LIMIT_MAPPINGS) {
+				yyerror("limit mappings must be between 0 "
+				    "and %d", NATPMPD_MAX_LIMIT_MAPPINGS);
+				YYERROR;
+			}
+			conf->sc_limit_mappings = $3;
+		}
+		| LIMIT LIFETIME NUMBER {
+			if ($3 < 1 || $3 > NATPMPD_MAX_LIMIT_LIFETIME) {
+				yyerror("limit lifetime must be between 1 "
+				    "and %d", NATPMPD_MAX_LIMIT_LIFETIME);
+				YYERROR;
+			}
+			conf->sc_limit_lifetime = $3;
+		}
+		| FILTER STRING {
+			if (strcmp($2, "pf") == 0)
+				conf->sc_filter = FILTER_PF;
+			else if (strcmp($2, "memory") == 0)
+				conf->sc_filter = FILTER_MEMORY;
+			else {
+				yyerror("unknown filter \"%s\"", $2);
+				free($2);
+				YYERROR;
+			}
+			free($2);
+		} filteropts
+		| KEEP RULESET {
+			conf->sc_flags |= NATPMPD_F_KEEP_RULESET;
+		}
+		| GROUP RULES {
+			conf->sc_flags |= NATPMPD_F_GROUP_RULES;
+		}
+		| ANNOUNCE UNICAST unicastrate {
+			conf->sc_unicast_rate = ($3 > 0) ? $3 :
+			    NATPMPD_UNICAST_RATE;
+		}
+		| LOG BUFFER NUMBER {
+			if ($3 < 0 || $3 > NATPMPD_MAX_LOG_BUFFER) {
+				yyerror("log buffer must be between 0 and %d",
+				    NATPMPD_MAX_LOG_BUFFER);
+				YYERROR;
+			}
+			conf->sc_log_buffer = $3;
+		}
+		| LOG logclass STRING {
+			int	 c, level;
+
+			if ((c = log_class_byname($2)) == -1) {
+				yyerror("unknown log class \"%s\"", $2);
+				free($2);
+				free($3);
+				YYERROR;
+			}
+			if (log_level_byname($3, &level) == -1) {
+				yyerror("unknown log level \"%s\"", $3);
+				free($2);
+				free($3);
+				YYERROR;
+			}
+			free($2);
+			free($3);
+
+			if (c == LOGC_MAX)
+				for (c = LOGC_REQUEST; c < LOGC_MAX; c++)
+					conf->sc_log_level[c] = level;
+			else
+				conf->sc_log_level[c] = level;
+		}
+		;
+
+logclass	: STRING
+		| RULESET		{
+			/* Also a keyword */
+			if (($$ = strdup("ruleset")) == NULL)
+				fatal(NULL);
+		}
+		| MAPPINGS		{
+			if (($$ = strdup("mappings")) == NULL)
+				fatal(NULL);
+		}
+		;
+
+filteropts	: /* empty */
+		| filteropts filteropt
+		;
+
+filteropt	: DELAY msec {
+			if (conf->sc_filter != FILTER_MEMORY) {
+				yyerror("only the memory filter has a delay");
+				YYERROR;
+			}
+			if ($2 > NATPMPD_MAX_FILTER_DELAY) {
+				yyerror("filter delay must be at most %dms",
+				    NATPMPD_MAX_FILTER_DELAY);
+				YYERROR;
+			}
+			conf->sc_filter_delay = $2;
+		}
+		| BUSY NUMBER {
+			if (conf->sc_filter != FILTER_MEMORY) {
+				yyerror("only the memory filter can be made "
+				    "busy");
+				YYERROR;
+			}
+			if ($2 < 0 || $2 > 100) {
+				yyerror("filter busy must be between 0 and "
+				    "100 percent");
+				YYERROR;
+			}
+			conf->sc_filter_busy = $2;
+		}
+		;
+
+burst		: /* empty */		{ $$ = 0; }
+		| BURST NUMBER		{
+			if ($2 < 1 || $2 > NATPMPD_MAX_LIMIT) {
+				yyerror("limit burst must be between 1 and %d",
+				    NATPMPD_MAX_LIMIT);
+				YYERROR;
+			}
+			$$ = $2;
+		}
+		;
+
+unicastrate	: /* empty */		{ $$ = 0; }
+		| RATE NUMBER		{
+			if ($2 < 1 || $2 > NATPMPD_MAX_UNICAST_RATE) {
+				yyerror("announce rate must be between 1 and "
+				    "%d", NATPMPD_MAX_UNICAST_RATE);
+				YYERROR;
+			}
+			$$ = $2;
+		}
+		;
+
+uplink		: /* empty */		{ $$ = NULL; }
+		| INTERFACE STRING	{ $$ = $2; }
+		;
+
+msec		: NUMBER		{
+			if ($1 < 0) {
+				yyerror("invalid delay");
+				YYERROR;
+			}
+			$$ = $1;
+		}
+		| STRING		{
+			const char	*errstr;
+			size_t		 len;
+
+			len = strlen($1);
+			if (len < 3 || strcmp($1 + len - 2, "ms") != 0) {
+				yyerror("invalid delay \"%s\"", $1);
+				free($1);
+				YYERROR;
+			}
+			$1[len - 2] = '\0';
+			$$ = strtonum($1, 0, INT_MAX, &errstr);
+			if (errstr != NULL) {
+				yyerror("delay is %s", errstr);
+				free($1);
+				YYERROR;
+			}
+			free($1);
+		}
 		;
 
 address		: STRING		{
@@ -191,9 +497,34 @@ lookup(char *s)
 {
 	/* this has to be sorted always */
 	static const struct keywords keywords[] = {
+		{ "announce",		ANNOUNCE },
+		{ "batch",		BATCH },
+		{ "buffer",		BUFFER },
+		{ "burst",		BURST },
+		{ "busy",		BUSY },
+		{ "commit",		COMMIT },
+		{ "delay",		DELAY },
+		{ "filter",		FILTER },
+		{ "group",		GROUP },
 		{ "interface",		INTERFACE },
+		{ "interval",		INTERVAL },
+		{ "keep",		KEEP },
+		{ "lifetime",		LIFETIME },
+		{ "limit",		LIMIT },
 		{ "listen",		LISTEN },
-		{ "on",			ON }
+		{ "log",		LOG },
+		{ "mappings",		MAPPINGS },
+		{ "max",		MAX },
+		{ "on",			ON },
+		{ "port",		PORT },
+		{ "range",		RANGE },
+		{ "rate",		RATE },
+		{ "rules",		RULES },
+		{ "ruleset",		RULESET },
+		{ "size",		SIZE },
+		{ "snapshot",		SNAPSHOT },
+		{ "unicast",		UNICAST },
+		{ "workers",		WORKERS }
 	};
 	const struct keywords	*p;
 
@@ -460,10 +791,56 @@ popfile(void)
 	return (file ? 0 : EOF);
 }
 
+/* Returns LOGC_MAX for every class */
+int
+log_class_byname(const char *name)
+{
+	static const struct {
+		const char	*name;
+		int		 class;
+	} classes[] = {
+		{ "all",	LOGC_MAX },
+		{ "mappings",	LOGC_MAPPING },
+		{ "requests",	LOGC_REQUEST },
+		{ "ruleset",	LOGC_RULESET },
+	};
+	u_int	 i;
+
+	for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+		if (strcmp(name, classes[i].name) == 0)
+			return (classes[i].class);
+
+	return (-1);
+}
+
+int
+log_level_byname(const char *name, int *level)
+{
+	static const struct {
+		const char	*name;
+		int		 level;
+	} levels[] = {
+		{ "none",	-1 },
+		{ "warning",	LOG_CRIT },
+		{ "info",	LOG_INFO },
+		{ "debug",	LOG_DEBUG },
+	};
+	u_int	 i;
+
+	for (i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
+		if (strcmp(name, levels[i].name) == 0) {
+			*level = levels[i].level;
+			return (0);
+		}
+
+	return (-1);
+}
+
 struct natpmpd *
 parse_config(const char *filename, u_int flags)
 {
-	int		 errors = 0;
+	struct listen_addr	*la;
+	int			 errors = 0;
 
 	if ((conf = calloc(1, sizeof(*conf))) == NULL) {
 		log_warn("cannot allocate memory");
@@ -472,6 +849,14 @@ parse_config(const char *filename, u_int flags)
 
 	conf->sc_flags = flags;
 	conf->sc_confpath = filename;
+	conf->sc_port_lo = IPPORT_HIFIRSTAUTO;
+	conf->sc_port_hi = IPPORT_HILASTAUTO;
+	conf->sc_batch = NATPMPD_BATCH;
+	conf->sc_commit_max = NATPMPD_COMMIT_MAX;
+	conf->sc_snapshot_interval = NATPMPD_SNAPSHOT_INTERVAL;
+	conf->sc_limit_burst = NATPMPD_LIMIT_BURST;
+	conf->sc_limit_lifetime = NATPMPD_LIMIT_LIFETIME;
+	memcpy(conf->sc_log_level, log_level, sizeof(conf->sc_log_level));
 
 	TAILQ_INIT(&conf->listen_addrs);
 
@@ -486,16 +871,26 @@ parse_config(const char *filename, u_int flags)
 	popfile();
 
 	if (errors) {
+		while ((la = TAILQ_FIRST(&conf->listen_addrs)) != NULL) {
+			TAILQ_REMOVE(&conf->listen_addrs, la, entry);
+			free(la);
+		}
+		free(conf->sc_snapshot);
 		free(conf);
 		return (NULL);
 	}
 
+	/* Always have at least the one uplink, even if it goes nowhere */
+	if (conf->sc_nuplinks == 0)
+		conf->sc_nuplinks = 1;
+
 	return (conf);
 }
 
 /* C&P */
 
 struct ntp_addr	*host_v4(const char *);
+struct ntp_addr	*host_v6(const char *);
 
 int
 host(const char *s, struct ntp_addr **hn)
@@ -510,6 +905,10 @@ host(const char *s, struct ntp_addr **hn)
 	if (h == NULL)
 		h = host_v4(s);
 
+	/* IPv6 address? */
+	if (h == NULL)
+		h = host_v6(s);
+
 	if (h == NULL)
 		return (0);
 
@@ -539,6 +938,26 @@ host_v4(const char *s)
 	return (h);
 }
 
+struct ntp_addr	*
+host_v6(const char *s)
+{
+	struct addrinfo		 hints, *res;
+	struct ntp_addr		*h = NULL;
+
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = SOCK_DGRAM; /*dummy*/
+	hints.ai_flags = AI_NUMERICHOST;
+	if (getaddrinfo(s, "0", &hints, &res) == 0) {
+		if ((h = calloc(1, sizeof(struct ntp_addr))) == NULL)
+			fatal(NULL);
+		memcpy(&h->ss, res->ai_addr, res->ai_addrlen);
+		freeaddrinfo(res);
+	}
+
+	return (h);
+}
+
 #define MAX_SERVERS_DNS 8
 
 int
@@ -562,7 +981,8 @@ host_dns(const char *s, struct ntp_addr **hn)
 	}
 
 	for (res = res0; res && cnt < MAX_SERVERS_DNS; res = res->ai_next) {
-		if (res->ai_family != AF_INET)
+		if (res->ai_family != AF_INET &&
+		    res->ai_family != AF_INET6)
 			continue;
 		if ((h = calloc(1, sizeof(struct ntp_addr))) == NULL)
 			fatal(NULL);
@@ -572,7 +992,8 @@ host_dns(const char *s, struct ntp_addr **hn)
 			sa_in->sin_len = sizeof(struct sockaddr_in);
 			sa_in->sin_addr.s_addr = ((struct sockaddr_in *)
 			    res->ai_addr)->sin_addr.s_addr;
-		}
+		} else
+			memcpy(&h->ss, res->ai_addr, res->ai_addrlen);
 
 		h->next = hh;
 		hh = h;
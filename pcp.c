@@ -0,0 +1,483 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <string.h>
+
+#include "natpmpd.h"
+
+/*
+ * The Port Control Protocol, RFC 6887, spoken on the same sockets as
+ * NAT-PMP and told apart from it by the version.  MAP and PEER requests
+ * for UDP and TCP end up in the same mapping code as NAT-PMP ones.  With
+ * no way of asking pf about the outbound state, a PEER request is given
+ * the inbound mapping for its internal port, just as MAP would be.
+ *
+ * A client speaking IPv6 isn't translated, MAP and PEER open a pinhole
+ * through to its own address and port instead.
+ *
+ * A mapping remembers the nonce of the client that created it and only
+ * that client can refresh or delete it.  One without a nonce, created by
+ * NAT-PMP or restored after a restart, goes to the first PCP client that
+ * asks for it.
+ *
+ * Workers answer ANNOUNCE requests and anything in error themselves and
+ * pass the rest up to the parent, which parses them again.
+ */
+
+/* How long an error should be expected to last, in seconds */
+#define PCP_SHORT_LIFETIME	 30
+#define PCP_LONG_LIFETIME	 1800
+
+/* The options we act on, where they are in the request if given */
+struct pcp_options {
+	const u_int8_t		*third_party;
+	const u_int8_t		*prefer_failure;
+};
+
+void		 pcp_header(struct natpmpd *, u_int8_t *, u_int8_t, u_int8_t,
+		    u_int32_t);
+ssize_t		 pcp_reply(struct natpmpd *, struct natpmp_slot *, u_int8_t,
+		    u_int32_t, size_t);
+ssize_t		 pcp_error(struct natpmpd *, struct natpmp_slot *, u_int8_t);
+u_int8_t	 pcp_options(u_int8_t, const u_int8_t *, size_t,
+		    struct pcp_options *);
+u_int8_t	 pcp_map(struct natpmpd *, struct natpmp_slot *,
+		    struct pcp_map *, u_int32_t, int);
+u_int8_t	 pcp_pinhole(struct natpmpd *, struct natpmp_slot *,
+		    struct pcp_map *, u_int32_t, int);
+int		 pcp_owner(struct mapping *, struct pcp_map *);
+int		 pcp_client(struct in6_addr *, struct sockaddr_storage *);
+int		 pcp_v4(struct in6_addr *, struct in_addr *);
+void		 pcp_v4mapped(struct in6_addr *, struct in_addr);
+
+static const u_int8_t	 no_nonce[PCP_NONCE_LEN];
+
+ssize_t
+pcp_request(struct natpmpd *env, struct natpmp_slot *slot)
+{
+	struct pcp_packet	 request;
+	struct pcp_options	 opts;
+	struct pcp_map		 map;
+	size_t			 len = slot->len, oplen;
+	u_int8_t		 result;
+	int			 whole;
+
+	/* The opcode is always there, natpmp_request() makes sure */
+	whole = (pcp_decode(slot->request, len, &request) == 0);
+
+	/* Never answer a response, such as one of our announcements */
+	if (request.opcode & 0x80) {
+		stats.dropped++;
+		return (0);
+	}
+
+	if (!whole || len > NATPMPD_MAX_PACKET_SIZE || len % 4)
+		return (pcp_error(env, slot, PCP_MALFORMED_REQUEST));
+
+	/* The client has to agree with us on its address */
+	if (!pcp_client(&request.client, &slot->ss))
+		return (pcp_error(env, slot, PCP_ADDRESS_MISMATCH));
+
+	switch (request.opcode) {
+	case PCP_OP_ANNOUNCE:
+		oplen = 0;
+		break;
+	case PCP_OP_MAP:
+		oplen = PCP_MAP_LEN;
+		break;
+	case PCP_OP_PEER:
+		oplen = PCP_PEER_LEN;
+		break;
+	default:
+		return (pcp_error(env, slot, PCP_UNSUPP_OPCODE));
+	}
+	if (len < PCP_HDR_LEN + oplen)
+		return (pcp_error(env, slot, PCP_MALFORMED_REQUEST));
+
+	if ((result = pcp_options(request.opcode,
+	    slot->request + PCP_HDR_LEN + oplen, len - PCP_HDR_LEN - oplen,
+	    &opts)) != PCP_SUCCESS)
+		return (pcp_error(env, slot, result));
+
+	if (request.opcode == PCP_OP_ANNOUNCE)
+		return (pcp_reply(env, slot, PCP_SUCCESS, 0, PCP_HDR_LEN));
+
+	/* No host gets to ask for mappings on behalf of another */
+	if (opts.third_party != NULL)
+		return (pcp_error(env, slot, PCP_NOT_AUTHORIZED));
+
+	/* Only the parent can touch the mappings */
+	if (env->sc_worker) {
+		natpmp_forward(env, slot);
+		return (0);
+	}
+
+	/* A client asking too often gets nothing done for it at all */
+	if (!client_allow(env, (struct sockaddr *)&slot->ss))
+		return (pcp_error(env, slot, PCP_NO_RESOURCES));
+
+	/*
+	 * Nobody gets a mapping for longer than the server will allow,
+	 * IPv4 or IPv6, and the response says what was granted.
+	 */
+	if (request.lifetime > env->sc_limit_lifetime)
+		request.lifetime = env->sc_limit_lifetime;
+
+	pcp_decode_map(slot->request + PCP_HDR_LEN, &map);
+	if ((result = pcp_map(env, slot, &map, request.lifetime,
+	    opts.prefer_failure != NULL)) != PCP_SUCCESS)
+		return (pcp_error(env, slot, result));
+
+	/*
+	 * Send back what was asked for, as granted, and the option obeyed.
+	 * The rest of PEER data, the remote peer, goes back as it came.
+	 */
+	pcp_encode_map(slot->response + PCP_HDR_LEN, &map);
+	memcpy(slot->response + PCP_HDR_LEN + PCP_MAP_LEN,
+	    slot->request + PCP_HDR_LEN + PCP_MAP_LEN, oplen - PCP_MAP_LEN);
+	len = PCP_HDR_LEN + oplen;
+	if (opts.prefer_failure != NULL) {
+		memcpy(slot->response + len, opts.prefer_failure,
+		    PCP_OPT_HDR_LEN);
+		len += PCP_OPT_HDR_LEN;
+	}
+
+	return (pcp_reply(env, slot, PCP_SUCCESS, request.lifetime, len));
+}
+
+/* Any version we don't speak, as long as it's not a response */
+ssize_t
+pcp_unsupported(struct natpmpd *env, struct natpmp_slot *slot)
+{
+	if (slot->request[1] & 0x80) {
+		stats.dropped++;
+		return (0);
+	}
+
+	return (pcp_error(env, slot, PCP_UNSUPP_VERSION));
+}
+
+/* An unsolicited ANNOUNCE, for when our address or epoch changes */
+ssize_t
+pcp_announce(struct natpmpd *env, u_int8_t *packet)
+{
+	pcp_header(env, packet, PCP_OP_ANNOUNCE | 0x80, PCP_SUCCESS, 0);
+
+	return (PCP_HDR_LEN);
+}
+
+void
+pcp_header(struct natpmpd *env, u_int8_t *packet, u_int8_t opcode,
+    u_int8_t result, u_int32_t lifetime)
+{
+	struct pcp_packet	 response;
+
+	memset(&response, 0, sizeof(response));
+	response.version = PCP_VERSION;
+	response.opcode = opcode;
+	response.result = result;
+	response.lifetime = lifetime;
+	response.epoch = sssoe(env);
+	pcp_encode(packet, &response);
+}
+
+/* Fill in the header of a response already holding len bytes of data */
+ssize_t
+pcp_reply(struct natpmpd *env, struct natpmp_slot *slot, u_int8_t result,
+    u_int32_t lifetime, size_t len)
+{
+	u_int8_t	 opcode = slot->request[1];
+
+	pcp_header(env, slot->response, opcode | 0x80, result, lifetime);
+
+	stats.pcp_requests[(opcode < STATS_PCP_OPCODES - 1) ?
+	    opcode : STATS_PCP_OPCODES - 1]++;
+	stats.pcp_results[result]++;
+
+	return (len);
+}
+
+/*
+ * An error response is the request itself, as much as will fit and
+ * padded out to at least a header, with the result set.
+ */
+ssize_t
+pcp_error(struct natpmpd *env, struct natpmp_slot *slot, u_int8_t result)
+{
+	size_t		 len;
+	u_int32_t	 lifetime;
+
+	len = (slot->len > NATPMPD_MAX_PACKET_SIZE) ?
+	    NATPMPD_MAX_PACKET_SIZE : slot->len;
+	memcpy(slot->response, slot->request, len);
+	len &= ~3;
+	if (len < PCP_HDR_LEN) {
+		memset(slot->response + len, 0, PCP_HDR_LEN - len);
+		len = PCP_HDR_LEN;
+	}
+
+	/* The client is told when it's worth trying again */
+	switch (result) {
+	case PCP_NETWORK_FAILURE:
+	case PCP_NO_RESOURCES:
+	case PCP_USER_EX_QUOTA:
+	case PCP_CANNOT_PROVIDE_EXTERNAL:
+	case PCP_EXCESSIVE_REMOTE_PEERS:
+		lifetime = PCP_SHORT_LIFETIME;
+		break;
+	default:
+		lifetime = PCP_LONG_LIFETIME;
+		break;
+	}
+
+	if (log_check(LOGC_REQUEST, LOG_DEBUG))
+		log_debug("PCP request from %s failed, result %u",
+		    log_sockaddr((struct sockaddr *)&slot->ss), result);
+
+	return (pcp_reply(env, slot, result, lifetime, len));
+}
+
+/*
+ * Walk the options following the opcode data.  Any we don't know are
+ * ignored if they're optional, otherwise the whole request is refused.
+ */
+u_int8_t
+pcp_options(u_int8_t opcode, const u_int8_t *p, size_t len,
+    struct pcp_options *opts)
+{
+	struct pcp_option	 o;
+	ssize_t			 olen;
+
+	memset(opts, 0, sizeof(*opts));
+
+	while (len > 0) {
+		if ((olen = pcp_decode_option(p, len, &o)) == -1)
+			return (PCP_MALFORMED_OPTION);
+
+		switch (o.code) {
+		case PCP_OPT_THIRD_PARTY:
+			if (opcode == PCP_OP_ANNOUNCE ||
+			    o.len != sizeof(struct in6_addr) ||
+			    opts->third_party != NULL)
+				return (PCP_MALFORMED_OPTION);
+			opts->third_party = p;
+			break;
+		case PCP_OPT_PREFER_FAILURE:
+			if (opcode != PCP_OP_MAP || o.len != 0 ||
+			    opts->prefer_failure != NULL)
+				return (PCP_MALFORMED_OPTION);
+			opts->prefer_failure = p;
+			break;
+		default:
+			/* The top half of the codes are optional */
+			if (o.code < 128)
+				return (PCP_UNSUPP_OPTION);
+			break;
+		}
+
+		p += olen;
+		len -= olen;
+	}
+
+	return (PCP_SUCCESS);
+}
+
+/*
+ * Create, refresh or delete the mapping described by a MAP or PEER
+ * request, filling in the external address and port it was given.
+ * With exact set, the client would rather have nothing than anything
+ * other than what it suggested.
+ */
+u_int8_t
+pcp_map(struct natpmpd *env, struct natpmp_slot *slot, struct pcp_map *map,
+    u_int32_t lifetime, int exact)
+{
+	struct uplink		*u = &env->sc_uplinks[slot->uplink];
+	struct mapping		*m;
+	struct sockaddr_in	 rdr, dst;
+	struct in_addr		 ext;
+	char			 rdr_ip[INET_ADDRSTRLEN];
+
+	if (map->proto != IPPROTO_UDP && map->proto != IPPROTO_TCP)
+		return (PCP_UNSUPP_PROTOCOL);
+	if (map->int_port == 0)
+		return (PCP_MALFORMED_REQUEST);
+
+	if (slot->ss.ss_family == AF_INET6)
+		return (pcp_pinhole(env, slot, map, lifetime, exact));
+
+	/* We don't have an external address */
+	if (u->address.s_addr == htonl(INADDR_ANY))
+		return (PCP_NETWORK_FAILURE);
+
+	memcpy(&rdr, &slot->ss, sizeof(rdr));
+	rdr.sin_port = map->int_port;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_len = sizeof(struct sockaddr_in);
+	dst.sin_family = AF_INET;
+	dst.sin_addr = u->address;
+	dst.sin_port = map->ext_port;
+
+	if (log_check(LOGC_REQUEST, LOG_INFO)) {
+		inet_ntop(AF_INET, &rdr.sin_addr, rdr_ip, INET_ADDRSTRLEN);
+		log_info("PCP %s request, port %d -> %s:%d, expires in %u "
+		    "seconds", (map->proto == IPPROTO_UDP) ? "UDP" : "TCP",
+		    ntohs(dst.sin_port), rdr_ip, ntohs(rdr.sin_port),
+		    lifetime);
+	}
+
+	if ((m = lookup_mapping(slot->uplink, map->proto, rdr.sin_addr,
+	    rdr.sin_port)) != NULL && !pcp_owner(m, map))
+		return (PCP_NOT_AUTHORIZED);
+
+	if (lifetime == 0) {
+		if (m != NULL)
+			natpmp_remove_mapping(slot->uplink, map->proto, &rdr);
+		return (PCP_SUCCESS);
+	}
+
+	/* Some other external address entirely was suggested */
+	if (exact && m == NULL &&
+	    !IN6_IS_ADDR_UNSPECIFIED(&map->ext_addr) &&
+	    (!pcp_v4(&map->ext_addr, &ext) ||
+	    (ext.s_addr != htonl(INADDR_ANY) &&
+	    ext.s_addr != u->address.s_addr)))
+		return (PCP_CANNOT_PROVIDE_EXTERNAL);
+
+	if (m == NULL && !client_quota(env, (struct sockaddr *)&rdr))
+		return (PCP_USER_EX_QUOTA);
+
+	if (natpmp_create_mapping(slot->uplink, map->proto, &rdr, &dst,
+	    lifetime, map->nonce, exact) == -1) {
+		if (exact)
+			return (PCP_CANNOT_PROVIDE_EXTERNAL);
+		if (log_check(LOGC_MAPPING, LOG_CRIT))
+			log_warnx("no free ports for mapping");
+		return (PCP_NO_RESOURCES);
+	}
+
+	map->ext_port = dst.sin_port;
+	pcp_v4mapped(&map->ext_addr, u->address);
+
+	return (PCP_SUCCESS);
+}
+
+/*
+ * The same for an IPv6 client, where the external address and port can
+ * only ever be its own.
+ */
+u_int8_t
+pcp_pinhole(struct natpmpd *env, struct natpmp_slot *slot,
+    struct pcp_map *map, u_int32_t lifetime, int exact)
+{
+	struct mapping		*m;
+	struct sockaddr_in6	 rdr;
+
+	memcpy(&rdr, &slot->ss, sizeof(rdr));
+	rdr.sin6_port = map->int_port;
+
+	if (log_check(LOGC_REQUEST, LOG_INFO))
+		log_info("PCP %s request, pinhole to [%s]:%d, expires in %u "
+		    "seconds", (map->proto == IPPROTO_UDP) ? "UDP" : "TCP",
+		    log_sockaddr((struct sockaddr *)&rdr),
+		    ntohs(rdr.sin6_port), lifetime);
+
+	if ((m = lookup_mapping6(slot->uplink, map->proto, &rdr.sin6_addr,
+	    rdr.sin6_port)) != NULL && !pcp_owner(m, map))
+		return (PCP_NOT_AUTHORIZED);
+
+	if (lifetime == 0) {
+		if (m != NULL)
+			natpmp_remove_pinhole(slot->uplink, map->proto, &rdr);
+		return (PCP_SUCCESS);
+	}
+
+	if (exact && m == NULL &&
+	    ((map->ext_port != 0 && map->ext_port != map->int_port) ||
+	    (!IN6_IS_ADDR_UNSPECIFIED(&map->ext_addr) &&
+	    !IN6_ARE_ADDR_EQUAL(&map->ext_addr, &rdr.sin6_addr))))
+		return (PCP_CANNOT_PROVIDE_EXTERNAL);
+
+	if (m == NULL && !client_quota(env, (struct sockaddr *)&rdr))
+		return (PCP_USER_EX_QUOTA);
+
+	natpmp_create_pinhole(slot->uplink, map->proto, &rdr, lifetime,
+	    map->nonce);
+
+	map->ext_port = map->int_port;
+	map->ext_addr = rdr.sin6_addr;
+
+	return (PCP_SUCCESS);
+}
+
+/* Only the client that created a mapping gets to change it */
+int
+pcp_owner(struct mapping *m, struct pcp_map *map)
+{
+	struct mapping_info	*mi = get_mapping_info(m);
+
+	return (memcmp(mi->nonce, no_nonce, sizeof(mi->nonce)) == 0 ||
+	    memcmp(mi->nonce, map->nonce, sizeof(mi->nonce)) == 0);
+}
+
+/* Whether the client address in a request is where it came from */
+int
+pcp_client(struct in6_addr *client, struct sockaddr_storage *ss)
+{
+	struct in_addr	 in;
+
+	switch (ss->ss_family) {
+	case AF_INET:
+		return (pcp_v4(client, &in) && in.s_addr ==
+		    ((struct sockaddr_in *)ss)->sin_addr.s_addr);
+	case AF_INET6:
+		return (IN6_ARE_ADDR_EQUAL(client,
+		    &((struct sockaddr_in6 *)ss)->sin6_addr));
+	default:
+		return (0);
+	}
+}
+
+/* PCP carries IPv4 addresses as IPv4-mapped IPv6 ones */
+int
+pcp_v4(struct in6_addr *in6, struct in_addr *in)
+{
+	if (!IN6_IS_ADDR_V4MAPPED(in6))
+		return (0);
+
+	memcpy(in, &in6->s6_addr[12], sizeof(*in));
+
+	return (1);
+}
+
+void
+pcp_v4mapped(struct in6_addr *in6, struct in_addr in)
+{
+	memset(in6, 0, sizeof(*in6));
+	in6->s6_addr[10] = 0xff;
+	in6->s6_addr[11] = 0xff;
+	memcpy(&in6->s6_addr[12], &in, sizeof(in));
+}
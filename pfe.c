@@ -0,0 +1,664 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+#include <sys/tree.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <event.h>
+#include <imsg.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "natpmpd.h"
+
+/*
+ * The pf process.  It is forked off before the parent drops privileges,
+ * holds the only descriptor for /dev/pf and makes every ruleset change
+ * on the parent's behalf so the process answering requests never blocks
+ * in a pf ioctl.
+ *
+ * The parent streams a batch of IMSG_PF_CHANGE messages followed by an
+ * IMSG_PF_COMMIT, or IMSG_PF_FLUSH to also empty every other sub-anchor,
+ * and gets an IMSG_PF_RESULT back once the batch has been committed or
+ * given up on.  If the ruleset is busy the commit is retried from a
+ * timer, doubling the wait each time.  Only one batch is outstanding at
+ * a time, apart from a flush which supersedes any batch being retried.
+ *
+ * At startup the parent can also send an IMSG_PF_RECOVER to have every
+ * mapping still loaded beneath the anchor sent back to it, as a series of
+ * IMSG_PF_CHANGE messages followed by an IMSG_PF_RECOVER.
+ *
+ * Normally every mapping gets its own sub-anchor.  With "group rules" the
+ * mappings are instead grouped by uplink, protocol and address family,
+ * a sub-anchor each, with the rules in each sorted by address and port.
+ * Every rule in a group then shares the fields pf computes skip steps
+ * for other than the destination, so a packet for another protocol or
+ * family skips the whole group in one go, and the number of sub-anchors
+ * pf has to step into stays the same however many mappings there are.
+ * In exchange a change has to reload every rule in its group, so this
+ * process keeps a copy of what is loaded to rebuild the groups from.
+ */
+
+/* A rule as loaded into one of the groups */
+struct pfe_rule {
+	RB_ENTRY(pfe_rule)	 by_id;
+	RB_ENTRY(pfe_rule)	 by_port;
+	struct pfe_change	 c;
+};
+
+RB_HEAD(pfe_rules, pfe_rule);
+RB_HEAD(pfe_group_rules, pfe_rule);
+
+struct pfe_group {
+	struct pfe_group_rules	 rules;
+	int			 dirty;
+	int			 nr;
+};
+
+#define PFE_GROUPS		 (NATPMPD_MAX_UPLINKS * 4)
+
+/* What a change in the batch replaced, to put back if the commit fails */
+struct pfe_undo {
+	u_int32_t		 id;
+	struct pfe_rule		*old;
+};
+
+__dead void	 pfe_main(struct natpmpd *, struct passwd *, int);
+void		 pfe_dispatch_parent(int, short, void *);
+void		 pfe_commit(int, short, void *);
+int		 pfe_transaction(void);
+void		 pfe_result(int);
+void		 pfe_recover(void);
+void		 pfe_recovered(struct pfe_change *);
+void		 pfe_shutdown(void);
+int		 pfe_rule_cmp(struct pfe_rule *, struct pfe_rule *);
+int		 pfe_group_rule_cmp(struct pfe_rule *, struct pfe_rule *);
+int		 pfe_group_transaction(void);
+struct pfe_group	*pfe_group(struct pfe_change *);
+void		 pfe_group_name(u_int, char *, size_t);
+void		 pfe_group_insert(struct pfe_rule *);
+void		 pfe_group_remove(struct pfe_rule *);
+void		 pfe_group_apply(void);
+void		 pfe_group_undo(void);
+void		 pfe_group_free(struct pfe_rules *);
+
+RB_PROTOTYPE(pfe_rules, pfe_rule, by_id, pfe_rule_cmp);
+RB_PROTOTYPE(pfe_group_rules, pfe_rule, by_port, pfe_group_rule_cmp);
+
+static struct imsgev		*iev_parent;
+static struct event		 retry_ev;
+
+/* Changes being received, and the batch being committed */
+static struct pfe_change	*pending, *batch;
+static u_int			 npending, maxpending, nbatch, maxbatch;
+static int			 batch_flush, batch_active;
+
+/* Mappings read back from the anchor, sent on a message at a time */
+static struct pfe_change	 recovered[PFE_CHANGE_MAX];
+static u_int			 nrecovered;
+
+static u_int			 retries;
+static struct timeval		 busy_since;
+
+/* What is loaded when grouping rules, and the state to undo a batch */
+static int			 group_rules;
+static struct pfe_rules		 rules = RB_INITIALIZER(&rules);
+static struct pfe_group		 groups[PFE_GROUPS];
+static struct pfe_rules		 saved_rules;
+static struct pfe_group_rules	 saved_groups[PFE_GROUPS];
+static struct pfe_undo		*undo;
+static u_int			 maxundo;
+
+pid_t
+start_pfe(struct natpmpd *env, struct passwd *pw, struct imsgev *iev)
+{
+	int	 fds[2];
+	pid_t	 pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, fds) == -1)
+		fatal("socketpair");
+
+	switch (pid = fork()) {
+	case -1:
+		fatal("fork");
+		/* NOTREACHED */
+	case 0:
+		close(fds[0]);
+		pfe_main(env, pw, fds[1]);
+		/* NOTREACHED */
+	default:
+		break;
+	}
+
+	close(fds[1]);
+	imsg_init(&iev->ibuf, fds[0]);
+
+	return (pid);
+}
+
+__dead void
+pfe_main(struct natpmpd *env, struct passwd *pw, int fd)
+{
+	u_int	 i;
+
+	setproctitle("pf");
+
+	init_filter(env, NULL, NULL, 0);
+
+	group_rules = env->sc_flags & NATPMPD_F_GROUP_RULES;
+	for (i = 0; i < PFE_GROUPS; i++)
+		RB_INIT(&groups[i].rules);
+
+	if (chroot(pw->pw_dir) == -1)
+		fatal("chroot");
+	if (chdir("/") == -1)
+		fatal("chdir(\"/\")");
+
+	/* The descriptor for /dev/pf is all that's needed from here on */
+	if (setgroups(1, &pw->pw_gid) ||
+	    setresgid(pw->pw_gid, pw->pw_gid, pw->pw_gid) ||
+	    setresuid(pw->pw_uid, pw->pw_uid, pw->pw_uid))
+		fatal("cannot drop privileges");
+
+	event_init();
+	log_async(env->sc_log_buffer);
+
+	/* The parent asks for a final flush and then goes away */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+
+	evtimer_set(&retry_ev, pfe_commit, NULL);
+
+	if ((iev_parent = calloc(1, sizeof(struct imsgev))) == NULL)
+		fatal("pfe_main");
+	imsg_init(&iev_parent->ibuf, fd);
+	iev_parent->handler = pfe_dispatch_parent;
+	iev_parent->data = env;
+	event_set(&iev_parent->ev, fd, EV_READ, pfe_dispatch_parent, env);
+	event_add(&iev_parent->ev, NULL);
+
+	event_dispatch();
+
+	exit(0);
+}
+
+void
+pfe_dispatch_parent(int fd, short event, void *arg)
+{
+	struct imsgbuf		*ibuf = &iev_parent->ibuf;
+	struct imsg		 imsg;
+	struct pfe_change	*c;
+	ssize_t			 n;
+	size_t			 len;
+	u_int			 count, size;
+
+	if (event & EV_READ) {
+		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
+			fatal("imsg_read error");
+		if (n == 0) {
+			/* connection closed */
+			pfe_shutdown();
+			log_async(0);
+			_exit(0);
+		}
+	}
+	if (event & EV_WRITE) {
+		if ((n = msgbuf_write(&ibuf->w)) == -1 && errno != EAGAIN)
+			fatal("msgbuf_write");
+	}
+
+	for (;;) {
+		if ((n = imsg_get(ibuf, &imsg)) == -1)
+			fatal("pfe_dispatch_parent: imsg_get error");
+		if (n == 0)
+			break;
+
+		switch (imsg.hdr.type) {
+		case IMSG_PF_CHANGE:
+			len = imsg.hdr.len - IMSG_HEADER_SIZE;
+			if (len == 0 || len % sizeof(*c))
+				fatalx("pfe_dispatch_parent: invalid change");
+			count = len / sizeof(*c);
+			if (npending + count > maxpending) {
+				size = maxpending ? maxpending : 256;
+				while (size < npending + count)
+					size *= 2;
+				if ((c = reallocarray(pending, size,
+				    sizeof(*c))) == NULL)
+					fatal("pfe_dispatch_parent");
+				pending = c;
+				maxpending = size;
+			}
+			memcpy(&pending[npending], imsg.data, len);
+			npending += count;
+			break;
+		case IMSG_PF_COMMIT:
+		case IMSG_PF_FLUSH:
+			if (batch_active) {
+				if (imsg.hdr.type == IMSG_PF_COMMIT)
+					fatalx("pfe_dispatch_parent: "
+					    "commit already in progress");
+				evtimer_del(&retry_ev);
+				pfe_result(EBUSY);
+			}
+
+			/* Swap the changes received so far in as the batch */
+			c = batch;
+			batch = pending;
+			pending = c;
+			size = maxbatch;
+			maxbatch = maxpending;
+			maxpending = size;
+			nbatch = npending;
+			npending = 0;
+
+			batch_flush = (imsg.hdr.type == IMSG_PF_FLUSH);
+			batch_active = 1;
+			pfe_commit(0, 0, NULL);
+			break;
+		case IMSG_PF_RECOVER:
+			pfe_recover();
+			break;
+		case IMSG_LOG_LEVEL:
+			if (imsg.hdr.len != IMSG_HEADER_SIZE +
+			    sizeof(log_level))
+				fatalx("pfe_dispatch_parent: "
+				    "invalid log levels");
+			memcpy(log_level, imsg.data, sizeof(log_level));
+			break;
+		case IMSG_STATS:
+			imsg_compose(ibuf, IMSG_STATS, imsg.hdr.peerid, 0, -1,
+			    &stats, sizeof(stats));
+			break;
+		default:
+			log_warnx("pfe_dispatch_parent: unexpected imsg %d",
+			    imsg.hdr.type);
+			break;
+		}
+		imsg_free(&imsg);
+	}
+
+	imsg_event_add(iev_parent);
+}
+
+/*
+ * Load or empty the sub-anchor of every mapping in the batch in a single
+ * transaction, a flush also empties every other sub-anchor, and report
+ * back.  If something else holds the ruleset busy, try again later.
+ */
+void
+pfe_commit(int fd, short event, void *arg)
+{
+	struct timeval	 tv;
+	u_int		 i;
+
+	if (pfe_transaction() == -1) {
+		if (errno == EBUSY && retries < NATPMPD_COMMIT_RETRIES) {
+			if (retries++ == 0)
+				gettimeofday(&busy_since, NULL);
+
+			i = NATPMPD_COMMIT_BACKOFF << (retries - 1);
+			tv.tv_sec = i / 1000;
+			tv.tv_usec = (i % 1000) * 1000;
+			evtimer_add(&retry_ev, &tv);
+			return;
+		}
+		pfe_result(errno);
+		return;
+	}
+
+	pfe_result(0);
+}
+
+int
+pfe_transaction(void)
+{
+	struct pfe_change	*c;
+	char			 name[FILTER_ANCHOR_LEN];
+	u_int			 i;
+	int			 saved_errno;
+
+	if (group_rules)
+		return (pfe_group_transaction());
+
+	stats.transactions++;
+
+	if (prepare_commit() == -1)
+		goto fail;
+	for (i = 0; i < nbatch; i++) {
+		snprintf(name, sizeof(name), "%u", batch[i].id);
+		if (add_anchor(name) == -1)
+			goto fail;
+	}
+	if (batch_flush && flush_anchors() == -1)
+		goto fail;
+	if (begin_commit() == -1)
+		goto fail;
+	for (i = 0; i < nbatch; i++) {
+		c = &batch[i];
+		if (!c->remove && add_rule(i, c) == -1)
+			goto fail;
+	}
+	if (do_commit() == -1)
+		goto fail;
+
+	return (0);
+
+fail:
+	saved_errno = errno;
+	do_rollback();
+	errno = saved_errno;
+	return (-1);
+}
+
+void
+pfe_result(int error)
+{
+	struct pfe_result	 res;
+	struct timeval		 now;
+
+	memset(&res, 0, sizeof(res));
+	res.error = error;
+	res.flush = batch_flush;
+	res.retries = retries;
+	if (retries > 0) {
+		gettimeofday(&now, NULL);
+		timersub(&now, &busy_since, &res.stall);
+	}
+
+	retries = 0;
+	nbatch = 0;
+	batch_active = 0;
+
+	if (imsg_compose(&iev_parent->ibuf, IMSG_PF_RESULT, 0, 0, -1,
+	    &res, sizeof(res)) == -1)
+		fatal("pfe_result");
+	imsg_event_add(iev_parent);
+}
+
+void
+pfe_recover(void)
+{
+	nrecovered = 0;
+	if (read_anchors(pfe_recovered) == -1)
+		log_warn("unable to read back ruleset");
+
+	if (nrecovered > 0 && imsg_compose(&iev_parent->ibuf,
+	    IMSG_PF_CHANGE, 0, 0, -1, recovered,
+	    nrecovered * sizeof(*recovered)) == -1)
+		fatal("pfe_recover");
+	if (imsg_compose(&iev_parent->ibuf, IMSG_PF_RECOVER, 0, 0, -1,
+	    NULL, 0) == -1)
+		fatal("pfe_recover");
+	imsg_event_add(iev_parent);
+}
+
+void
+pfe_recovered(struct pfe_change *c)
+{
+	if (nrecovered == PFE_CHANGE_MAX) {
+		if (imsg_compose(&iev_parent->ibuf, IMSG_PF_CHANGE, 0, 0, -1,
+		    recovered, sizeof(recovered)) == -1)
+			fatal("pfe_recovered");
+		nrecovered = 0;
+	}
+
+	memcpy(&recovered[nrecovered++], c, sizeof(*c));
+}
+
+/*
+ * The parent has gone.  Whatever it last asked for, typically the flush
+ * on its way out, is still worth finishing so wait out any retries here.
+ */
+void
+pfe_shutdown(void)
+{
+	while (batch_active && evtimer_pending(&retry_ev, NULL)) {
+		evtimer_del(&retry_ev);
+		usleep((NATPMPD_COMMIT_BACKOFF << (retries - 1)) * 1000);
+		pfe_commit(0, 0, NULL);
+	}
+}
+
+int
+pfe_rule_cmp(struct pfe_rule *a, struct pfe_rule *b)
+{
+	return ((a->c.id > b->c.id) - (a->c.id < b->c.id));
+}
+
+/* By address, then port, so rules for the same address are adjacent */
+int
+pfe_group_rule_cmp(struct pfe_rule *a, struct pfe_rule *b)
+{
+	struct mapping_addr	*x = &a->c.addr, *y = &b->c.addr;
+	int			 r;
+
+	if (x->ma_af == AF_INET)
+		r = memcmp(&x->ma_dst, &y->ma_dst, sizeof(x->ma_dst));
+	else
+		r = memcmp(&x->ma_addr6, &y->ma_addr6, sizeof(x->ma_addr6));
+	if (r != 0)
+		return (r);
+	if (x->ma_dst_port != y->ma_dst_port)
+		return (ntohs(x->ma_dst_port) < ntohs(y->ma_dst_port) ?
+		    -1 : 1);
+
+	return (pfe_rule_cmp(a, b));
+}
+
+RB_GENERATE(pfe_rules, pfe_rule, by_id, pfe_rule_cmp);
+RB_GENERATE(pfe_group_rules, pfe_rule, by_port, pfe_group_rule_cmp);
+
+/*
+ * Apply the batch to the copy of what is loaded, then reload every group
+ * it touched.  If the commit fails the copy is put back the way it was,
+ * so a retry starts from the same place.
+ */
+int
+pfe_group_transaction(void)
+{
+	struct pfe_group	*g;
+	struct pfe_rule		*r;
+	char			 name[FILTER_ANCHOR_LEN];
+	u_int			 i;
+	int			 saved_errno;
+
+	stats.transactions++;
+
+	pfe_group_apply();
+
+	if (prepare_commit() == -1)
+		goto fail;
+	for (i = 0; i < PFE_GROUPS; i++) {
+		g = &groups[i];
+		if (!g->dirty)
+			continue;
+		pfe_group_name(i, name, sizeof(name));
+		if ((g->nr = add_anchor(name)) == -1)
+			goto fail;
+	}
+	if (batch_flush && flush_anchors() == -1)
+		goto fail;
+	if (begin_commit() == -1)
+		goto fail;
+	for (i = 0; i < PFE_GROUPS; i++) {
+		g = &groups[i];
+		if (!g->dirty)
+			continue;
+		RB_FOREACH(r, pfe_group_rules, &g->rules)
+			if (add_rule(g->nr, &r->c) == -1)
+				goto fail;
+	}
+	if (do_commit() == -1)
+		goto fail;
+
+	/* Whatever the batch replaced has gone from the ruleset too */
+	if (batch_flush)
+		pfe_group_free(&saved_rules);
+	else
+		for (i = 0; i < nbatch; i++)
+			free(undo[i].old);
+
+	return (0);
+
+fail:
+	saved_errno = errno;
+	do_rollback();
+	pfe_group_undo();
+	errno = saved_errno;
+	return (-1);
+}
+
+struct pfe_group *
+pfe_group(struct pfe_change *c)
+{
+	if (c->uplink >= NATPMPD_MAX_UPLINKS)
+		fatalx("pfe_group: invalid uplink");
+
+	return (&groups[(c->uplink * 2 + (c->proto == IPPROTO_TCP)) * 2 +
+	    (c->addr.ma_af == AF_INET6)]);
+}
+
+/* "udp4.0", "tcp6.3" and so on */
+void
+pfe_group_name(u_int i, char *name, size_t len)
+{
+	snprintf(name, len, "%s%c.%u", (i & 2) ? "tcp" : "udp",
+	    (i & 1) ? '6' : '4', i / 4);
+}
+
+void
+pfe_group_insert(struct pfe_rule *r)
+{
+	struct pfe_group	*g = pfe_group(&r->c);
+
+	RB_INSERT(pfe_rules, &rules, r);
+	RB_INSERT(pfe_group_rules, &g->rules, r);
+	g->dirty = 1;
+}
+
+void
+pfe_group_remove(struct pfe_rule *r)
+{
+	struct pfe_group	*g = pfe_group(&r->c);
+
+	RB_REMOVE(pfe_rules, &rules, r);
+	RB_REMOVE(pfe_group_rules, &g->rules, r);
+	g->dirty = 1;
+}
+
+/*
+ * A flush sets the whole copy aside and starts again from the batch,
+ * otherwise each change replaces whatever rule the mapping had, noting
+ * what that was.  Later changes to the same mapping win.
+ */
+void
+pfe_group_apply(void)
+{
+	struct pfe_rule		*r, key;
+	struct pfe_undo		*u;
+	u_int			 i, size;
+
+	for (i = 0; i < PFE_GROUPS; i++)
+		groups[i].dirty = 0;
+
+	if (batch_flush) {
+		saved_rules = rules;
+		RB_INIT(&rules);
+		for (i = 0; i < PFE_GROUPS; i++) {
+			saved_groups[i] = groups[i].rules;
+			RB_INIT(&groups[i].rules);
+		}
+	} else if (nbatch > maxundo) {
+		size = maxundo ? maxundo : 256;
+		while (size < nbatch)
+			size *= 2;
+		if ((u = reallocarray(undo, size, sizeof(*u))) == NULL)
+			fatal("pfe_group_apply");
+		undo = u;
+		maxundo = size;
+	}
+
+	for (i = 0; i < nbatch; i++) {
+		key.c.id = batch[i].id;
+		if ((r = RB_FIND(pfe_rules, &rules, &key)) != NULL)
+			pfe_group_remove(r);
+		if (!batch_flush) {
+			undo[i].id = batch[i].id;
+			undo[i].old = r;
+		} else
+			free(r);
+
+		if (batch[i].remove)
+			continue;
+		if ((r = malloc(sizeof(*r))) == NULL)
+			fatal("pfe_group_apply");
+		memcpy(&r->c, &batch[i], sizeof(r->c));
+		pfe_group_insert(r);
+	}
+}
+
+void
+pfe_group_undo(void)
+{
+	struct pfe_rule		*r, key;
+	u_int			 i;
+
+	if (batch_flush) {
+		pfe_group_free(&rules);
+		rules = saved_rules;
+		for (i = 0; i < PFE_GROUPS; i++)
+			groups[i].rules = saved_groups[i];
+		return;
+	}
+
+	for (i = nbatch; i-- > 0; ) {
+		key.c.id = undo[i].id;
+		if ((r = RB_FIND(pfe_rules, &rules, &key)) != NULL) {
+			pfe_group_remove(r);
+			free(r);
+		}
+		if (undo[i].old != NULL)
+			pfe_group_insert(undo[i].old);
+	}
+}
+
+/* Only the tree by id is taken apart, the groups go along with it */
+void
+pfe_group_free(struct pfe_rules *head)
+{
+	struct pfe_rule		*r;
+
+	while ((r = RB_MIN(pfe_rules, head)) != NULL) {
+		RB_REMOVE(pfe_rules, head, r);
+		free(r);
+	}
+}
@@ -0,0 +1,199 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <event.h>
+#include <imsg.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "natpmpd.h"
+
+/*
+ * The configuration reader.  Unlike every other process it keeps root
+ * and stays out of the chroot, so that a reload can still read the
+ * configuration file, which only root usually can.  That's all it does:
+ * each time the parent asks, the file is parsed and the result sent
+ * back a piece at a time, the settings, each address to listen on and
+ * the snapshot path, then an end marker.  The end marker on its own
+ * means the file couldn't be parsed.
+ */
+
+__dead void	 reader_main(struct natpmpd *, const char *, int);
+void		 reader_dispatch_parent(int, short, void *);
+void		 reader_send(struct imsgbuf *, struct natpmpd *);
+
+static const char	*reader_file;
+static struct imsgev	*iev_parent;
+
+pid_t
+start_reader(struct natpmpd *env, const char *conffile, struct imsgev *iev)
+{
+	int	 fds[2];
+	pid_t	 pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, fds) == -1)
+		fatal("socketpair");
+
+	switch (pid = fork()) {
+	case -1:
+		fatal("fork");
+		/* NOTREACHED */
+	case 0:
+		close(fds[0]);
+		reader_main(env, conffile, fds[1]);
+		/* NOTREACHED */
+	default:
+		break;
+	}
+
+	close(fds[1]);
+	imsg_init(&iev->ibuf, fds[0]);
+
+	return (pid);
+}
+
+__dead void
+reader_main(struct natpmpd *env, const char *conffile, int fd)
+{
+	setproctitle("config");
+	reader_file = conffile;
+
+	/* Nothing but the channel to the parent is any use here */
+	close(env->sc_iev_pfe->ibuf.fd);
+
+	event_init();
+	log_async(env->sc_log_buffer);
+
+	/* The parent going away closes the channel, that's our cue */
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGINT, SIG_IGN);
+	signal(SIGTERM, SIG_IGN);
+
+	if ((iev_parent = calloc(1, sizeof(struct imsgev))) == NULL)
+		fatal("reader_main");
+	imsg_init(&iev_parent->ibuf, fd);
+	iev_parent->handler = reader_dispatch_parent;
+	iev_parent->data = env;
+	event_set(&iev_parent->ev, fd, EV_READ, reader_dispatch_parent, env);
+	event_add(&iev_parent->ev, NULL);
+
+	event_dispatch();
+
+	exit(0);
+}
+
+void
+reader_dispatch_parent(int fd, short event, void *arg)
+{
+	struct natpmpd		*env = (struct natpmpd *)arg;
+	struct imsgbuf		*ibuf = &iev_parent->ibuf;
+	struct imsg		 imsg;
+	struct natpmpd		*nconf;
+	struct listen_addr	*la;
+	ssize_t			 n;
+
+	if (event & EV_READ) {
+		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
+			fatal("imsg_read error");
+		if (n == 0)	/* connection closed */
+			exit(0);
+	}
+	if (event & EV_WRITE) {
+		if ((n = msgbuf_write(&ibuf->w)) == -1 && errno != EAGAIN)
+			fatal("msgbuf_write");
+	}
+
+	for (;;) {
+		if ((n = imsg_get(ibuf, &imsg)) == -1)
+			fatal("reader_dispatch_parent: imsg_get error");
+		if (n == 0)
+			break;
+
+		switch (imsg.hdr.type) {
+		case IMSG_RECONF:
+			nconf = parse_config(reader_file,
+			    env->sc_flags & NATPMPD_F_VERBOSE);
+			reader_send(ibuf, nconf);
+			if (nconf == NULL)
+				break;
+			while ((la = TAILQ_FIRST(&nconf->listen_addrs))) {
+				TAILQ_REMOVE(&nconf->listen_addrs, la, entry);
+				free(la);
+			}
+			free(nconf->sc_snapshot);
+			free(nconf);
+			break;
+		case IMSG_LOG_LEVEL:
+			if (imsg.hdr.len != IMSG_HEADER_SIZE +
+			    sizeof(log_level))
+				fatalx("reader_dispatch_parent: "
+				    "invalid log level");
+			memcpy(log_level, imsg.data, sizeof(log_level));
+			break;
+		default:
+			log_warnx("reader_dispatch_parent: unexpected imsg %d",
+			    imsg.hdr.type);
+			break;
+		}
+		imsg_free(&imsg);
+	}
+
+	imsg_event_add(iev_parent);
+}
+
+/* Pointers are meaningless to the parent, it fills them in again */
+void
+reader_send(struct imsgbuf *ibuf, struct natpmpd *nconf)
+{
+	struct natpmpd		 c;
+	struct listen_addr	*la;
+
+	if (nconf != NULL) {
+		memcpy(&c, nconf, sizeof(c));
+		c.sc_confpath = NULL;
+		c.sc_snapshot = NULL;
+		TAILQ_INIT(&c.listen_addrs);
+		if (imsg_compose(ibuf, IMSG_RECONF_CONF, 0, 0, -1, &c,
+		    sizeof(c)) == -1)
+			fatal("reader_send");
+
+		TAILQ_FOREACH(la, &nconf->listen_addrs, entry)
+			if (imsg_compose(ibuf, IMSG_RECONF_LISTEN, 0, 0, -1,
+			    la, sizeof(*la)) == -1)
+				fatal("reader_send");
+
+		if (nconf->sc_snapshot != NULL &&
+		    imsg_compose(ibuf, IMSG_RECONF_SNAPSHOT, 0, 0, -1,
+		    nconf->sc_snapshot, strlen(nconf->sc_snapshot) + 1) == -1)
+			fatal("reader_send");
+	}
+
+	if (imsg_compose(ibuf, IMSG_RECONF_END, 0, 0, -1, NULL, 0) == -1)
+		fatal("reader_send");
+}
@@ -0,0 +1,203 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <event.h>
+#include <imsg.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "natpmpd.h"
+#include "fuzz.h"
+
+/*
+ * Configuration files, as read by parse_config().  The parser only reads
+ * from a file, so each input is written out to the same temporary one
+ * in TMPDIR first, ideally somewhere in memory.  Whatever is parsed is
+ * thrown away again, nothing is checked beyond its being there or not.
+ *
+ * Names are never looked up, whatever the fuzzer comes up with would
+ * otherwise go off to the resolver.  Only numeric addresses are turned
+ * into anything, by a getaddrinfo() of our own that the parser gets in
+ * place of the real one.
+ *
+ * yacc doesn't free the strings of a statement it gives up on, so with
+ * libFuzzer this needs -detect_leaks=0.
+ */
+
+void		 fuzz_init(void);
+void		 fuzz_cleanup(void);
+void		 fuzz_free(struct natpmpd *);
+int		 getaddrinfo(const char *, const char *,
+		    const struct addrinfo *, struct addrinfo **);
+void		 freeaddrinfo(struct addrinfo *);
+
+static char	 path[PATH_MAX];
+static int	 fd = -1;
+
+/* One of everything natpmpd.conf(5) has, and a bit of a mess */
+static const char	 seed_all[] =
+	"interface em0\n"
+	"interface em1\n"
+	"listen on 192.0.2.1\n"
+	"listen on 2001:db8::1\n"
+	"port range 50000:50999\n"
+	"announce unicast rate 500\n"
+	"batch size 32\n"
+	"commit delay 5ms\n"
+	"commit max 256\n"
+	"filter memory delay 20ms busy 10\n"
+	"group rules\n"
+	"keep ruleset\n"
+	"limit mappings 16\n"
+	"limit rate 5 burst 20\n"
+	"log all warning\n"
+	"log requests debug\n"
+	"log buffer 1024\n"
+	"snapshot \"/var/db/natpmpd.state\"\n"
+	"snapshot interval 60\n"
+	"workers 2\n";
+static const char	 seed_bad[] =
+	"# comment\n"
+	"interface em0 \\\n"
+	"listen on 198.51.100.7\n"
+	"port range 2000:1000\n"
+	"filter pf busy 3\n"
+	"log bogus info\n"
+	"limit rate 0\n"
+	"snapshot relative\n"
+	"workers 99999999999999999999\n"
+	"\"unterminated\n";
+
+const struct fuzz_seed	 fuzz_seeds[] = {
+	{ seed_all,	sizeof(seed_all) - 1 },
+	{ seed_bad,	sizeof(seed_bad) - 1 },
+	{ NULL,		0 }
+};
+
+void
+fuzz_init(void)
+{
+	const char	*tmpdir;
+
+	log_init(0);
+	if ((tmpdir = getenv("TMPDIR")) == NULL || *tmpdir == '\0')
+		tmpdir = "/tmp";
+	if ((size_t)snprintf(path, sizeof(path), "%s/fuzz_parse.XXXXXXXXXX",
+	    tmpdir) >= sizeof(path))
+		errx(1, "TMPDIR too long");
+	if ((fd = mkstemp(path)) == -1)
+		err(1, "mkstemp");
+	atexit(fuzz_cleanup);
+}
+
+void
+fuzz_cleanup(void)
+{
+	unlink(path);
+}
+
+/* What reload_config() would have done with it */
+void
+fuzz_free(struct natpmpd *conf)
+{
+	struct listen_addr	*la;
+
+	while ((la = TAILQ_FIRST(&conf->listen_addrs)) != NULL) {
+		TAILQ_REMOVE(&conf->listen_addrs, la, entry);
+		free(la);
+	}
+	free(conf->sc_snapshot);
+	free(conf);
+}
+
+int
+getaddrinfo(const char *host, const char *serv, const struct addrinfo *hints,
+    struct addrinfo **res)
+{
+	struct addrinfo		*ai;
+	struct sockaddr_in	*sin;
+	struct sockaddr_in6	*sin6;
+	int			 family;
+
+	family = (hints != NULL) ? hints->ai_family : PF_UNSPEC;
+	if ((ai = calloc(1, sizeof(*ai) + sizeof(struct sockaddr_storage))) ==
+	    NULL)
+		return (EAI_MEMORY);
+	ai->ai_addr = (struct sockaddr *)(ai + 1);
+	ai->ai_socktype = (hints != NULL) ? hints->ai_socktype : 0;
+
+	sin = (struct sockaddr_in *)ai->ai_addr;
+	sin6 = (struct sockaddr_in6 *)ai->ai_addr;
+	if (family != PF_INET6 && host != NULL &&
+	    inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+		sin->sin_family = AF_INET;
+		ai->ai_addrlen = sizeof(*sin);
+	} else if (family != PF_INET && host != NULL &&
+	    inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+		sin6->sin6_family = AF_INET6;
+		ai->ai_addrlen = sizeof(*sin6);
+	} else {
+		free(ai);
+		return (EAI_NONAME);
+	}
+	ai->ai_family = ai->ai_addr->sa_family;
+
+	*res = ai;
+	return (0);
+}
+
+void
+freeaddrinfo(struct addrinfo *ai)
+{
+	struct addrinfo	*next;
+
+	for (; ai != NULL; ai = next) {
+		next = ai->ai_next;
+		free(ai);
+	}
+}
+
+int
+LLVMFuzzerTestOneInput(const u_int8_t *data, size_t size)
+{
+	struct natpmpd	*conf;
+
+	if (fd == -1)
+		fuzz_init();
+
+	if (ftruncate(fd, 0) == -1 ||
+	    pwrite(fd, data, size, 0) != (ssize_t)size)
+		err(1, "%s", path);
+
+	if ((conf = parse_config(path, 0)) != NULL)
+		fuzz_free(conf);
+
+	return (0);
+}
@@ -0,0 +1,277 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Requests, as read off the socket by natpmp_handler(), handed to the
+ * parent one after another just as it does: decoded, answered, rate
+ * limited, turned into mappings and the responses held back while their
+ * rules are waiting to be committed.  Nothing is ever sent, either to a
+ * client or to the pf process, which is left looking busy throughout.
+ *
+ * An input is a byte of settings followed by any number of requests,
+ * each a two byte length, a byte saying who it came from and when, then
+ * the request itself:
+ *
+ *	settings	0x01 no external address, 0x02 rate limiting,
+ *			0x04 a commit delay
+ *	source		0x80 over IPv6, 0x78 how long since the last one,
+ *			0x07 which of eight hosts
+ *
+ * Everything is put back the way it was after each input.
+ */
+
+int	natpmpd_main(int, char *[]);
+
+#define main	natpmpd_main
+#define usage	natpmpd_usage
+#include "natpmpd.c"
+#undef main
+#undef usage
+
+#include "fuzz.h"
+
+#define FUZZ_TIME		 1000000
+#define FUZZ_PORT_LO		 50000
+#define FUZZ_PORTS		 64
+
+void		 fuzz_init(void);
+void		 fuzz_reset(void);
+
+static struct natpmpd	*env;
+static struct timespec	 now_ts;
+static u_int64_t	 now_msec;
+
+/* A NAT-PMP address request, UDP and TCP mapping requests and PCP */
+static const u_int8_t	 seed_natpmp[] = {
+	0x00,
+	0x00, 0x02, 0x01, 0x00, 0x00,
+	0x00, 0x0c, 0x01, 0x00, 0x01, 0x00, 0x00, 0x04, 0xd2, 0xc3, 0x50,
+	0x00, 0x00, 0x0e, 0x10,
+	0x00, 0x0c, 0x09, 0x00, 0x02, 0x00, 0x00, 0x04, 0xd2, 0x00, 0x00,
+	0x00, 0x00, 0x0e, 0x10,
+	0x00, 0x0c, 0x01, 0x00, 0x01, 0x00, 0x00, 0x04, 0xd2, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00
+};
+static const u_int8_t	 seed_pcp[] = {
+	0x02,
+	/* MAP over IPv4, with PREFER_FAILURE */
+	0x00, 0x40, 0x01, 0x02, 0x01, 0x00, 0x00, 0x00, 0x00, 0x0e, 0x10,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff,
+	0xff, 0x0a, 0x00, 0x00, 0x02, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+	0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x06, 0x00, 0x00, 0x00, 0x04,
+	0xd2, 0xc3, 0x50, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00,
+	0x00,
+	/* PEER over IPv6 */
+	0x00, 0x50, 0x82, 0x02, 0x02, 0x00, 0x00, 0x00, 0x00, 0x0e, 0x10,
+	0x20, 0x01, 0x0d, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x03, 0x0c, 0x0b, 0x0a, 0x09, 0x08, 0x07,
+	0x06, 0x05, 0x04, 0x03, 0x02, 0x01, 0x11, 0x00, 0x00, 0x00, 0x13,
+	0x88, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x35, 0x00,
+	0x00, 0x20, 0x01, 0x0d, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x35,
+	/* ANNOUNCE, then an unsupported version */
+	0x00, 0x18, 0x04, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff,
+	0xff, 0x0a, 0x00, 0x00, 0x05,
+	0x00, 0x02, 0x05, 0x03, 0x00
+};
+
+const struct fuzz_seed	 fuzz_seeds[] = {
+	{ seed_natpmp,	sizeof(seed_natpmp) },
+	{ seed_pcp,	sizeof(seed_pcp) },
+	{ NULL,		0 }
+};
+
+/* Made up time, moved on by each request */
+void
+init_clock(void)
+{
+	now_msec = 0;
+}
+
+const struct timespec *
+clock_update(void)
+{
+	now_ts.tv_sec = now_msec / 1000;
+	now_ts.tv_nsec = (now_msec % 1000) * 1000000;
+
+	return (&now_ts);
+}
+
+time_t
+clock_now(void)
+{
+	return (FUZZ_TIME + now_msec / 1000);
+}
+
+u_int32_t
+clock_msec(void)
+{
+	return (now_msec);
+}
+
+u_int32_t
+sssoe(struct natpmpd *e)
+{
+	return (now_msec / 1000);
+}
+
+/* What natpmpd's main() would have done, for a parent without workers */
+void
+fuzz_init(void)
+{
+	log_init(0);
+	if ((env = calloc(1, sizeof(*env))) == NULL)
+		fatal("fuzz_init");
+
+	TAILQ_INIT(&env->listen_addrs);
+	env->sc_nuplinks = 1;
+	env->sc_uplinks[0].env = env;
+	env->sc_port_lo = FUZZ_PORT_LO;
+	env->sc_port_hi = FUZZ_PORT_LO + FUZZ_PORTS - 1;
+	env->sc_batch = 2;
+	env->sc_commit_max = 4;
+	env->sc_limit_burst = 4;
+	env->sc_limit_mappings = 8;
+	env->sc_limit_lifetime = NATPMPD_LIMIT_LIFETIME;
+
+	init_clock();
+	init_mappings(env);
+	init_limits();
+	init_batch(env);
+
+	event_init();
+	evtimer_set(&env->sc_commit_ev, commit_timeout, env);
+	evtimer_set(&env->sc_expire_ev, expire_mappings, env);
+
+	/* Nothing goes to the pf process, it never gets done */
+	env->sc_pfe_busy = 1;
+}
+
+/* Throw away every mapping and change, as if the batch was committed */
+void
+fuzz_reset(void)
+{
+	struct mapping	*m;
+	u_int		 i;
+
+	for (i = 0; i < nchanges; i++) {
+		m = mapping_by_index(changes[i]);
+		m->flags &= ~MAPPING_F_QUEUED;
+		if (m->flags & MAPPING_F_DEAD)
+			free_mapping(m);
+	}
+	nchanges = 0;
+	ndeferred = 0;
+	env->sc_commit_wanted = 0;
+	if (evtimer_pending(&env->sc_commit_ev, NULL))
+		evtimer_del(&env->sc_commit_ev);
+
+	while ((m = first_mapping()) != NULL) {
+		unlink_mapping(m);
+		free_mapping(m);
+	}
+	init_limits();
+}
+
+int
+LLVMFuzzerTestOneInput(const u_int8_t *data, size_t size)
+{
+	static struct natpmp_slot	 slot;
+	struct sockaddr_in		*sin;
+	struct sockaddr_in6		*sin6;
+	u_int32_t			 gen;
+	size_t				 len;
+	u_int8_t			 settings, source;
+
+	if (env == NULL)
+		fuzz_init();
+	if (size < 1)
+		return (0);
+
+	settings = *data++;
+	size--;
+	env->sc_uplinks[0].address.s_addr = (settings & 0x01) ?
+	    htonl(INADDR_ANY) : htonl(0xc0000201);
+	env->sc_limit_rate = (settings & 0x02) ? 10 : 0;
+	env->sc_commit_delay = (settings & 0x04) ? 10 : 0;
+
+	while (size >= 3) {
+		len = data[0] << 8 | data[1];
+		source = data[2];
+		data += 3;
+		size -= 3;
+		if (len > size)
+			len = size;
+
+		now_msec += ((source >> 3) & 0x0f) * 250;
+		clock_update();
+
+		memset(&slot, 0, sizeof(slot));
+		slot.fd = -1;
+		if (source & 0x80) {
+			sin6 = (struct sockaddr_in6 *)&slot.ss;
+			sin6->sin6_family = AF_INET6;
+			sin6->sin6_addr.s6_addr[0] = 0x20;
+			sin6->sin6_addr.s6_addr[1] = 0x01;
+			sin6->sin6_addr.s6_addr[2] = 0x0d;
+			sin6->sin6_addr.s6_addr[3] = 0xb8;
+			sin6->sin6_addr.s6_addr[15] = 1 + (source & 0x07);
+			sin6->sin6_port = htons(NATPMPD_CLIENT_PORT);
+			slot.slen = sizeof(*sin6);
+		} else {
+			sin = (struct sockaddr_in *)&slot.ss;
+			sin->sin_family = AF_INET;
+			sin->sin_addr.s_addr = htonl(0x0a000001 +
+			    (source & 0x07));
+			sin->sin_port = htons(NATPMPD_CLIENT_PORT);
+			slot.slen = sizeof(*sin);
+		}
+
+		/* Anything longer would have been cut short on the way in */
+		slot.len = (len > sizeof(slot.request)) ?
+		    sizeof(slot.request) : len;
+		memcpy(slot.request, data, slot.len);
+		data += len;
+		size -= len;
+
+		/* As natpmp_handler() does for each request in a batch */
+		gen = changes_gen;
+		slot.rlen = natpmp_request(env, &slot);
+		if (slot.rlen < 0 ||
+		    (size_t)slot.rlen > sizeof(slot.response))
+			abort();
+		if (slot.rlen > 0 && gen != changes_gen) {
+			defer_response(env, &slot);
+			slot.rlen = 0;
+		}
+		if (env->sc_commit_delay > 0 &&
+		    nchanges >= env->sc_commit_max)
+			flush_changes(env);
+		schedule_commit(env);
+
+		expire_mappings(0, 0, env);
+		evtimer_del(&env->sc_expire_ev);
+	}
+
+	fuzz_reset();
+
+	return (0);
+}
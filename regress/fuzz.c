@@ -0,0 +1,177 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fuzz.h"
+
+/*
+ * The main() every harness gets when it isn't linked against libFuzzer,
+ * which brings its own.  Each file named is run through the harness, or
+ * standard input if there are none, which is all AFL needs.  With -n the
+ * seeds are mangled that many times over instead, a byte or a run of
+ * bytes at a time, to give the harness a going over without anything
+ * else installed.
+ */
+
+__dead void	 usage(void);
+size_t		 read_input(int, u_int8_t *);
+size_t		 mangle(u_int8_t *, size_t);
+
+__dead void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s [-n count] [file ...]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static u_int8_t		 buf[FUZZ_MAX_INPUT];
+	const struct fuzz_seed	*s;
+	const char		*errstr;
+	long long		 count = 0, i;
+	size_t			 len;
+	u_int			 nseeds;
+	int			 ch, fd;
+
+	while ((ch = getopt(argc, argv, "n:")) != -1) {
+		switch (ch) {
+		case 'n':
+			count = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "count is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (count > 0) {
+		if (argc > 0)
+			usage();
+		for (nseeds = 0; fuzz_seeds[nseeds].data != NULL; nseeds++)
+			;
+		for (i = 0; i < count; i++) {
+			s = &fuzz_seeds[arc4random_uniform(nseeds)];
+			memcpy(buf, s->data, s->len);
+			len = mangle(buf, s->len);
+			LLVMFuzzerTestOneInput(buf, len);
+		}
+		return (0);
+	}
+
+	if (argc == 0) {
+		len = read_input(STDIN_FILENO, buf);
+		LLVMFuzzerTestOneInput(buf, len);
+		return (0);
+	}
+
+	for (; argc > 0; argc--, argv++) {
+		if ((fd = open(argv[0], O_RDONLY)) == -1)
+			err(1, "%s", argv[0]);
+		len = read_input(fd, buf);
+		close(fd);
+		LLVMFuzzerTestOneInput(buf, len);
+	}
+
+	return (0);
+}
+
+/* Anything past the end of the buffer is ignored */
+size_t
+read_input(int fd, u_int8_t *buf)
+{
+	ssize_t	 n;
+	size_t	 len = 0;
+
+	while (len < FUZZ_MAX_INPUT &&
+	    (n = read(fd, buf + len, FUZZ_MAX_INPUT - len)) != 0) {
+		if (n == -1)
+			err(1, "read");
+		len += n;
+	}
+
+	return (len);
+}
+
+/*
+ * A few random changes: flipped bits, bytes set to something awkward,
+ * runs of bytes cut out or repeated, and the end chopped off.
+ */
+size_t
+mangle(u_int8_t *buf, size_t len)
+{
+	static const u_int8_t	 awkward[] = { 0x00, 0x01, 0x7f, 0x80, 0xff };
+	size_t			 at, n;
+	u_int			 i, changes;
+
+	changes = 1 + arc4random_uniform(8);
+	for (i = 0; i < changes; i++) {
+		at = len ? arc4random_uniform(len) : 0;
+		n = 1 + arc4random_uniform(16);
+		switch (arc4random_uniform(6)) {
+		case 0:
+			if (len > 0)
+				buf[at] ^= 1 << arc4random_uniform(8);
+			break;
+		case 1:
+			if (len > 0)
+				buf[at] = awkward[arc4random_uniform(
+				    sizeof(awkward))];
+			break;
+		case 2:
+			if (len > 0)
+				buf[at] = arc4random_uniform(256);
+			break;
+		case 3:
+			if (n > len - at)
+				n = len - at;
+			memmove(buf + at, buf + at + n, len - at - n);
+			len -= n;
+			break;
+		case 4:
+			if (n > len - at)
+				n = len - at;
+			if (n > FUZZ_MAX_INPUT - len)
+				n = FUZZ_MAX_INPUT - len;
+			memmove(buf + at + n, buf + at, len - at);
+			len += n;
+			break;
+		default:
+			len = at;
+			break;
+		}
+	}
+
+	return (len);
+}
@@ -0,0 +1,35 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _FUZZ_H
+#define _FUZZ_H
+
+/* The largest input the standalone driver reads or makes up */
+#define FUZZ_MAX_INPUT		 65536
+
+/* Somewhere for the driver's made up inputs to start from */
+struct fuzz_seed {
+	const void		*data;
+	size_t			 len;
+};
+
+/* Each harness provides these, the seeds ending with a NULL */
+extern const struct fuzz_seed	 fuzz_seeds[];
+int		 LLVMFuzzerTestOneInput(const u_int8_t *, size_t);
+
+#endif /* _FUZZ_H */
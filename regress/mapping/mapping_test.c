@@ -0,0 +1,815 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Random sequences of mappings being created, renewed, deleted and left
+ * to expire, run through the parent and the pf process both at once.
+ * The two are built in here and joined by a socket pair, as they would
+ * be after the fork, with the in-memory filter standing in for pf, so
+ * changes are queued, batched, committed, retried and freed by the very
+ * same code as in the daemon.  Time is made up, so expiry can be forced.
+ *
+ * Alongside is a plain list of mappings, kept the way natpmpd did before
+ * the mapping table, where every lookup is a walk of the list, anything
+ * expired is found by looking at the lot and the whole ruleset is just
+ * every mapping on it.  Whenever everything has been committed the rules
+ * read back out of the filter have to be exactly those, and each of the
+ * table's mappings has to agree with the list about its external port
+ * and when it expires, and each rule's label has to be late enough for
+ * the mapping to be recovered from it.  Which free port a new mapping
+ * gets is random in both, so the list takes the one the table picked,
+ * once it's checked it's the one that should have been picked or at
+ * least a free one.
+ *
+ * The sequence comes from its own generator, so a seed that fails can be
+ * run again, though the free ports picked along the way won't be the
+ * same.  With -v the daemon logs to stderr, as it does with -d.  With -f
+ * it starts off with a commit that fails for good and checks nothing
+ * more is sent until the backoff after it is over.
+ */
+
+int	natpmpd_main(int, char *[]);
+
+#define main	natpmpd_main
+#define usage	natpmpd_usage
+#include "natpmpd.c"
+#undef main
+#undef usage
+#include "pfe.c"
+
+#include <err.h>
+#include <limits.h>
+
+#define TEST_UPLINKS		 2
+#define TEST_HOSTS		 4
+#define TEST_HOST_PORTS		 8
+#define TEST_PORT_LO		 50000
+#define TEST_PORTS		 24
+#define TEST_TIME		 1000000
+#define TEST_WHEEL		 1024	/* EXPIRE_WHEEL_SIZE in mapping.c */
+#define TEST_LIFETIME		 (8 * TEST_WHEEL)
+
+struct ref_mapping {
+	LIST_ENTRY(ref_mapping)	 entry;
+	u_int8_t		 uplink;
+	u_int8_t		 proto;
+	struct in_addr		 rdr;
+	in_port_t		 rdr_port;
+	struct in_addr		 dst;
+	in_port_t		 dst_port;
+	time_t			 expires;
+	time_t			 label;		/* the least it can have */
+};
+
+/* A rule, reduced to what the ruleset is compared on */
+struct rule {
+	u_int8_t		 uplink;
+	u_int8_t		 proto;
+	u_int32_t		 rdr;
+	u_int16_t		 rdr_port;
+	u_int32_t		 dst;
+	u_int16_t		 dst_port;
+	time_t			 label_lo;	/* the label, or what it */
+	time_t			 label_hi;	/* has to be between */
+};
+
+__dead void	 usage(void);
+u_int32_t	 rnd(u_int32_t);
+struct ref_mapping *ref_lookup(u_int8_t, u_int8_t, struct in_addr,
+		    in_port_t);
+int		 ref_port_free(u_int8_t, u_int8_t, in_port_t);
+u_int		 ref_count(void);
+void		 setup(void);
+void		 pick(u_int8_t *, u_int8_t *, struct in_addr *, in_port_t *);
+void		 do_create(void);
+void		 do_renew(void);
+void		 do_map(void);
+void		 do_delete(void);
+void		 do_expire(void);
+void		 do_backoff(void);
+void		 settle(void);
+void		 collect_rule(struct pfe_change *);
+int		 rule_cmp(const void *, const void *);
+void		 check(void);
+
+static LIST_HEAD(, ref_mapping)	 ref_mappings =
+				    LIST_HEAD_INITIALIZER(ref_mappings);
+static struct natpmpd		*env;
+static struct timespec		 now_ts;
+static time_t			 now;
+static u_int64_t		 rnd_state;
+static u_int64_t		 step;
+static struct rule		*rules_read;
+static u_int			 nrules_read, maxrules_read;
+
+/* Made up time, only moved on by the test */
+void
+init_clock(void)
+{
+	now = TEST_TIME;
+}
+
+const struct timespec *
+clock_update(void)
+{
+	now_ts.tv_sec = now;
+
+	return (&now_ts);
+}
+
+time_t
+clock_now(void)
+{
+	return (now);
+}
+
+u_int32_t
+clock_msec(void)
+{
+	return (now * 1000);
+}
+
+u_int32_t
+sssoe(struct natpmpd *e)
+{
+	return (now - TEST_TIME);
+}
+
+__dead void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s [-fgv] [-b percent] [-d msec] [-n steps] "
+	    "[-s seed]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char	*errstr;
+	u_int64_t	 seed, steps = 20000;
+	u_int8_t	 flags = 0;
+	u_int		 busy = 0, delay = 0, r, until;
+	int		 ch, backoff = 0, verbose = 0;
+
+	seed = arc4random();
+	while ((ch = getopt(argc, argv, "b:d:fgn:s:v")) != -1) {
+		switch (ch) {
+		case 'b':
+			busy = strtonum(optarg, 0, 90, &errstr);
+			if (errstr != NULL)
+				errx(1, "percent is %s: %s", errstr, optarg);
+			break;
+		case 'd':
+			delay = strtonum(optarg, 0, 100, &errstr);
+			if (errstr != NULL)
+				errx(1, "msec is %s: %s", errstr, optarg);
+			break;
+		case 'f':
+			backoff = 1;
+			break;
+		case 'g':
+			flags |= NATPMPD_F_GROUP_RULES;
+			break;
+		case 'n':
+			steps = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "steps is %s: %s", errstr, optarg);
+			break;
+		case 's':
+			seed = strtonum(optarg, 0, UINT_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "seed is %s: %s", errstr, optarg);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 0)
+		usage();
+
+	printf("seed %llu\n", (unsigned long long)seed);
+	rnd_state = seed * 2 + 1;
+
+	/* The daemon's own logging goes to syslog, unless asked for */
+	log_init(verbose);
+	if ((env = calloc(1, sizeof(*env))) == NULL)
+		err(1, NULL);
+	env->sc_flags = flags;
+	env->sc_filter = FILTER_MEMORY;
+	env->sc_filter_busy = busy;
+	env->sc_commit_delay = delay;
+	env->sc_commit_max = 64;
+	env->sc_limit_lifetime = TEST_LIFETIME;
+	setup();
+	if (backoff)
+		do_backoff();
+
+	for (step = 0, until = 0; step < steps; step++) {
+		r = rnd(100);
+		if (r < 40)
+			do_create();
+		else if (r < 60)
+			do_renew();
+		else if (r < 65)
+			do_map();
+		else if (r < 85)
+			do_delete();
+		else
+			do_expire();
+
+		/* Sometimes let a batch go, or come back, in the middle */
+		if (rnd(2))
+			event_loop(EVLOOP_NONBLOCK);
+		if (until-- == 0) {
+			settle();
+			check();
+			until = rnd(20);
+		}
+	}
+	settle();
+	check();
+
+	printf("%llu steps, %u mappings left, %llu commits, "
+	    "%llu transactions, %llu busy retries\n",
+	    (unsigned long long)steps, ref_count(),
+	    (unsigned long long)stats.commits,
+	    (unsigned long long)stats.transactions,
+	    (unsigned long long)stats.busy_retries);
+
+	return (0);
+}
+
+/* xorshift64*, as arc4random can't be made to repeat itself */
+u_int32_t
+rnd(u_int32_t n)
+{
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+
+	return (((rnd_state * 2685821657736338717ULL) >> 32) % n);
+}
+
+struct ref_mapping *
+ref_lookup(u_int8_t uplink, u_int8_t proto, struct in_addr addr,
+    in_port_t port)
+{
+	struct ref_mapping	*r;
+
+	LIST_FOREACH(r, &ref_mappings, entry)
+		if (r->uplink == uplink && r->proto == proto &&
+		    r->rdr.s_addr == addr.s_addr && r->rdr_port == port)
+			return (r);
+
+	return (NULL);
+}
+
+int
+ref_port_free(u_int8_t uplink, u_int8_t proto, in_port_t port)
+{
+	struct ref_mapping	*r;
+
+	if (ntohs(port) < TEST_PORT_LO ||
+	    ntohs(port) >= TEST_PORT_LO + TEST_PORTS)
+		return (0);
+	LIST_FOREACH(r, &ref_mappings, entry)
+		if (r->uplink == uplink && r->proto == proto &&
+		    r->dst_port == port)
+			return (0);
+
+	return (1);
+}
+
+u_int
+ref_count(void)
+{
+	struct ref_mapping	*r;
+	u_int			 count = 0;
+
+	LIST_FOREACH(r, &ref_mappings, entry)
+		count++;
+
+	return (count);
+}
+
+/* What natpmpd's main() and pfe_main() would have done */
+void
+setup(void)
+{
+	struct imsgev	*iev;
+	int		 fds[2];
+	u_int		 i;
+
+	env->sc_nuplinks = TEST_UPLINKS;
+	for (i = 0; i < TEST_UPLINKS; i++) {
+		env->sc_uplinks[i].id = i;
+		env->sc_uplinks[i].address.s_addr = htonl(0xc0000201 + i);
+	}
+	env->sc_port_lo = TEST_PORT_LO;
+	env->sc_port_hi = TEST_PORT_LO + TEST_PORTS - 1;
+
+	init_clock();
+	init_mappings(env);
+	init_limits();
+	init_filter(env, NULL, NULL, 0);
+	group_rules = env->sc_flags & NATPMPD_F_GROUP_RULES;
+	for (i = 0; i < PFE_GROUPS; i++)
+		RB_INIT(&groups[i].rules);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, fds) == -1)
+		err(1, "socketpair");
+	if (fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	event_init();
+
+	if ((iev = calloc(1, sizeof(*iev))) == NULL)
+		err(1, NULL);
+	imsg_init(&iev->ibuf, fds[0]);
+	iev->handler = natpmp_dispatch_pfe;
+	iev->data = env;
+	event_set(&iev->ev, fds[0], EV_READ, natpmp_dispatch_pfe, env);
+	event_add(&iev->ev, NULL);
+	env->sc_iev_pfe = iev;
+
+	evtimer_set(&retry_ev, pfe_commit, NULL);
+	if ((iev_parent = calloc(1, sizeof(*iev_parent))) == NULL)
+		err(1, NULL);
+	imsg_init(&iev_parent->ibuf, fds[1]);
+	iev_parent->handler = pfe_dispatch_parent;
+	iev_parent->data = env;
+	event_set(&iev_parent->ev, fds[1], EV_READ, pfe_dispatch_parent, env);
+	event_add(&iev_parent->ev, NULL);
+
+	evtimer_set(&env->sc_commit_ev, commit_timeout, env);
+	evtimer_set(&env->sc_expire_ev, expire_mappings, env);
+
+	/* Start from an empty anchor, just as the daemon does */
+	rebuild_rules(env);
+	settle();
+}
+
+/* Few enough hosts and ports that they're reused, and collide, a lot */
+void
+pick(u_int8_t *uplink, u_int8_t *proto, struct in_addr *addr,
+    in_port_t *port)
+{
+	*uplink = rnd(TEST_UPLINKS);
+	*proto = rnd(2) ? IPPROTO_TCP : IPPROTO_UDP;
+	addr->s_addr = htonl(0x0a000001 + rnd(TEST_HOSTS));
+	*port = htons(1024 + rnd(TEST_HOST_PORTS));
+}
+
+/*
+ * A new mapping, usually.  The related mapping for the other protocol,
+ * then the preferred port, then any free one.  PCP can insist on exactly
+ * the port it asked for.
+ */
+void
+do_create(void)
+{
+	struct sockaddr_in	 rdr, dst;
+	struct ref_mapping	*r, *o;
+	u_int32_t		 lifetime;
+	in_port_t		 want, expect;
+	u_int8_t		 uplink, proto;
+	int			 exact, ret, any;
+
+	memset(&rdr, 0, sizeof(rdr));
+	memset(&dst, 0, sizeof(dst));
+	pick(&uplink, &proto, &rdr.sin_addr, &rdr.sin_port);
+	dst.sin_addr = env->sc_uplinks[uplink].address;
+	switch (rnd(3)) {
+	case 0:
+		want = 0;
+		break;
+	case 1:
+		want = htons(TEST_PORT_LO + rnd(TEST_PORTS));
+		break;
+	default:
+		/* Out of range sometimes */
+		want = htons(TEST_PORT_LO - 4 + rnd(TEST_PORTS + 8));
+		break;
+	}
+	dst.sin_port = want;
+	exact = (rnd(4) == 0);
+	lifetime = rnd(8) ? 1 + rnd(300) : 1 + rnd(4 * TEST_WHEEL);
+
+	ret = natpmp_create_mapping(uplink, proto, &rdr, &dst, lifetime,
+	    NULL, exact);
+	schedule_commit(env);
+
+	if ((r = ref_lookup(uplink, proto, rdr.sin_addr,
+	    rdr.sin_port)) != NULL) {
+		if (ret != 0 || dst.sin_port != r->dst_port)
+			errx(1, "step %llu: refresh gave %d, port %u, "
+			    "not port %u", (unsigned long long)step, ret,
+			    ntohs(dst.sin_port), ntohs(r->dst_port));
+		r->expires = now + lifetime;
+		r->label = now + lifetime / 2;
+		return;
+	}
+
+	o = ref_lookup(uplink,
+	    (proto == IPPROTO_UDP) ? IPPROTO_TCP : IPPROTO_UDP,
+	    rdr.sin_addr, rdr.sin_port);
+	expect = 0;
+	any = 0;
+	if (!exact && o != NULL && ref_port_free(uplink, proto, o->dst_port))
+		expect = o->dst_port;
+	else if (ref_port_free(uplink, proto, want))
+		expect = want;
+	else if (!exact || want == 0) {
+		for (any = TEST_PORT_LO; any < TEST_PORT_LO + TEST_PORTS;
+		    any++)
+			if (ref_port_free(uplink, proto, htons(any)))
+				break;
+		any = (any < TEST_PORT_LO + TEST_PORTS);
+	}
+
+	if (expect == 0 && !any) {
+		if (ret != -1)
+			errx(1, "step %llu: created a mapping on port %u, "
+			    "none should be free", (unsigned long long)step,
+			    ntohs(dst.sin_port));
+		return;
+	}
+	if (ret != 1)
+		errx(1, "step %llu: failed to create a mapping",
+		    (unsigned long long)step);
+	if (expect != 0 && dst.sin_port != expect)
+		errx(1, "step %llu: mapping got port %u, not port %u",
+		    (unsigned long long)step, ntohs(dst.sin_port),
+		    ntohs(expect));
+	if (!ref_port_free(uplink, proto, dst.sin_port))
+		errx(1, "step %llu: mapping got port %u, which isn't free",
+		    (unsigned long long)step, ntohs(dst.sin_port));
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		err(1, NULL);
+	r->uplink = uplink;
+	r->proto = proto;
+	r->rdr = rdr.sin_addr;
+	r->rdr_port = rdr.sin_port;
+	r->dst = dst.sin_addr;
+	r->dst_port = dst.sin_port;
+	r->expires = now + lifetime;
+	r->label = r->expires;
+	LIST_INSERT_HEAD(&ref_mappings, r, entry);
+}
+
+/* Ask again for a mapping there already is, for however long */
+void
+do_renew(void)
+{
+	struct sockaddr_in	 rdr, dst;
+	struct ref_mapping	*r;
+	u_int32_t		 lifetime;
+	u_int			 i, n;
+	int			 ret;
+
+	if ((n = ref_count()) == 0)
+		return;
+	i = rnd(n);
+	LIST_FOREACH(r, &ref_mappings, entry)
+		if (i-- == 0)
+			break;
+
+	memset(&rdr, 0, sizeof(rdr));
+	memset(&dst, 0, sizeof(dst));
+	rdr.sin_addr = r->rdr;
+	rdr.sin_port = r->rdr_port;
+	dst.sin_addr = r->dst;
+	dst.sin_port = rnd(2) ? r->dst_port : 0;
+	lifetime = 1 + rnd(300);
+
+	ret = natpmp_create_mapping(r->uplink, r->proto, &rdr, &dst,
+	    lifetime, NULL, 0);
+	if (ret != 0 || dst.sin_port != r->dst_port)
+		errx(1, "step %llu: renewal gave %d, port %u, not port %u",
+		    (unsigned long long)step, ret, ntohs(dst.sin_port),
+		    ntohs(r->dst_port));
+	r->expires = now + lifetime;
+	r->label = now + lifetime / 2;
+}
+
+/*
+ * A NAT-PMP request for far longer than is allowed, which must get the
+ * longest lifetime there is and not one that's wrapped round to expire
+ * straight away.  A mapping there already is goes down the renewal fast
+ * path when the external port is given.
+ */
+void
+do_map(void)
+{
+	struct natpmp_slot	 slot;
+	struct natpmp_packet	 request, response;
+	struct sockaddr_in	*client = (struct sockaddr_in *)&slot.ss;
+	struct ref_mapping	*r;
+	u_int8_t		 uplink, proto;
+
+	memset(&slot, 0, sizeof(slot));
+	memset(&request, 0, sizeof(request));
+	memset(&response, 0, sizeof(response));
+	pick(&uplink, &proto, &client->sin_addr, &request.int_port);
+	client->sin_family = AF_INET;
+	slot.uplink = uplink;
+	r = ref_lookup(uplink, proto, client->sin_addr, request.int_port);
+	request.ext_port = (r != NULL && rnd(2)) ? r->dst_port : 0;
+	request.lifetime = UINT32_MAX - rnd(3) * rnd(TEST_LIFETIME);
+
+	natpmp_mapping(env, &slot, proto, &request, &response);
+	schedule_commit(env);
+
+	if (response.result != NATPMPD_SUCCESS) {
+		if (r != NULL)
+			errx(1, "step %llu: renewal refused with %u",
+			    (unsigned long long)step, response.result);
+		return;
+	}
+	if (response.lifetime != TEST_LIFETIME)
+		errx(1, "step %llu: granted %u seconds, not %u",
+		    (unsigned long long)step, response.lifetime,
+		    TEST_LIFETIME);
+
+	if (r != NULL) {
+		if (response.ext_port != r->dst_port)
+			errx(1, "step %llu: renewal gave port %u, not port %u",
+			    (unsigned long long)step, ntohs(response.ext_port),
+			    ntohs(r->dst_port));
+		r->expires = now + TEST_LIFETIME;
+		r->label = now + TEST_LIFETIME / 2;
+		return;
+	}
+	if (!ref_port_free(uplink, proto, response.ext_port))
+		errx(1, "step %llu: mapping got port %u, which isn't free",
+		    (unsigned long long)step, ntohs(response.ext_port));
+
+	if ((r = calloc(1, sizeof(*r))) == NULL)
+		err(1, NULL);
+	r->uplink = uplink;
+	r->proto = proto;
+	r->rdr = client->sin_addr;
+	r->rdr_port = request.int_port;
+	r->dst = env->sc_uplinks[uplink].address;
+	r->dst_port = response.ext_port;
+	r->expires = now + TEST_LIFETIME;
+	r->label = r->expires;
+	LIST_INSERT_HEAD(&ref_mappings, r, entry);
+}
+
+/* One mapping, or every one on the host for the protocol */
+void
+do_delete(void)
+{
+	struct sockaddr_in	 rdr;
+	struct ref_mapping	*r, *next;
+	u_int8_t		 uplink, proto;
+	int			 count, ret;
+
+	memset(&rdr, 0, sizeof(rdr));
+	pick(&uplink, &proto, &rdr.sin_addr, &rdr.sin_port);
+	if (rnd(4) == 0)
+		rdr.sin_port = 0;
+
+	ret = natpmp_remove_mapping(uplink, proto, &rdr);
+	schedule_commit(env);
+
+	count = 0;
+	for (r = LIST_FIRST(&ref_mappings); r != NULL; r = next) {
+		next = LIST_NEXT(r, entry);
+		if (r->uplink == uplink && r->proto == proto &&
+		    r->rdr.s_addr == rdr.sin_addr.s_addr &&
+		    (rdr.sin_port == 0 || r->rdr_port == rdr.sin_port)) {
+			LIST_REMOVE(r, entry);
+			free(r);
+			count++;
+		}
+	}
+	if (ret != count)
+		errx(1, "step %llu: removed %d mappings, not %d",
+		    (unsigned long long)step, ret, count);
+}
+
+/* Move time on, now and then by more than the whole wheel */
+void
+do_expire(void)
+{
+	struct ref_mapping	*r, *next;
+
+	now += rnd(16) ? rnd(10) : rnd(3 * TEST_WHEEL);
+
+	expire_mappings(0, 0, env);
+	evtimer_del(&env->sc_expire_ev);
+
+	for (r = LIST_FIRST(&ref_mappings); r != NULL; r = next) {
+		next = LIST_NEXT(r, entry);
+		if (r->expires <= now) {
+			LIST_REMOVE(r, entry);
+			free(r);
+		}
+	}
+}
+
+/*
+ * Make pf busy for longer than the pf process will wait, then queue a
+ * whole batch of changes and ask for them to be sent, just as a burst
+ * of requests or an uplink changing address would.  Until the backoff
+ * after the failure is over not one transaction may be started.
+ */
+void
+do_backoff(void)
+{
+	u_int64_t	 transactions;
+	u_int		 busy = env->sc_filter_busy, i;
+
+	env->sc_filter_busy = 100;
+	init_filter(env, NULL, NULL, 0);
+	while (nchanges == 0)
+		do_create();
+	while (env->sc_pfe_busy)
+		event_loop(EVLOOP_ONCE);
+	if (env->sc_commit_backoff == 0 ||
+	    !evtimer_pending(&env->sc_commit_ev, NULL))
+		errx(1, "no backoff after a failed commit");
+
+	env->sc_filter_busy = busy;
+	init_filter(env, NULL, NULL, 0);
+	transactions = stats.transactions;
+	for (i = 0; i < 1000 && nchanges < env->sc_commit_max; i++)
+		do_create();
+	if (nchanges < env->sc_commit_max)
+		errx(1, "only %u changes queued", nchanges);
+	flush_changes(env);
+	event_loop(EVLOOP_NONBLOCK);
+	if (env->sc_pfe_busy || stats.transactions != transactions ||
+	    !evtimer_pending(&env->sc_commit_ev, NULL))
+		errx(1, "a batch was sent while backing off");
+
+	settle();
+	check();
+	if (env->sc_commit_backoff != 0)
+		errx(1, "still backing off after a commit");
+}
+
+/* Run both sides until every change has been committed */
+void
+settle(void)
+{
+	for (;;) {
+		if (!env->sc_pfe_busy && nchanges > 0 &&
+		    !evtimer_pending(&env->sc_commit_ev, NULL))
+			flush_changes(env);
+		if (!env->sc_pfe_busy && nchanges == 0 &&
+		    !evtimer_pending(&env->sc_commit_ev, NULL))
+			break;
+		event_loop(EVLOOP_ONCE);
+	}
+}
+
+void
+collect_rule(struct pfe_change *c)
+{
+	struct rule	*r;
+	u_int		 size;
+
+	if (nrules_read == maxrules_read) {
+		size = maxrules_read ? maxrules_read * 2 : 64;
+		if ((r = reallocarray(rules_read, size, sizeof(*r))) == NULL)
+			err(1, NULL);
+		rules_read = r;
+		maxrules_read = size;
+	}
+
+	r = &rules_read[nrules_read++];
+	memset(r, 0, sizeof(*r));
+	r->uplink = c->uplink;
+	r->proto = c->proto;
+	r->rdr = ntohl(c->addr.ma_rdr.s_addr);
+	r->rdr_port = ntohs(c->addr.ma_rdr_port);
+	r->dst = ntohl(c->addr.ma_dst.s_addr);
+	r->dst_port = ntohs(c->addr.ma_dst_port);
+	r->label_lo = r->label_hi = c->expires;
+}
+
+int
+rule_cmp(const void *a, const void *b)
+{
+	const struct rule	*ra = a, *rb = b;
+
+	if (ra->uplink != rb->uplink)
+		return (ra->uplink < rb->uplink ? -1 : 1);
+	if (ra->proto != rb->proto)
+		return (ra->proto < rb->proto ? -1 : 1);
+	if (ra->rdr != rb->rdr)
+		return (ra->rdr < rb->rdr ? -1 : 1);
+	if (ra->rdr_port != rb->rdr_port)
+		return (ra->rdr_port < rb->rdr_port ? -1 : 1);
+	if (ra->dst != rb->dst)
+		return (ra->dst < rb->dst ? -1 : 1);
+	if (ra->dst_port != rb->dst_port)
+		return (ra->dst_port < rb->dst_port ? -1 : 1);
+
+	return (0);
+}
+
+/*
+ * The list's ruleset is the list, the real one is whatever the filter
+ * has loaded.  Sorted, the two have to be the same.
+ */
+void
+check(void)
+{
+	struct ref_mapping	*r;
+	struct pfe_change	 c;
+	struct mapping		*m;
+	struct rule		*expect;
+	u_int			 i, n;
+
+	n = ref_count();
+	if (count_mappings() != n)
+		errx(1, "step %llu: %u mappings, not %u",
+		    (unsigned long long)step, count_mappings(), n);
+
+	if ((expect = calloc(n ? n : 1, sizeof(*expect))) == NULL)
+		err(1, NULL);
+	nrules_read = 0;
+	i = 0;
+	LIST_FOREACH(r, &ref_mappings, entry) {
+		if ((m = lookup_mapping(r->uplink, r->proto, r->rdr,
+		    r->rdr_port)) == NULL)
+			errx(1, "step %llu: mapping for %s:%u missing",
+			    (unsigned long long)step, inet_ntoa(r->rdr),
+			    ntohs(r->rdr_port));
+		if (m->dst_port != r->dst_port || m->expires != r->expires)
+			errx(1, "step %llu: mapping for %s:%u has port %u, "
+			    "expiring at %lld, not port %u at %lld",
+			    (unsigned long long)step, inet_ntoa(r->rdr),
+			    ntohs(r->rdr_port), ntohs(m->dst_port),
+			    (long long)m->expires, ntohs(r->dst_port),
+			    (long long)r->expires);
+
+		/* What the list would have loaded for it */
+		memset(&c, 0, sizeof(c));
+		c.uplink = r->uplink;
+		c.proto = r->proto;
+		c.addr.ma_af = AF_INET;
+		c.addr.ma_rdr = r->rdr;
+		c.addr.ma_rdr_port = r->rdr_port;
+		c.addr.ma_dst = r->dst;
+		c.addr.ma_dst_port = r->dst_port;
+		collect_rule(&c);
+		rules_read[nrules_read - 1].label_lo = r->label;
+		rules_read[nrules_read - 1].label_hi = r->expires;
+	}
+	memcpy(expect, rules_read, n * sizeof(*expect));
+	qsort(expect, n, sizeof(*expect), rule_cmp);
+
+	nrules_read = 0;
+	if (read_anchors(collect_rule) == -1)
+		err(1, "read_anchors");
+	qsort(rules_read, nrules_read, sizeof(*rules_read), rule_cmp);
+
+	if (nrules_read != n)
+		errx(1, "step %llu: %u rules loaded, not %u",
+		    (unsigned long long)step, nrules_read, n);
+	for (i = 0; i < n; i++)
+		if (rule_cmp(&expect[i], &rules_read[i]) != 0)
+			errx(1, "step %llu: rule %u loaded doesn't match",
+			    (unsigned long long)step, i);
+		else if (rules_read[i].label_lo < expect[i].label_lo ||
+		    rules_read[i].label_lo > expect[i].label_hi)
+			errx(1, "step %llu: rule %u labelled %lld, not "
+			    "between %lld and %lld", (unsigned long long)step,
+			    i, (long long)rules_read[i].label_lo,
+			    (long long)expect[i].label_lo,
+			    (long long)expect[i].label_hi);
+
+	free(expect);
+}
@@ -0,0 +1,260 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/endian.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "natpmpd.h"
+
+/*
+ * Snapshot of the mapping table, so that clients keep their mappings
+ * across a restart.  The file is a fixed header followed by an array of
+ * fixed size records, everything in network byte order and naturally
+ * aligned so it can be used straight from a mapping of the file.  The
+ * checksum covers the header, with the checksum itself zeroed, and the
+ * records.
+ *
+ * The file is opened before the chroot and rewritten in place through
+ * that descriptor.  A crash part way through a write leaves a file that
+ * fails the checksum, which just means starting with no mappings.
+ */
+
+#define STATE_MAGIC	 0x4e504d53	/* "NPMS" */
+#define STATE_VERSION	 2
+
+struct state_header {
+	u_int32_t	 magic;
+	u_int32_t	 version;
+	u_int32_t	 count;
+	u_int32_t	 cksum;
+	u_int64_t	 written;
+};
+
+/* An IPv4 mapping's internal then external address, or an IPv6 one */
+struct state_record {
+	u_int8_t	 addr[16];
+	u_int16_t	 rdr_port;
+	u_int16_t	 dst_port;
+	u_int8_t	 family;	/* 4 or 6 */
+	u_int8_t	 proto;
+	u_int8_t	 uplink;
+	u_int8_t	 pad;
+	u_int64_t	 expires;	/* absolute, seconds since the epoch */
+};
+
+u_int32_t	 state_cksum(const void *, size_t, u_int32_t);
+
+static int	 state_fd = -1;
+
+/* FNV-1a */
+u_int32_t
+state_cksum(const void *buf, size_t len, u_int32_t h)
+{
+	const u_int8_t	*p = buf;
+
+	while (len--) {
+		h ^= *p++;
+		h *= 16777619;
+	}
+
+	return (h);
+}
+
+int
+state_open(const char *path)
+{
+	if ((state_fd = open(path, O_RDWR|O_CREAT, 0600)) == -1) {
+		log_warn("state_open: %s", path);
+		return (-1);
+	}
+
+	return (0);
+}
+
+/* For the other processes, which have no use for the file */
+void
+state_close(void)
+{
+	if (state_fd != -1) {
+		close(state_fd);
+		state_fd = -1;
+	}
+}
+
+/*
+ * Load every mapping from the snapshot that restore_mapping() is happy
+ * with, returning how many were loaded.
+ * The mappings are linked but not queued, the ruleset is rebuilt with
+ * all of them at once afterwards.
+ */
+int
+state_load(void)
+{
+	struct stat		 st;
+	struct state_header	 hdr;
+	struct state_record	*r;
+	struct mapping_addr	 ma;
+	void			*p;
+	time_t			 now;
+	u_int32_t		 cksum, count, i;
+	int			 loaded;
+
+	if (state_fd == -1)
+		return (0);
+
+	if (fstat(state_fd, &st) == -1) {
+		log_warn("state_load: fstat");
+		return (-1);
+	}
+	if (st.st_size == 0)
+		return (0);
+	if ((size_t)st.st_size < sizeof(hdr)) {
+		log_warnx("state_load: snapshot truncated, ignoring");
+		return (-1);
+	}
+
+	if ((p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, state_fd,
+	    0)) == MAP_FAILED) {
+		log_warn("state_load: mmap");
+		return (-1);
+	}
+
+	memcpy(&hdr, p, sizeof(hdr));
+	count = ntohl(hdr.count);
+	if (ntohl(hdr.magic) != STATE_MAGIC ||
+	    ntohl(hdr.version) != STATE_VERSION ||
+	    (size_t)st.st_size != sizeof(hdr) + count * sizeof(*r)) {
+		log_warnx("state_load: not a valid snapshot, ignoring");
+		munmap(p, st.st_size);
+		return (-1);
+	}
+
+	cksum = hdr.cksum;
+	hdr.cksum = 0;
+	if (htonl(state_cksum((u_int8_t *)p + sizeof(hdr),
+	    count * sizeof(*r), state_cksum(&hdr, sizeof(hdr),
+	    2166136261U))) != cksum) {
+		log_warnx("state_load: snapshot checksum mismatch, ignoring");
+		munmap(p, st.st_size);
+		return (-1);
+	}
+
+	clock_update();
+	now = clock_now();
+	loaded = 0;
+	r = (struct state_record *)((u_int8_t *)p + sizeof(hdr));
+	for (i = 0; i < count; i++, r++) {
+		memset(&ma, 0, sizeof(ma));
+		switch (r->family) {
+		case 4:
+			ma.ma_af = AF_INET;
+			memcpy(&ma.ma_rdr, &r->addr[0], sizeof(ma.ma_rdr));
+			memcpy(&ma.ma_dst, &r->addr[4], sizeof(ma.ma_dst));
+			break;
+		case 6:
+			ma.ma_af = AF_INET6;
+			memcpy(&ma.ma_addr6, r->addr, sizeof(ma.ma_addr6));
+			break;
+		default:
+			continue;
+		}
+		ma.ma_rdr_port = r->rdr_port;
+		ma.ma_dst_port = r->dst_port;
+
+		loaded += restore_mapping(r->uplink, r->proto, &ma,
+		    betoh64(r->expires), now);
+	}
+
+	munmap(p, st.st_size);
+
+	return (loaded);
+}
+
+/* Rewrite the snapshot with every live mapping */
+int
+state_write(void)
+{
+	struct state_header	*hdr;
+	struct state_record	*r;
+	struct mapping		*m;
+	struct mapping_addr	 ma;
+	u_int8_t		*buf;
+	size_t			 len;
+	u_int32_t		 count;
+	ssize_t			 n;
+
+	if (state_fd == -1)
+		return (0);
+
+	count = count_mappings();
+
+	len = sizeof(*hdr) + count * sizeof(*r);
+	if ((buf = calloc(1, len)) == NULL) {
+		log_warn("state_write");
+		return (-1);
+	}
+
+	hdr = (struct state_header *)buf;
+	r = (struct state_record *)(buf + sizeof(*hdr));
+	for (m = first_mapping(); m != NULL; m = next_mapping(m)) {
+		get_mapping_addr(m, &ma);
+		if (ma.ma_af == AF_INET6) {
+			r->family = 6;
+			memcpy(r->addr, &ma.ma_addr6, sizeof(r->addr));
+		} else {
+			r->family = 4;
+			memcpy(&r->addr[0], &ma.ma_rdr, sizeof(ma.ma_rdr));
+			memcpy(&r->addr[4], &ma.ma_dst, sizeof(ma.ma_dst));
+		}
+		r->rdr_port = ma.ma_rdr_port;
+		r->dst_port = ma.ma_dst_port;
+		r->proto = m->proto;
+		r->uplink = m->uplink;
+		r->expires = htobe64(m->expires);
+		r++;
+	}
+
+	hdr->magic = htonl(STATE_MAGIC);
+	hdr->version = htonl(STATE_VERSION);
+	hdr->count = htonl(count);
+	hdr->written = htobe64(time(NULL));
+	hdr->cksum = htonl(state_cksum(buf, len, 2166136261U));
+
+	if ((n = pwrite(state_fd, buf, len, 0)) == -1 || (size_t)n != len ||
+	    ftruncate(state_fd, len) == -1) {
+		log_warn("state_write");
+		free(buf);
+		return (-1);
+	}
+
+	free(buf);
+
+	return (0);
+}
@@ -0,0 +1,242 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <string.h>
+
+#include "natpmpd.h"
+
+/*
+ * NAT-PMP and PCP messages as they are on the wire, read straight out of
+ * the receive buffer and written straight into the send one.  Every field
+ * is got at by its offset a byte at a time, so neither the alignment of
+ * the buffer nor how the compiler would lay out a struct matter, and the
+ * byte order is spelt out rather than left to ntohl() and friends.
+ * Addresses and ports are copied as they are, in network order, which is
+ * how the rest of the daemon keeps them.
+ *
+ * The lengths in natpmpd.h are checked against the offsets below as this
+ * is compiled.
+ */
+
+#define WIRE_CTASSERT(x)	 extern char wire_ctassert[(x) ? 1 : -1]
+
+#define GET16(p)		 ((u_int16_t)((p)[0] << 8 | (p)[1]))
+#define GET32(p)		 ((u_int32_t)(p)[0] << 24 | (p)[1] << 16 | \
+				    (p)[2] << 8 | (p)[3])
+#define PUT16(p, v) do {						\
+	(p)[0] = (v) >> 8;						\
+	(p)[1] = (v);							\
+} while (0)
+#define PUT32(p, v) do {						\
+	(p)[0] = (v) >> 24;						\
+	(p)[1] = (v) >> 16;						\
+	(p)[2] = (v) >> 8;						\
+	(p)[3] = (v);							\
+} while (0)
+
+/* RFC 6886, requests then responses */
+#define NATPMP_VERSION_OFF	 0
+#define NATPMP_OPCODE_OFF	 1
+#define NATPMP_INT_PORT_OFF	 4
+#define NATPMP_EXT_PORT_OFF	 6
+#define NATPMP_LIFETIME_OFF	 8
+#define NATPMP_RESULT_OFF	 2
+#define NATPMP_SSSOE_OFF	 4
+#define NATPMP_ADDRESS_OFF	 8
+#define NATPMP_R_INT_PORT_OFF	 8
+#define NATPMP_R_EXT_PORT_OFF	 10
+#define NATPMP_R_LIFETIME_OFF	 12
+
+WIRE_CTASSERT(NATPMP_OPCODE_OFF + 1 == NATPMP_HDR_LEN);
+WIRE_CTASSERT(NATPMP_LIFETIME_OFF + 4 == NATPMP_MAP_LEN);
+WIRE_CTASSERT(NATPMP_SSSOE_OFF + 4 == NATPMP_RESPONSE_LEN);
+WIRE_CTASSERT(NATPMP_ADDRESS_OFF + 4 == NATPMP_ADDR_RESPONSE_LEN);
+WIRE_CTASSERT(NATPMP_R_LIFETIME_OFF + 4 == NATPMP_MAP_RESPONSE_LEN);
+
+/* RFC 6887, the common header, then MAP and the start of PEER data */
+#define PCP_VERSION_OFF		 0
+#define PCP_OPCODE_OFF		 1
+#define PCP_RESULT_OFF		 3
+#define PCP_LIFETIME_OFF	 4
+#define PCP_EPOCH_OFF		 8
+#define PCP_CLIENT_OFF		 8
+#define PCP_NONCE_OFF		 0
+#define PCP_PROTO_OFF		 12
+#define PCP_INT_PORT_OFF	 16
+#define PCP_EXT_PORT_OFF	 18
+#define PCP_EXT_ADDR_OFF	 20
+#define PCP_OPT_CODE_OFF	 0
+#define PCP_OPT_LEN_OFF		 2
+
+WIRE_CTASSERT(PCP_CLIENT_OFF + sizeof(struct in6_addr) == PCP_HDR_LEN);
+WIRE_CTASSERT(PCP_NONCE_OFF + PCP_NONCE_LEN == PCP_PROTO_OFF);
+WIRE_CTASSERT(PCP_EXT_ADDR_OFF + sizeof(struct in6_addr) == PCP_MAP_LEN);
+WIRE_CTASSERT(PCP_OPT_LEN_OFF + 2 == PCP_OPT_HDR_LEN);
+WIRE_CTASSERT(PCP_MAP_LEN <= PCP_PEER_LEN);
+
+/* Nothing built here may outgrow a slot */
+WIRE_CTASSERT(NATPMP_MAP_RESPONSE_LEN <= NATPMPD_MAX_PACKET_SIZE);
+WIRE_CTASSERT(PCP_HDR_LEN + PCP_PEER_LEN + PCP_OPT_HDR_LEN <=
+    NATPMPD_MAX_PACKET_SIZE);
+
+/*
+ * A NAT-PMP request.  The version and opcode are always there, the rest
+ * of a mapping request is left zeroed if it's too short to be one.
+ */
+int
+natpmp_decode(const u_int8_t *p, size_t len, struct natpmp_packet *msg)
+{
+	memset(msg, 0, sizeof(*msg));
+	if (len < NATPMP_HDR_LEN)
+		return (-1);
+
+	msg->version = p[NATPMP_VERSION_OFF];
+	msg->opcode = p[NATPMP_OPCODE_OFF];
+	if (len < NATPMP_MAP_LEN)
+		return (0);
+
+	memcpy(&msg->int_port, p + NATPMP_INT_PORT_OFF, sizeof(in_port_t));
+	memcpy(&msg->ext_port, p + NATPMP_EXT_PORT_OFF, sizeof(in_port_t));
+	msg->lifetime = GET32(p + NATPMP_LIFETIME_OFF);
+
+	return (0);
+}
+
+/* A NAT-PMP response, its opcode deciding what follows the header */
+size_t
+natpmp_encode(u_int8_t *p, const struct natpmp_packet *msg)
+{
+	p[NATPMP_VERSION_OFF] = msg->version;
+	p[NATPMP_OPCODE_OFF] = msg->opcode;
+	PUT16(p + NATPMP_RESULT_OFF, msg->result);
+	PUT32(p + NATPMP_SSSOE_OFF, msg->sssoe);
+
+	switch (msg->opcode) {
+	case 0x80:
+		memcpy(p + NATPMP_ADDRESS_OFF, &msg->address,
+		    sizeof(struct in_addr));
+		return (NATPMP_ADDR_RESPONSE_LEN);
+	case 0x81:
+	case 0x82:
+		memcpy(p + NATPMP_R_INT_PORT_OFF, &msg->int_port,
+		    sizeof(in_port_t));
+		memcpy(p + NATPMP_R_EXT_PORT_OFF, &msg->ext_port,
+		    sizeof(in_port_t));
+		PUT32(p + NATPMP_R_LIFETIME_OFF, msg->lifetime);
+		return (NATPMP_MAP_RESPONSE_LEN);
+	default:
+		return (NATPMP_RESPONSE_LEN);
+	}
+}
+
+/* Bring a response built earlier up to date before sending it again */
+void
+natpmp_encode_epoch(u_int8_t *p, u_int32_t sssoe)
+{
+	PUT32(p + NATPMP_SSSOE_OFF, sssoe);
+}
+
+/*
+ * A PCP request header.  As with NAT-PMP, the version and opcode are
+ * always there, -1 means the rest of the header isn't.
+ */
+int
+pcp_decode(const u_int8_t *p, size_t len, struct pcp_packet *msg)
+{
+	memset(msg, 0, sizeof(*msg));
+	if (len < NATPMP_HDR_LEN)
+		return (-1);
+
+	msg->version = p[PCP_VERSION_OFF];
+	msg->opcode = p[PCP_OPCODE_OFF];
+	if (len < PCP_HDR_LEN)
+		return (-1);
+
+	msg->lifetime = GET32(p + PCP_LIFETIME_OFF);
+	memcpy(&msg->client, p + PCP_CLIENT_OFF, sizeof(msg->client));
+
+	return (0);
+}
+
+/* A PCP response header, with the reserved fields zeroed */
+size_t
+pcp_encode(u_int8_t *p, const struct pcp_packet *msg)
+{
+	memset(p, 0, PCP_HDR_LEN);
+	p[PCP_VERSION_OFF] = msg->version;
+	p[PCP_OPCODE_OFF] = msg->opcode;
+	p[PCP_RESULT_OFF] = msg->result;
+	PUT32(p + PCP_LIFETIME_OFF, msg->lifetime);
+	PUT32(p + PCP_EPOCH_OFF, msg->epoch);
+
+	return (PCP_HDR_LEN);
+}
+
+void
+pcp_encode_epoch(u_int8_t *p, u_int32_t epoch)
+{
+	PUT32(p + PCP_EPOCH_OFF, epoch);
+}
+
+/* MAP data, or the start of PEER data, already known to be all there */
+void
+pcp_decode_map(const u_int8_t *p, struct pcp_map *map)
+{
+	memcpy(map->nonce, p + PCP_NONCE_OFF, sizeof(map->nonce));
+	map->proto = p[PCP_PROTO_OFF];
+	memcpy(&map->int_port, p + PCP_INT_PORT_OFF, sizeof(in_port_t));
+	memcpy(&map->ext_port, p + PCP_EXT_PORT_OFF, sizeof(in_port_t));
+	memcpy(&map->ext_addr, p + PCP_EXT_ADDR_OFF, sizeof(map->ext_addr));
+}
+
+void
+pcp_encode_map(u_int8_t *p, const struct pcp_map *map)
+{
+	memset(p, 0, PCP_MAP_LEN);
+	memcpy(p + PCP_NONCE_OFF, map->nonce, sizeof(map->nonce));
+	p[PCP_PROTO_OFF] = map->proto;
+	memcpy(p + PCP_INT_PORT_OFF, &map->int_port, sizeof(in_port_t));
+	memcpy(p + PCP_EXT_PORT_OFF, &map->ext_port, sizeof(in_port_t));
+	memcpy(p + PCP_EXT_ADDR_OFF, &map->ext_addr, sizeof(map->ext_addr));
+}
+
+/*
+ * The option at the start of the len bytes left, returning how far it
+ * goes, padding included, or -1 if it doesn't fit.
+ */
+ssize_t
+pcp_decode_option(const u_int8_t *p, size_t len, struct pcp_option *o)
+{
+	size_t	 olen;
+
+	if (len < PCP_OPT_HDR_LEN)
+		return (-1);
+
+	o->code = p[PCP_OPT_CODE_OFF];
+	o->len = GET16(p + PCP_OPT_LEN_OFF);
+	olen = PCP_OPT_HDR_LEN + ((o->len + 3) & ~3);
+	if (olen > len)
+		return (-1);
+
+	return (olen);
+}
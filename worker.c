@@ -0,0 +1,319 @@
+/*	$Id$ */
+
+/*
+ * Copyright (c) 2010 Matt Dainty <matt@bodgit-n-scarper.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <event.h>
+#include <imsg.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "natpmpd.h"
+
+/*
+ * Optional worker processes.  Each worker owns a share of the listening
+ * sockets, reading, validating and answering requests on them itself.
+ * Only mapping requests are passed up to the parent, which owns the
+ * mapping table and the ruleset, over an imsg channel.  Requests and
+ * responses cross the channel a batch at a time.
+ */
+
+__dead void	 worker_main(struct natpmpd *, u_int, int);
+void		 worker_dispatch_parent(int, short, void *);
+void		 worker_shutdown(int, short, void *);
+void		 worker_listen(struct natpmpd *, struct imsg *);
+void		 worker_unlisten(struct natpmpd *, struct imsg *);
+
+static struct natpmp_slot	*replies;
+
+void
+imsg_event_add(struct imsgev *iev)
+{
+	iev->events = EV_READ;
+	if (iev->ibuf.w.queued)
+		iev->events |= EV_WRITE;
+
+	event_del(&iev->ev);
+	event_set(&iev->ev, iev->ibuf.fd, iev->events, iev->handler, iev->data);
+	event_add(&iev->ev, NULL);
+}
+
+/*
+ * Fork off worker number id, 1 being the first, returning its pid to the
+ * parent with its end of the channel set up in iev.
+ */
+pid_t
+start_worker(struct natpmpd *env, u_int id, struct imsgev *iev)
+{
+	int	 fds[2];
+	pid_t	 pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, fds) == -1)
+		fatal("socketpair");
+
+	switch (pid = fork()) {
+	case -1:
+		fatal("fork");
+		/* NOTREACHED */
+	case 0:
+		close(fds[0]);
+		worker_main(env, id, fds[1]);
+		/* NOTREACHED */
+	default:
+		break;
+	}
+
+	close(fds[1]);
+	imsg_init(&iev->ibuf, fds[0]);
+
+	return (pid);
+}
+
+__dead void
+worker_main(struct natpmpd *env, u_int id, int fd)
+{
+	struct listen_addr	*la;
+	struct event		 ev_sigint, ev_sigterm;
+
+	setproctitle("worker %u", id);
+	env->sc_worker = id;
+
+	/* The parent's sockets aren't ours to read from */
+	TAILQ_FOREACH(la, &env->listen_addrs, entry)
+		if (la->worker != id) {
+			close(la->fd);
+			la->fd = -1;
+		}
+
+	/* Nor are the channels to the pf process and the configuration
+	 * reader, the control socket, the snapshot or the interface socket
+	 */
+	close(env->sc_iev_pfe->ibuf.fd);
+	close(env->sc_iev_reader->ibuf.fd);
+	control_close();
+	state_close();
+	close(env->sc_ifsock);
+
+	if ((replies = calloc(env->sc_batch, sizeof(*replies))) == NULL)
+		fatal("worker_main");
+
+	event_init();
+	log_async(env->sc_log_buffer);
+
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGHUP, SIG_IGN);
+	signal_set(&ev_sigint, SIGINT, worker_shutdown, NULL);
+	signal_set(&ev_sigterm, SIGTERM, worker_shutdown, NULL);
+	signal_add(&ev_sigint, NULL);
+	signal_add(&ev_sigterm, NULL);
+
+	if ((env->sc_iev_parent = calloc(1, sizeof(struct imsgev))) == NULL)
+		fatal("worker_main");
+	imsg_init(&env->sc_iev_parent->ibuf, fd);
+	env->sc_iev_parent->handler = worker_dispatch_parent;
+	env->sc_iev_parent->data = env;
+	event_set(&env->sc_iev_parent->ev, fd, EV_READ,
+	    worker_dispatch_parent, env);
+	event_add(&env->sc_iev_parent->ev, NULL);
+
+	TAILQ_FOREACH(la, &env->listen_addrs, entry) {
+		if (la->worker != id)
+			continue;
+		event_set(&la->ev, la->fd, EV_READ|EV_PERSIST,
+		    natpmp_handler, env);
+		event_add(&la->ev, NULL);
+	}
+
+	event_dispatch();
+
+	exit(0);
+}
+
+void
+worker_shutdown(int sig, short event, void *arg)
+{
+	/* The parent does all of the cleaning up */
+	log_async(0);
+	_exit(0);
+}
+
+/*
+ * Responses from the parent are sent out in runs, one run per listening
+ * socket, keeping the batch order.
+ */
+void
+worker_dispatch_parent(int fd, short event, void *arg)
+{
+	struct natpmpd		*env = (struct natpmpd *)arg;
+	struct imsgev		*iev = env->sc_iev_parent;
+	struct imsgbuf		*ibuf = &iev->ibuf;
+	struct imsg		 imsg;
+	struct natpmp_msg	 msg;
+	struct natpmp_slot	*slot;
+	struct uplink_address	 ua;
+	ssize_t			 n;
+	u_int			 count;
+	int			 lastfd;
+
+	if (event & EV_READ) {
+		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
+			fatal("imsg_read error");
+		if (n == 0) {
+			/* connection closed */
+			log_async(0);
+			_exit(0);
+		}
+	}
+	if (event & EV_WRITE) {
+		if ((n = msgbuf_write(&ibuf->w)) == -1 && errno != EAGAIN)
+			fatal("msgbuf_write");
+		if (n == 0) {
+			/* connection closed */
+			log_async(0);
+			_exit(0);
+		}
+	}
+
+	count = 0;
+	lastfd = -1;
+	for (;;) {
+		if ((n = imsg_get(ibuf, &imsg)) == -1)
+			fatal("worker_dispatch_parent: imsg_get error");
+		if (n == 0)
+			break;
+
+		switch (imsg.hdr.type) {
+		case IMSG_RESPONSE:
+			if (imsg.hdr.len != IMSG_HEADER_SIZE + sizeof(msg))
+				fatalx("worker_dispatch_parent: "
+				    "invalid response");
+			memcpy(&msg, imsg.data, sizeof(msg));
+			if (msg.len > sizeof(msg.data))
+				fatalx("worker_dispatch_parent: "
+				    "invalid response length");
+
+			if (count == env->sc_batch ||
+			    (count > 0 && msg.fd != lastfd)) {
+				natpmp_send(lastfd, replies, count);
+				count = 0;
+			}
+			slot = &replies[count++];
+			memcpy(&slot->ss, &msg.ss, sizeof(slot->ss));
+			slot->slen = msg.slen;
+			slot->rlen = msg.len;
+			memcpy(slot->response, msg.data, msg.len);
+			lastfd = msg.fd;
+			break;
+		case IMSG_ADDRESS:
+			if (imsg.hdr.len != IMSG_HEADER_SIZE + sizeof(ua))
+				fatalx("worker_dispatch_parent: "
+				    "invalid address");
+			memcpy(&ua, imsg.data, sizeof(ua));
+			if (ua.uplink >= env->sc_nuplinks)
+				fatalx("worker_dispatch_parent: "
+				    "invalid uplink");
+			env->sc_uplinks[ua.uplink].address = ua.address;
+			break;
+		case IMSG_LISTEN_ADD:
+			worker_listen(env, &imsg);
+			break;
+		case IMSG_LISTEN_CLOSE:
+			worker_unlisten(env, &imsg);
+			break;
+		case IMSG_LOG_LEVEL:
+			if (imsg.hdr.len != IMSG_HEADER_SIZE +
+			    sizeof(log_level))
+				fatalx("worker_dispatch_parent: "
+				    "invalid log levels");
+			memcpy(log_level, imsg.data, sizeof(log_level));
+			break;
+		case IMSG_STATS:
+			imsg_compose(ibuf, IMSG_STATS, imsg.hdr.peerid, 0, -1,
+			    &stats, sizeof(stats));
+			break;
+		default:
+			log_warnx("worker_dispatch_parent: unexpected "
+			    "imsg %d", imsg.hdr.type);
+			break;
+		}
+		imsg_free(&imsg);
+	}
+
+	if (count > 0)
+		natpmp_send(lastfd, replies, count);
+
+	imsg_event_add(iev);
+}
+
+/* A socket opened by a reload and given to us */
+void
+worker_listen(struct natpmpd *env, struct imsg *imsg)
+{
+	struct listen_addr	*la, nla;
+
+	if (imsg->hdr.len != IMSG_HEADER_SIZE + sizeof(nla) ||
+	    imsg->fd == -1)
+		fatalx("worker_listen: invalid socket");
+	memcpy(&nla, imsg->data, sizeof(nla));
+	if (nla.uplink >= env->sc_nuplinks)
+		fatalx("worker_listen: invalid uplink");
+
+	if ((la = calloc(1, sizeof(*la))) == NULL)
+		fatal("worker_listen");
+	memcpy(&la->sa, &nla.sa, sizeof(la->sa));
+	la->uplink = nla.uplink;
+	la->fd = imsg->fd;
+	la->worker = env->sc_worker;
+	TAILQ_INSERT_TAIL(&env->listen_addrs, la, entry);
+
+	event_set(&la->ev, la->fd, EV_READ|EV_PERSIST, natpmp_handler, env);
+	event_add(&la->ev, NULL);
+}
+
+void
+worker_unlisten(struct natpmpd *env, struct imsg *imsg)
+{
+	struct listen_addr	*la;
+	struct sockaddr_storage	 ss;
+
+	if (imsg->hdr.len != IMSG_HEADER_SIZE + sizeof(ss))
+		fatalx("worker_unlisten: invalid address");
+	memcpy(&ss, imsg->data, sizeof(ss));
+
+	TAILQ_FOREACH(la, &env->listen_addrs, entry)
+		if (la->worker == env->sc_worker &&
+		    la->sa.ss_family == ss.ss_family &&
+		    memcmp(&la->sa, &ss,
+		    SA_LEN((struct sockaddr *)&ss)) == 0)
+			break;
+	if (la == NULL)
+		return;
+
+	event_del(&la->ev);
+	close(la->fd);
+	TAILQ_REMOVE(&env->listen_addrs, la, entry);
+	free(la);
+}